@@ -9,17 +9,387 @@
  * Description: This program reads a C++ file and adds proper comments
  *              according to coding style guidelines. Fixed version with
  *              smart brace tracking and proper I/O detection.
+ *              Can also run non-interactively from a batch spec file.
  */
 
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <algorithm>
+#include <filesystem>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <new>
+#include <sstream>
+#include <cstdint>
+#include <cstdio>
+#include <chrono>
+#include <string_view>
+#include <cerrno>
+#include <climits>
+#include <glob.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <csignal>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
 
 
+#ifdef CG_COUNT_ALLOCATIONS
+/*
+ * Allocation counter
+ * Only built with -DCG_COUNT_ALLOCATIONS. Counts heap allocations per
+ * thread so batch mode can show how many AnnotateSource makes per line;
+ * in steady state with no comments emitted that number should be zero.
+ */
+thread_local size_t g_threadAllocations = 0;
+atomic<size_t> g_annotateAllocations(0);
+atomic<size_t> g_annotateLines(0);
+
+void* operator new(size_t size)
+{
+    g_threadAllocations++;
+    void* memory = malloc(size == 0 ? 1 : size);
+    if (memory == nullptr)
+    {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+void operator delete(void* memory) noexcept
+{
+    free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+    free(memory);
+}
+#endif
+
+
+
+/*
+ * Tracing and counters
+ * Spans around each stage (mapping input, scanning, annotating, waiting
+ * for the user, writing) are recorded when --trace is given and can be
+ * saved as Chrome trace-event JSON. Counters are always kept and shown
+ * by --stats. Building with -DCG_NO_TRACE removes all of it.
+ */
+enum StatCounter
+{
+    STAT_FILES,
+    STAT_LINES,
+    STAT_FUNCTIONS,
+    STAT_IO_SITES,
+    STAT_CONTROL_SITES,
+    STAT_VARIABLE_SITES,
+    STAT_PROMPTS,
+    STAT_BYTES_WRITTEN,
+    STAT_INPUT_WAIT_US,
+    STAT_DOCUMENT_BYTES,
+    STAT_DOCUMENT_PEAK,
+    STAT_COUNT
+};
+
+#ifndef CG_NO_TRACE
+
+struct TraceEvent
+{
+    const char* name;
+    string detail;
+    long long startMicros;
+    long long durationMicros;
+    int threadNumber;
+};
+
+atomic<uint64_t> g_stats[STAT_COUNT];
+atomic<bool> g_traceEnabled(false);
+const chrono::steady_clock::time_point g_programStart = chrono::steady_clock::now();
+mutex g_traceLock;
+vector<TraceEvent> g_traceEvents;
+
+
+
+/*
+ * MicrosSinceStart
+ * This function gives the time since the program started.
+ * Input: None
+ * Return: long long - returns microseconds since start. No side effects.
+ */
+long long MicrosSinceStart()
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - g_programStart).count();
+} // MicrosSinceStart
+
+
+
+/*
+ * TraceThreadNumber
+ * This function gives the calling thread a small number for the trace.
+ * Input: None
+ * Return: int - returns 1 for the first thread that asks, 2 for the
+ *               next, and so on. No side effects.
+ */
+int TraceThreadNumber()
+{
+    static atomic<int> nextNumber(1);
+    thread_local int threadNumber = nextNumber++;
+    return threadNumber;
+} // TraceThreadNumber
+
+
+
+/*
+ * CTraceSpan
+ * Records how long the enclosing block took, as one trace event.
+ * Costs one flag check when tracing is off.
+ */
+class CTraceSpan
+{
+public:
+    CTraceSpan(const char* name, string_view detail = string_view());
+    ~CTraceSpan();
+    CTraceSpan(const CTraceSpan&) = delete;
+    CTraceSpan& operator=(const CTraceSpan&) = delete;
+    
+private:
+    const char* m_name;
+    string m_detail;
+    long long m_startMicros;
+};
+
+
+
+/*
+ * CTraceSpan::CTraceSpan
+ * This constructor starts timing a span if tracing is on.
+ * Input: name [IN] - stage name; must be a string literal
+ *        detail [IN] - extra text such as the file path
+ * Return: None
+ */
+CTraceSpan::CTraceSpan(const char* name, string_view detail)
+{
+    m_name = nullptr;
+    m_startMicros = 0;
+    if (g_traceEnabled.load(memory_order_relaxed))
+    {
+        m_name = name;
+        m_detail = detail;
+        m_startMicros = MicrosSinceStart();
+    }
+} // CTraceSpan::CTraceSpan
+
+
+
+/*
+ * CTraceSpan::~CTraceSpan
+ * This destructor stores the finished span.
+ * Input: None
+ * Return: None
+ */
+CTraceSpan::~CTraceSpan()
+{
+    if (m_name != nullptr)
+    {
+        TraceEvent event = {m_name, m_detail, m_startMicros, MicrosSinceStart() - m_startMicros,
+                            TraceThreadNumber()};
+        lock_guard<mutex> guard(g_traceLock);
+        g_traceEvents.push_back(event);
+    }
+} // CTraceSpan::~CTraceSpan
+
+
+
+/*
+ * JsonEscape
+ * This function makes text safe to put inside a JSON string.
+ * Input: text [IN] - the text to escape
+ * Return: string - returns the escaped text. No side effects.
+ */
+string JsonEscape(string_view text)
+{
+    string escaped;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+            escaped += c;
+        }
+        else if ((unsigned char)c < 0x20)
+        {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+            escaped += code;
+        }
+        else
+        {
+            escaped += c;
+        }
+    }
+    return escaped;
+} // JsonEscape
+
+
+
+/*
+ * WriteChromeTrace
+ * This function saves the recorded spans and final counters in Chrome
+ * trace-event format, for chrome://tracing or Perfetto.
+ * Input: tracePath [IN] - file to write
+ * Return: bool - returns true if the file was written, false otherwise.
+ *                Side effect: writes tracePath.
+ */
+bool WriteChromeTrace(const string& tracePath)
+{
+    static const char* const counterNames[STAT_COUNT] = {
+        "files", "lines", "functions", "io_sites", "control_sites", "variable_sites",
+        "prompts", "bytes_written", "input_wait_us", "document_bytes", "document_peak"
+    };
+    
+    ofstream traceFile(tracePath);
+    if (!traceFile.is_open())
+    {
+        return false;
+    }
+    
+    lock_guard<mutex> guard(g_traceLock);
+    traceFile << "{\"traceEvents\":[\n";
+    for (const TraceEvent& event : g_traceEvents)
+    {
+        traceFile << "{\"name\":\"" << event.name << "\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":"
+                  << event.startMicros << ",\"dur\":" << event.durationMicros
+                  << ",\"pid\":1,\"tid\":" << event.threadNumber;
+        if (!event.detail.empty())
+        {
+            traceFile << ",\"args\":{\"detail\":\"" << JsonEscape(event.detail) << "\"}";
+        }
+        traceFile << "},\n";
+    }
+    traceFile << "{\"name\":\"counters\",\"ph\":\"C\",\"ts\":" << MicrosSinceStart()
+              << ",\"pid\":1,\"args\":{";
+    for (int i = 0; i < STAT_COUNT; i++)
+    {
+        traceFile << (i > 0 ? "," : "") << "\"" << counterNames[i] << "\":" << g_stats[i].load();
+    }
+    traceFile << "}}\n]}\n";
+    return traceFile.good();
+} // WriteChromeTrace
+
+
+
+/*
+ * FormatStatsSummary
+ * This function describes the whole run on one line: what was read and
+ * found, how much was asked and written, and where the time went.
+ * Input: None
+ * Return: string - returns the summary line. No side effects.
+ */
+string FormatStatsSummary()
+{
+    rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    double cpuSeconds = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+                        (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+    
+    char summary[640];
+    snprintf(summary, sizeof(summary),
+             "stats: files=%llu lines=%llu functions=%llu io=%llu control=%llu variables=%llu "
+             "prompts=%llu bytes_written=%llu document_bytes=%llu document_peak=%llu "
+             "input_wait=%.3fs cpu=%.3fs wall=%.3fs",
+             (unsigned long long)g_stats[STAT_FILES], (unsigned long long)g_stats[STAT_LINES],
+             (unsigned long long)g_stats[STAT_FUNCTIONS], (unsigned long long)g_stats[STAT_IO_SITES],
+             (unsigned long long)g_stats[STAT_CONTROL_SITES],
+             (unsigned long long)g_stats[STAT_VARIABLE_SITES],
+             (unsigned long long)g_stats[STAT_PROMPTS], (unsigned long long)g_stats[STAT_BYTES_WRITTEN],
+             (unsigned long long)g_stats[STAT_DOCUMENT_BYTES],
+             (unsigned long long)g_stats[STAT_DOCUMENT_PEAK],
+             g_stats[STAT_INPUT_WAIT_US] / 1e6, cpuSeconds, MicrosSinceStart() / 1e6);
+    return summary;
+} // FormatStatsSummary
+
+
+
+/*
+ * RaiseStat
+ * This function raises a counter that keeps a high-water mark.
+ * Input: counter [IN] - the counter to raise
+ *        value [IN] - the value just seen
+ * Return: void - no return value. Side effect: updates the counter.
+ */
+void RaiseStat(StatCounter counter, uint64_t value)
+{
+    uint64_t current = g_stats[counter].load(memory_order_relaxed);
+    while (current < value &&
+           !g_stats[counter].compare_exchange_weak(current, value, memory_order_relaxed))
+    {
+    }
+} // RaiseStat
+
+#define TRACE_JOIN(a, b) a##b
+#define TRACE_NAME(line) TRACE_JOIN(traceSpan, line)
+#define TRACE_SPAN(...) CTraceSpan TRACE_NAME(__LINE__)(__VA_ARGS__)
+#define COUNT_STAT(counter, amount) g_stats[counter].fetch_add((amount), memory_order_relaxed)
+#define PEAK_STAT(counter, value) RaiseStat((counter), (value))
+
+#else
+
+#define TRACE_SPAN(...)
+#define COUNT_STAT(counter, amount)
+#define PEAK_STAT(counter, value)
+
+#endif
+
+
+
+/*
+ * ReadAnswer
+ * This function reads one answer line from the user. Every prompt goes
+ * through here so prompts and time spent waiting can be counted.
+ * Input: answer [OUT] - receives the line typed, without the newline
+ * Return: bool - returns false at end of input, true otherwise.
+ *                Side effect: reads from standard input.
+ */
+bool ReadAnswer(string& answer)
+{
+#ifndef CG_NO_TRACE
+    TRACE_SPAN("wait for user");
+    long long startMicros = MicrosSinceStart();
+    bool gotLine = (bool)getline(cin, answer);
+    COUNT_STAT(STAT_PROMPTS, 1);
+    COUNT_STAT(STAT_INPUT_WAIT_US, MicrosSinceStart() - startMicros);
+    return gotLine;
+#else
+    return (bool)getline(cin, answer);
+#endif
+} // ReadAnswer
+
+
+
 /*
  * ExpandPath
  * This function expands ~ to home directory path if needed.
@@ -28,7 +398,7 @@ using namespace std;
  * Return: string - returns expanded path with ~ replaced by home directory.
  *                  No side effects.
  */
-string ExpandPath(string fileName)
+string ExpandPath(string_view fileName)
 {
     if (fileName.length() > 0 && fileName[0] == '~')
     {
@@ -37,10 +407,10 @@ string ExpandPath(string fileName)
         if (homeDir != nullptr)
         {
             string homePath = homeDir;
-            return homePath + fileName.substr(1); // Replace ~ with home path
+            return homePath.append(fileName.substr(1)); // Replace ~ with home path
         }
     }
-    return fileName;
+    return string(fileName);
 } // ExpandPath
 
 
@@ -53,7 +423,7 @@ string ExpandPath(string fileName)
  * Return: bool - returns true if file exists and can be opened,
  *                false otherwise. Side effect: shows expanded path.
  */
-bool CheckIfFileExists(string fileName)
+bool CheckIfFileExists(string_view fileName)
 {
     string expandedPath = ExpandPath(fileName);
     cout << "Checking file: " << expandedPath << endl; // Debug info
@@ -88,7 +458,7 @@ string GetValidFilePath()
     while (!isFileFound)
     {
         cout << "Enter your C++ file name or full path: ";
-        getline(cin, filePath);
+        ReadAnswer(filePath);
         
         if (CheckIfFileExists(filePath))
         {
@@ -115,7 +485,7 @@ string GetValidFilePath()
  * Return: string - returns valid parameter mode (IN, OUT, or IN/OUT).
  *                  Side effect: displays prompts to user.
  */
-string GetValidParameterMode(string paramName)
+string GetValidParameterMode(string_view paramName)
 {
     string mode;
     bool validMode = false;
@@ -123,7 +493,7 @@ string GetValidParameterMode(string paramName)
     while (!validMode)
     {
         cout << "Is '" << paramName << "' [IN], [OUT], or [IN/OUT]? ";
-        getline(cin, mode);
+        ReadAnswer(mode);
         
         if (mode == "IN" || mode == "OUT" || mode == "IN/OUT")
         {
@@ -141,446 +511,10587 @@ string GetValidParameterMode(string paramName)
 
 
 /*
- * CreateFileHeader
- * This function writes the standard file header comment block to output.
- * Follows the exact format from coding guidelines sample.
- * Input: outputFile [IN/OUT] - file stream to write header to
- *        fileName [IN] - original filename to include in header
- *        date [IN] - current date string
- *        project [IN] - project name
- *        description [IN] - program description
- * Return: void - no return value. Side effect: writes formatted header
- *                block to the output file stream.
- */
-void CreateFileHeader(ofstream& outputFile, string fileName, string date, 
-                      string project, string description)
-{
-    outputFile << "// ============================================================================" << endl;
-    outputFile << "// file: " << fileName << endl;
-    outputFile << "// ============================================================================" << endl;
-    outputFile << "// Programmer: Lin Aung" << endl;
-    outputFile << "// Date: " << date << endl;
-    outputFile << "// Class: CSCI 123 (\"Intro to Programming Using C++\")" << endl;
-    outputFile << "// Time: MW 11:45am" << endl;
-    outputFile << "// Instructor: Luciano Rodriguez" << endl;
-    outputFile << "// Project: " << project << endl;
-    outputFile << "//" << endl;
-    outputFile << "// Description:" << endl;
-    outputFile << "//      " << description << endl;
-    outputFile << "//" << endl;
-    outputFile << "// ============================================================================" << endl;
-    outputFile << endl;
-} // CreateFileHeader
+ * CMappedFile
+ * Read-only view of a whole input file. Regular files are memory-mapped
+ * so lines can be used in place; anything else (pipes, empty files) is
+ * read into a private buffer.
+ */
+class CMappedFile
+{
+public:
+    CMappedFile();
+    ~CMappedFile();
+    CMappedFile(const CMappedFile&) = delete;
+    CMappedFile& operator=(const CMappedFile&) = delete;
+    
+    bool Open(const string& path, string& errorMessage);
+    const char* Data() const;
+    size_t Size() const;
+    
+private:
+    void* m_mapping;
+    size_t m_size;
+    string m_buffer;
+};
 
 
 
 /*
- * CreateFunctionHeader
- * This function creates a properly formatted function comment header.
- * Follows the exact format from the coding guidelines sample code.
- * Input: outputFile [IN/OUT] - file stream to write comment to
- *        functionName [IN] - name of the function
- *        description [IN] - what the function does
- *        parameters [IN] - parameter descriptions with modes
- *        returnDesc [IN] - description of return value
- * Return: void - no return value. Side effect: writes formatted function
- *                comment block to output file.
+ * CMappedFile::CMappedFile
+ * This constructor makes an empty view.
+ * Input: None
+ * Return: None
  */
-void CreateFunctionHeader(ofstream& outputFile, string functionName, 
-                          string description, string parameters, string returnDesc)
+CMappedFile::CMappedFile()
 {
-    outputFile << endl << endl;
-    outputFile << "// ==== " << functionName << " ";
-    
-    // Add equal signs to reach approximately 80 characters
-    int nameLength = functionName.length();
-    int equalsNeeded = 80 - 9 - nameLength; // 9 for "// ==== " and " "
-    for (int i = 0; i < equalsNeeded; i++)
-    {
-        outputFile << "=";
-    }
-    outputFile << endl;
-    
-    outputFile << "//" << endl;
-    outputFile << "// " << description << endl;
-    outputFile << "//" << endl;
-    
-    if (!parameters.empty())
-    {
-        outputFile << "// Input:" << endl;
-        outputFile << "//      " << parameters << endl;
-        outputFile << "//" << endl;
-    }
-    
-    if (!returnDesc.empty())
-    {
-        outputFile << "// Output:" << endl;
-        outputFile << "//      " << returnDesc << endl;
-        outputFile << "//" << endl;
-    }
-    
-    outputFile << "// ============================================================================" << endl;
-    outputFile << endl;
-} // CreateFunctionHeader
+    m_mapping = nullptr;
+    m_size = 0;
+} // CMappedFile::CMappedFile
 
 
 
 /*
- * IsLikelyFunctionStart
- * This function determines if a line looks like start of a function.
- * Uses better heuristics to avoid false positives.
- * Input: line [IN] - the code line to examine
- * Return: bool - returns true if line appears to be function definition,
- *                false otherwise. No side effects.
+ * CMappedFile::~CMappedFile
+ * This destructor releases the mapping, if any.
+ * Input: None
+ * Return: None
  */
-bool IsLikelyFunctionStart(string line)
+CMappedFile::~CMappedFile()
 {
-    // Must have parentheses and not end with semicolon
-    if (line.find('(') == string::npos || line.find(')') == string::npos)
+    if (m_mapping != nullptr)
     {
-        return false;
+        munmap(m_mapping, m_size);
     }
-    
-    if (line.find(';') != string::npos)
+} // CMappedFile::~CMappedFile
+
+
+
+/*
+ * CMappedFile::Open
+ * This function maps a file, or reads it if it cannot be mapped.
+ * Input: path [IN] - the file to open
+ *        errorMessage [OUT] - receives the reason when opening fails
+ * Return: bool - returns true if the contents are available, false
+ *                otherwise. No side effects.
+ */
+bool CMappedFile::Open(const string& path, string& errorMessage)
+{
+    int fileDescriptor = open(path.c_str(), O_RDONLY);
+    if (fileDescriptor < 0)
     {
+        errorMessage = "Cannot open " + path;
         return false;
     }
     
-    // Exclude control structures (with space after keyword)
-    if (line.find("if (") != string::npos ||
-        line.find("while (") != string::npos ||
-        line.find("for (") != string::npos ||
-        line.find("switch (") != string::npos)
+    struct stat fileInfo;
+    if (fstat(fileDescriptor, &fileInfo) == 0 && S_ISREG(fileInfo.st_mode) && fileInfo.st_size > 0)
     {
-        return false;
+        void* mapping = mmap(nullptr, (size_t)fileInfo.st_size, PROT_READ, MAP_PRIVATE,
+                             fileDescriptor, 0);
+        if (mapping != MAP_FAILED)
+        {
+            madvise(mapping, (size_t)fileInfo.st_size, MADV_SEQUENTIAL);
+            m_mapping = mapping;
+            m_size = (size_t)fileInfo.st_size;
+            close(fileDescriptor);
+            return true;
+        }
     }
     
-    // Exclude I/O statements
-    if (line.find("cout") != string::npos ||
-        line.find("cin") != string::npos)
+    // Not mappable - fall back to reading it all
+    char chunk[65536];
+    ssize_t bytesRead;
+    while ((bytesRead = read(fileDescriptor, chunk, sizeof(chunk))) != 0)
     {
-        return false;
+        if (bytesRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            errorMessage = "Cannot read " + path;
+            close(fileDescriptor);
+            return false;
+        }
+        m_buffer.append(chunk, (size_t)bytesRead);
     }
-    
+    m_size = m_buffer.size();
+    close(fileDescriptor);
     return true;
-} // IsLikelyFunctionStart
+} // CMappedFile::Open
 
 
 
 /*
- * IsIOStatement
- * This function checks if a line contains input/output operations.
- * Looks for cout, cin, printf, scanf, etc.
- * Input: line [IN] - the code line to examine
- * Return: bool - returns true if line contains I/O operations,
- *                false otherwise. No side effects.
+ * CMappedFile::Data
+ * This function gives the start of the file contents.
+ * Input: None
+ * Return: const char* - returns the first byte of the file.
+ *                       No side effects.
  */
-bool IsIOStatement(string line)
+const char* CMappedFile::Data() const
 {
-    return (line.find("cout") != string::npos ||
-            line.find("cin") != string::npos ||
-            line.find("printf") != string::npos ||
-            line.find("scanf") != string::npos ||
-            line.find("getline") != string::npos);
-} // IsIOStatement
+    return (m_mapping != nullptr) ? (const char*)m_mapping : m_buffer.data();
+} // CMappedFile::Data
 
 
 
 /*
- * IsControlStatement
- * This function checks if a line contains control flow statements.
- * Looks for if, while, for, switch, etc.
- * Input: line [IN] - the code line to examine
- * Return: bool - returns true if line contains control statements,
- *                false otherwise. No side effects.
+ * CMappedFile::Size
+ * This function gives the file size in bytes.
+ * Input: None
+ * Return: size_t - returns the number of bytes. No side effects.
  */
-bool IsControlStatement(string line)
+size_t CMappedFile::Size() const
 {
-    return (line.find("if (") != string::npos ||
-            line.find("else if (") != string::npos ||
-            line.find("else") != string::npos ||
-            line.find("while (") != string::npos ||
-            line.find("for (") != string::npos ||
-            line.find("switch (") != string::npos ||
-            line.find("do") != string::npos);
-} // IsControlStatement
+    return m_size;
+} // CMappedFile::Size
 
 
 
 /*
- * main
- * This function is the main program entry point with smart brace tracking.
- * Tracks function depth to only ask about function-level closing braces.
- * Input: None
- * Return: int - returns 0 for successful completion, 1 for file errors.
- *               Side effects: creates output file, displays user interface.
+ * CreateTemporaryFile
+ * This function creates a new, empty file with a unique name, so two
+ * runs writing the same destination never share a temporary file.
+ * Input: pathTemplate [IN] - the name to use, ending in XXXXXX, which
+ *                            is replaced to make it unique
+ *        temporaryPath [OUT] - receives the name of the created file
+ * Return: bool - returns true if the file was created, false otherwise.
+ *                Side effect: creates the file, readable by all.
  */
-int main()
+bool CreateTemporaryFile(const string& pathTemplate, string& temporaryPath)
 {
-    cout << "// ============================================================================" << endl;
-    cout << "// Enhanced C++ Comment Generator" << endl;
-    cout << "// ============================================================================" << endl;
-    cout << endl;
-    
-    // Get and validate input file path
-    string inputFilePath = GetValidFilePath();
-    
-    // Get output filename
-    string outputFileName;
-    cout << "Enter output filename (or press Enter for default): ";
-    getline(cin, outputFileName);
-    
-    if (outputFileName.empty())
+    vector<char> name(pathTemplate.begin(), pathTemplate.end());
+    name.push_back('\0');
+    int descriptor = mkstemp(name.data());
+    if (descriptor < 0)
+    {
+        return false;
+    }
+    temporaryPath = name.data();
+    if (fchmod(descriptor, 0644) != 0 || close(descriptor) != 0)
     {
-        outputFileName = "commented_" + inputFilePath;
+        remove(temporaryPath.c_str());
+        return false;
     }
+    return true;
+} // CreateTemporaryFile
+
+
+
+/*
+ * COutputWriter
+ * Collects output as a list of pieces and writes them with writev in a
+ * few large calls. Unchanged source lines are referenced in place (the
+ * caller keeps that memory alive until Flush); generated comment text is
+ * appended to one growing buffer. Neighbouring pieces of the same kind
+ * are merged, so a run of untouched lines is a single iovec. A writer
+ * made for descriptor -1 writes nothing; with a capture it renders text
+ * into a string. A writer made for QUEUE_ONLY keeps everything queued
+ * until AddQueued moves it onto another writer.
+ */
+const int QUEUE_ONLY = -2;
+
+class COutputWriter
+{
+public:
+    COutputWriter(int fileDescriptor);
+    COutputWriter(const COutputWriter&) = delete;
+    COutputWriter& operator=(const COutputWriter&) = delete;
     
-    // Get header information
-    string currentDate;
-    string projectName;
-    string programDescription;
-    
-    cout << endl << "File header information:" << endl;
-    cout << "Today's date (MM/DD/YYYY): ";
-    getline(cin, currentDate);
+    void AddSource(const char* text, size_t length);
+    void AddText(string_view text);
+    void AddRepeated(char c, size_t count);
+    void AddQueued(COutputWriter& part);
+    void StartCapture(string* capture);
+    void StopCapture();
+    bool Flush();
     
-    cout << "Project name: ";
-    getline(cin, projectName);
+private:
+    struct Piece
+    {
+        const char* source;       // nullptr for generated text
+        size_t generatedOffset;
+        size_t length;
+    };
     
-    cout << "Program description: ";
-    getline(cin, programDescription);
+    void FlushIfFull();
+    void StartGeneratedPiece();
     
-    // Open files
-    ifstream inputFile(inputFilePath);
-    if (!inputFile.is_open())
+    int m_fileDescriptor;
+    bool m_failed;
+    vector<Piece> m_pieces;
+    string m_generated;
+    string* m_capture;            // also receives a copy while set
+};
+
+
+
+/*
+ * COutputWriter::COutputWriter
+ * This constructor sets up a writer for an open file descriptor.
+ * Input: fileDescriptor [IN] - where Flush writes to; -1 or QUEUE_ONLY
+ *                              for a writer that never writes
+ * Return: None
+ */
+COutputWriter::COutputWriter(int fileDescriptor)
+{
+    m_fileDescriptor = fileDescriptor;
+    m_failed = false;
+    m_capture = nullptr;
+} // COutputWriter::COutputWriter
+
+
+
+/*
+ * COutputWriter::AddSource
+ * This function queues a span of source text without copying it.
+ * Input: text [IN] - start of the span; must stay valid until Flush
+ *        length [IN] - number of bytes
+ * Return: void - no return value. Side effect: may flush when full.
+ */
+void COutputWriter::AddSource(const char* text, size_t length)
+{
+    if (length == 0)
     {
-        cout << "Error: Cannot open " << inputFilePath << endl;
-        return 1;
+        return;
     }
-    
-    ofstream outputFile(outputFileName);
-    if (!outputFile.is_open())
+    if (m_capture != nullptr)
     {
-        cout << "Error: Cannot create " << outputFileName << endl;
-        return 1;
+        m_capture->append(text, length);
     }
-    
-    // Create file header
-    CreateFileHeader(outputFile, inputFilePath, currentDate, projectName, programDescription);
-    
-    // Process file line by line with smart brace tracking
-    string currentLine;
-    int braceDepth = 0;
-    bool inFunction = false;
-    string lastFunctionName = "";
-    
-    cout << endl << "Processing your code..." << endl << endl;
-    
-    while (getline(inputFile, currentLine))
+    if (!m_pieces.empty() && m_pieces.back().source != nullptr &&
+        m_pieces.back().source + m_pieces.back().length == text)
     {
-        // Skip existing comments
-        if (currentLine.find("//") == 0 || currentLine.find("/*") == 0)
-        {
-            outputFile << currentLine << endl;
-            continue;
-        }
-        
-        // Count braces to track depth
-        int openBraces = 0;
-        int closeBraces = 0;
-        for (char c : currentLine)
-        {
-            if (c == '{') openBraces++;
-            if (c == '}') closeBraces++;
-        }
+        m_pieces.back().length += length;
+        return;
+    }
+    
+    FlushIfFull();
+    Piece piece = {text, 0, length};
+    m_pieces.push_back(piece);
+} // COutputWriter::AddSource
+
+
+
+/*
+ * COutputWriter::AddText
+ * This function queues generated text, copying it into the buffer.
+ * Input: text [IN] - the text to write
+ * Return: void - no return value. Side effect: may flush when full.
+ */
+void COutputWriter::AddText(string_view text)
+{
+    if (text.empty())
+    {
+        return;
+    }
+    if (m_capture != nullptr)
+    {
+        m_capture->append(text.data(), text.size());
+    }
+    StartGeneratedPiece();
+    m_generated.append(text.data(), text.size());
+    m_pieces.back().length += text.size();
+} // COutputWriter::AddText
+
+
+
+/*
+ * COutputWriter::AddRepeated
+ * This function queues one character repeated, such as a '=' banner.
+ * Input: c [IN] - the character
+ *        count [IN] - how many times to write it
+ * Return: void - no return value. Side effect: may flush when full.
+ */
+void COutputWriter::AddRepeated(char c, size_t count)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    if (m_capture != nullptr)
+    {
+        m_capture->append(count, c);
+    }
+    StartGeneratedPiece();
+    m_generated.append(count, c);
+    m_pieces.back().length += count;
+} // COutputWriter::AddRepeated
+
+
+
+/*
+ * COutputWriter::AddQueued
+ * This function moves everything queued on another writer to the end
+ * of this one, so parts of a file annotated on several threads go out
+ * in order. Source spans are still not copied.
+ * Input: part [IN/OUT] - a QUEUE_ONLY writer; left empty
+ * Return: void - no return value. Side effect: may flush when full.
+ */
+void COutputWriter::AddQueued(COutputWriter& part)
+{
+    for (const Piece& piece : part.m_pieces)
+    {
+        if (piece.source != nullptr)
+        {
+            AddSource(piece.source, piece.length);
+        }
+        else
+        {
+            AddText(string_view(part.m_generated.data() + piece.generatedOffset, piece.length));
+        }
+    }
+    part.m_pieces.clear();
+    part.m_generated.clear();
+} // COutputWriter::AddQueued
+
+
+
+/*
+ * COutputWriter::StartCapture
+ * This function starts copying everything queued into a string, so a
+ * piece of output can be remembered for later runs.
+ * Input: capture [OUT] - receives the copied output until StopCapture
+ * Return: void - no return value. No side effects.
+ */
+void COutputWriter::StartCapture(string* capture)
+{
+    m_capture = capture;
+} // COutputWriter::StartCapture
+
+
+
+/*
+ * COutputWriter::StopCapture
+ * This function stops copying output.
+ * Input: None
+ * Return: void - no return value. No side effects.
+ */
+void COutputWriter::StopCapture()
+{
+    m_capture = nullptr;
+} // COutputWriter::StopCapture
+
+
+
+/*
+ * COutputWriter::FlushIfFull
+ * This function writes out the queue once it holds a full writev batch
+ * or a large amount of generated text, unless the writer is QUEUE_ONLY.
+ * Input: None
+ * Return: void - no return value. Side effect: may write to the file.
+ */
+void COutputWriter::FlushIfFull()
+{
+    if (m_fileDescriptor != QUEUE_ONLY && (m_pieces.size() >= IOV_MAX || m_generated.size() >= (1 << 20)))
+    {
+        Flush();
+    }
+} // COutputWriter::FlushIfFull
+
+
+
+/*
+ * COutputWriter::StartGeneratedPiece
+ * This function makes sure the last queued piece is generated text, so
+ * the caller can append to m_generated and grow that piece.
+ * Input: None
+ * Return: void - no return value. Side effect: may flush when full.
+ */
+void COutputWriter::StartGeneratedPiece()
+{
+    if (m_pieces.empty() || m_pieces.back().source != nullptr)
+    {
+        FlushIfFull();
+        Piece piece = {nullptr, m_generated.size(), 0};
+        m_pieces.push_back(piece);
+    }
+} // COutputWriter::StartGeneratedPiece
+
+
+
+/*
+ * COutputWriter::Flush
+ * This function writes every queued piece, IOV_MAX pieces per writev,
+ * and retries short writes.
+ * Input: None
+ * Return: bool - returns true if everything written so far reached the
+ *                file, false after any write error. Side effect: writes
+ *                to the file and empties the queue.
+ */
+bool COutputWriter::Flush()
+{
+    if (m_fileDescriptor < 0)
+    {
+        m_pieces.clear();
+        m_generated.clear();
+        return true;
+    }
+    
+    size_t pieceIndex = 0;
+    vector<iovec> batch;
+    
+    while (!m_failed && pieceIndex < m_pieces.size())
+    {
+        batch.clear();
+        for (; pieceIndex < m_pieces.size() && batch.size() < IOV_MAX; pieceIndex++)
+        {
+            const Piece& piece = m_pieces[pieceIndex];
+            const char* start = (piece.source != nullptr) ? piece.source
+                                                          : m_generated.data() + piece.generatedOffset;
+            iovec entry = {(void*)start, piece.length};
+            batch.push_back(entry);
+        }
         
-        // Detect function definitions
-        if (IsLikelyFunctionStart(currentLine))
+        // writev may stop early; skip what was written and go again
+        size_t batchStart = 0;
+        while (batchStart < batch.size())
         {
-            cout << "Found function: " << currentLine << endl;
-            
-            string answer;
-            cout << "Add function comment? (y/n): ";
-            getline(cin, answer);
-            
-            string funcName = "";
-            if (answer == "y" || answer == "Y")
+            ssize_t written = writev(m_fileDescriptor, &batch[batchStart], (int)(batch.size() - batchStart));
+            if (written < 0)
             {
-                string funcDesc;
-                string funcParams = "";
-                string funcReturn;
-                
-                cout << "Enter function name: ";
-                getline(cin, funcName);
-                
-                cout << "What does this function do? ";
-                getline(cin, funcDesc);
-                
-                string hasParams;
-                cout << "Does this function have parameters? (y/n): ";
-                getline(cin, hasParams);
-                
-                if (hasParams == "y" || hasParams == "Y")
+                if (errno == EINTR)
                 {
-                    string paramName;
-                    string paramDesc;
-                    
-                    cout << "Enter parameter name: ";
-                    getline(cin, paramName);
-                    
-                    cout << "What does '" << paramName << "' do? ";
-                    getline(cin, paramDesc);
-                    
-                    string paramMode = GetValidParameterMode(paramName);
-                    
-                    funcParams = paramName + " [" + paramMode + "] -- " + paramDesc;
+                    continue;
                 }
-                
-                cout << "What does this function return? (or Enter for void): ";
-                getline(cin, funcReturn);
-                
-                CreateFunctionHeader(outputFile, funcName, funcDesc, funcParams, funcReturn);
+                m_failed = true;
+                break;
             }
-            else
+            COUNT_STAT(STAT_BYTES_WRITTEN, written);
+            size_t remaining = (size_t)written;
+            while (batchStart < batch.size() && remaining >= batch[batchStart].iov_len)
             {
-                // Still need to get function name for end detection
-                cout << "Enter function name for end detection (or Enter to skip): ";
-                getline(cin, funcName);
+                remaining -= batch[batchStart].iov_len;
+                batchStart++;
             }
-            
-            // Remember function name for closing brace detection
-            if (!funcName.empty())
+            if (remaining > 0)
             {
-                lastFunctionName = funcName;
+                batch[batchStart].iov_base = (char*)batch[batchStart].iov_base + remaining;
+                batch[batchStart].iov_len -= remaining;
             }
-            
-            // Mark that we're entering a function
-            inFunction = true;
-            braceDepth = 0; // Will be incremented when we see the opening brace
-            
-            cout << endl;
         }
-        
-        // Detect I/O statements
-        else if (IsIOStatement(currentLine))
+    }
+    
+    m_pieces.clear();
+    m_generated.clear();
+    return !m_failed;
+} // COutputWriter::Flush
+
+
+
+/*
+ * TemplateSlot
+ * The fields a comment template can name in braces, e.g. {name}.
+ * File headers use the first eight, function headers the rest and
+ * {description}.
+ */
+enum TemplateSlot
+{
+    SLOT_FILE,
+    SLOT_DATE,
+    SLOT_PROJECT,
+    SLOT_DESCRIPTION,
+    SLOT_PROGRAMMER,
+    SLOT_CLASS,
+    SLOT_TIME,
+    SLOT_INSTRUCTOR,
+    SLOT_NAME,
+    SLOT_PARAM,
+    SLOT_RETURN,
+    SLOT_COUNT
+};
+
+constexpr const char* TEMPLATE_SLOT_NAMES[SLOT_COUNT] =
+{
+    "file", "date", "project", "description", "programmer", "class", "time", "instructor",
+    "name", "param", "return"
+};
+
+// {rule} fills a line with '=' up to this column
+const size_t COMMENT_RULE_WIDTH = 80;
+
+// Room in a compiled template; the built-in ones use about a quarter
+const size_t TEMPLATE_MAX_PIECES = 64;
+const size_t TEMPLATE_MAX_TEXT = 2048;
+
+
+
+/*
+ * TemplatePiece
+ * One step of a compiled template. Static text between slots is kept
+ * as one piece, already joined across lines, so writing a header is a
+ * few copies into the output.
+ */
+enum TemplatePieceKind
+{
+    PIECE_TEXT,                   // static text
+    PIECE_SLOT,                   // the value of slot
+    PIECE_RULE,                   // '=' up to COMMENT_RULE_WIDTH
+    PIECE_IF,                     // skip covered pieces if a slot in mask is empty
+    PIECE_EACH                    // covered pieces once per line of {param}
+};
+
+struct TemplatePiece
+{
+    TemplatePieceKind kind = PIECE_TEXT;
+    uint8_t slot = 0;
+    uint16_t mask = 0;
+    uint16_t covered = 0;         // pieces after an IF or EACH that it controls
+    uint16_t offset = 0;          // text of a PIECE_TEXT
+    uint16_t length = 0;
+    int16_t column = -1;          // column after a PIECE_TEXT holding a '\n'
+};
+
+
+
+/*
+ * CommentTemplate
+ * A header template compiled by CompileCommentTemplate. It has a fixed
+ * size, so the built-in ones are compiled by the compiler and a spec's
+ * own ones at load, never while writing.
+ */
+struct CommentTemplate
+{
+    TemplatePiece pieces[TEMPLATE_MAX_PIECES] = {};
+    char text[TEMPLATE_MAX_TEXT] = {};
+    uint16_t pieceCount = 0;
+    uint16_t textLength = 0;
+    const char* error = nullptr;  // why compiling failed, nullptr if it did not
+    uint16_t errorLine = 0;       // template line the error is on, 0-based
+};
+
+
+
+/*
+ * FindTemplateSlot
+ * This function looks up a slot by the name written in its braces.
+ * Input: name [IN] - the text between the braces
+ * Return: int - returns the TemplateSlot, or -1 for an unknown name.
+ *               No side effects.
+ */
+constexpr int FindTemplateSlot(string_view name)
+{
+    for (int slot = 0; slot < SLOT_COUNT; slot++)
+    {
+        if (name == TEMPLATE_SLOT_NAMES[slot])
         {
-            cout << "Found I/O statement: " << currentLine << endl;
-            
-            string answer;
-            cout << "Add comment for this I/O? (y/n): ";
-            getline(cin, answer);
-            
-            if (answer == "y" || answer == "Y")
-            {
-                string comment;
-                cout << "What does this I/O do? ";
-                getline(cin, comment);
-                
-                outputFile << "    // " << comment << endl;
-            }
-            cout << endl;
+            return slot;
+        }
+    }
+    return -1;
+} // FindTemplateSlot
+
+
+
+/*
+ * AddTemplatePiece
+ * This function appends a piece to a template being compiled.
+ * Input: compiled [IN/OUT] - the template
+ *        piece [IN] - the piece to add
+ * Return: bool - returns false if the template is full. Side effect:
+ *                sets the error when full.
+ */
+constexpr bool AddTemplatePiece(CommentTemplate& compiled, const TemplatePiece& piece)
+{
+    if (compiled.pieceCount == TEMPLATE_MAX_PIECES)
+    {
+        compiled.error = "template is too long";
+        return false;
+    }
+    compiled.pieces[compiled.pieceCount++] = piece;
+    return true;
+} // AddTemplatePiece
+
+
+
+/*
+ * AddTemplateText
+ * This function appends static text to a template being compiled,
+ * joining it to the previous piece when that is text too.
+ * Input: compiled [IN/OUT] - the template
+ *        text [IN] - the static text
+ *        joinFrom [IN] - first piece the text may be joined to; pieces
+ *                        before it belong to a closed IF or EACH
+ * Return: bool - returns false if the template is full. Side effect:
+ *                sets the error when full.
+ */
+constexpr bool AddTemplateText(CommentTemplate& compiled, string_view text, size_t joinFrom)
+{
+    if (text.empty())
+    {
+        return true;
+    }
+    if (compiled.textLength + text.length() > TEMPLATE_MAX_TEXT)
+    {
+        compiled.error = "template is too long";
+        return false;
+    }
+    if (compiled.pieceCount <= joinFrom || compiled.pieces[compiled.pieceCount - 1].kind != PIECE_TEXT)
+    {
+        TemplatePiece piece;
+        piece.offset = compiled.textLength;
+        if (!AddTemplatePiece(compiled, piece))
+        {
+            return false;
+        }
+    }
+    
+    TemplatePiece& piece = compiled.pieces[compiled.pieceCount - 1];
+    for (char c : text)
+    {
+        compiled.text[compiled.textLength++] = c;
+        piece.length++;
+        if (c == '\n')
+        {
+            piece.column = 0;
+        }
+        else if (piece.column >= 0)
+        {
+            piece.column++;
+        }
+    }
+    return true;
+} // AddTemplateText
+
+
+
+/*
+ * CompileCommentTemplate
+ * This function compiles header template text into pieces. The text is
+ * copied line by line, with these additions:
+ *     {slot}       the slot's value, e.g. {name} or {date}
+ *     {rule}       '=' up to column 80
+ *     {{           a '{'
+ *     {?slot}      at the start of a line: leave the line out when the
+ *                  slot is empty
+ *     {param}      the line is written once per parameter, and left out
+ *                  when there are none
+ * Consecutive lines with the same {?slot} guards share one IF piece.
+ * Input: source [IN] - the template text, one template line per line
+ * Return: CommentTemplate - returns the compiled template; error is set
+ *                           if the text is not a valid template.
+ *                           No side effects.
+ */
+constexpr CommentTemplate CompileCommentTemplate(string_view source)
+{
+    CommentTemplate compiled;
+    const size_t NO_PIECE = TEMPLATE_MAX_PIECES;
+    size_t ifPiece = NO_PIECE;
+    size_t eachPiece = NO_PIECE;
+    uint16_t regionMask = 0;
+    size_t joinFrom = 0;
+    
+    size_t lineStart = 0;
+    for (uint16_t lineNumber = 0; lineStart < source.length(); lineNumber++)
+    {
+        size_t lineEnd = source.find('\n', lineStart);
+        if (lineEnd == string_view::npos)
+        {
+            lineEnd = source.length();
         }
+        string_view line = source.substr(lineStart, lineEnd - lineStart);
+        bool hasLineEnd = (lineEnd < source.length());
+        lineStart = lineEnd + 1;
+        compiled.errorLine = lineNumber;
         
-        // Detect control statements
-        else if (IsControlStatement(currentLine))
+        uint16_t mask = 0;
+        while (line.compare(0, 2, "{?") == 0)
         {
-            cout << "Found control statement: " << currentLine << endl;
-            
-            string answer;
-            cout << "Add comment for this control statement? (y/n): ";
-            getline(cin, answer);
-            
-            if (answer == "y" || answer == "Y")
+            size_t closePos = line.find('}');
+            int slot = (closePos == string_view::npos) ? -1 : FindTemplateSlot(line.substr(2, closePos - 2));
+            if (slot < 0)
             {
-                string comment;
-                cout << "What does this control statement do? ";
-                getline(cin, comment);
-                
-                outputFile << "    // " << comment << endl;
+                compiled.error = "unknown slot in {?...}";
+                return compiled;
             }
-            cout << endl;
+            mask |= (uint16_t)(1 << slot);
+            line = line.substr(closePos + 1);
         }
+        bool repeats = (line.find("{param}") != string_view::npos);
         
-        // Detect variable declarations
-        else if ((currentLine.find("int ") != string::npos ||
-                  currentLine.find("string ") != string::npos ||
-                  currentLine.find("double ") != string::npos ||
-                  currentLine.find("float ") != string::npos ||
-                  currentLine.find("char ") != string::npos ||
-                  currentLine.find("bool ") != string::npos) &&
-                 currentLine.find(';') != string::npos &&
-                 currentLine.find('(') == string::npos)
+        // A line starts a new region unless it has the guards of the
+        // region before it; an EACH region is always one line
+        bool sameRegion = (ifPiece != NO_PIECE && eachPiece == NO_PIECE && !repeats && mask == regionMask);
+        if (!sameRegion)
         {
-            cout << "Found variable: " << currentLine << endl;
-            
-            string answer;
-            cout << "Add variable comment? (y/n): ";
-            getline(cin, answer);
-            
-            if (answer == "y" || answer == "Y")
+            if (ifPiece != NO_PIECE)
             {
-                string varComment;
-                cout << "What is this variable for? ";
-                getline(cin, varComment);
-                
-                outputFile << "    // " << varComment << endl;
+                compiled.pieces[ifPiece].covered = (uint16_t)(compiled.pieceCount - ifPiece - 1);
+                ifPiece = NO_PIECE;
+                joinFrom = compiled.pieceCount;
+            }
+            if (mask != 0)
+            {
+                TemplatePiece piece;
+                piece.kind = PIECE_IF;
+                piece.mask = mask;
+                ifPiece = compiled.pieceCount;
+                regionMask = mask;
+                if (!AddTemplatePiece(compiled, piece))
+                {
+                    return compiled;
+                }
+            }
+            if (repeats)
+            {
+                TemplatePiece piece;
+                piece.kind = PIECE_EACH;
+                eachPiece = compiled.pieceCount;
+                if (!AddTemplatePiece(compiled, piece))
+                {
+                    return compiled;
+                }
             }
-            cout << endl;
         }
         
-        // Update brace depth first
-        braceDepth += openBraces - closeBraces;
-        
-        // Write the original line (but check if we need to add function end comment)
-        if (inFunction && closeBraces > 0 && braceDepth == 0)
+        size_t position = 0;
+        while (position < line.length())
         {
-            // This is the end of a function - check if user wants end comment
-            if (!lastFunctionName.empty())
+            size_t openPos = line.find('{', position);
+            if (openPos == string_view::npos)
             {
-                cout << "End of function '" << lastFunctionName << "' detected: " << currentLine << endl;
-                string answer;
-                cout << "Add function end comment? (y/n): ";
-                getline(cin, answer);
-                
-                if (answer == "y" || answer == "Y")
-                {
-                    // Add comment to the same line as the closing brace
-                    outputFile << currentLine << "  // end of \"" << lastFunctionName << "\"" << endl;
-                    outputFile << endl << endl;
-                }
-                else
+                openPos = line.length();
+            }
+            if (!AddTemplateText(compiled, line.substr(position, openPos - position), joinFrom))
+            {
+                return compiled;
+            }
+            if (openPos == line.length())
+            {
+                break;
+            }
+            if (line.compare(openPos, 2, "{{") == 0)
+            {
+                if (!AddTemplateText(compiled, "{", joinFrom))
                 {
-                    outputFile << currentLine << endl;
+                    return compiled;
                 }
-                cout << endl;
+                position = openPos + 2;
+                continue;
+            }
+            
+            size_t closePos = line.find('}', openPos);
+            if (closePos == string_view::npos)
+            {
+                compiled.error = "'{' without '}'";
+                return compiled;
+            }
+            string_view name = line.substr(openPos + 1, closePos - openPos - 1);
+            TemplatePiece piece;
+            if (name == "rule")
+            {
+                piece.kind = PIECE_RULE;
+            }
+            else if (FindTemplateSlot(name) >= 0)
+            {
+                piece.kind = PIECE_SLOT;
+                piece.slot = (uint8_t)FindTemplateSlot(name);
             }
             else
             {
-                outputFile << currentLine << endl;
+                compiled.error = (name.compare(0, 1, "?") == 0) ? "{?...} must start the line"
+                                                                : "unknown slot";
+                return compiled;
             }
-            inFunction = false;
-            lastFunctionName = "";
+            if (!AddTemplatePiece(compiled, piece))
+            {
+                return compiled;
+            }
+            position = closePos + 1;
         }
-        else
+        if (hasLineEnd && !AddTemplateText(compiled, "\n", joinFrom))
         {
-            // Normal line - just write it
-            outputFile << currentLine << endl;
+            return compiled;
         }
         
-        // If we just entered a function and saw an opening brace, set depth properly
-        if (inFunction && openBraces > 0 && braceDepth == openBraces)
+        if (eachPiece != NO_PIECE)
         {
-            // This handles the case where { is on the same line as function declaration
-            // braceDepth is already set correctly by the += operation above
+            compiled.pieces[eachPiece].covered = (uint16_t)(compiled.pieceCount - eachPiece - 1);
+            eachPiece = NO_PIECE;
+            if (ifPiece != NO_PIECE)
+            {
+                compiled.pieces[ifPiece].covered = (uint16_t)(compiled.pieceCount - ifPiece - 1);
+                ifPiece = NO_PIECE;
+            }
+            joinFrom = compiled.pieceCount;
         }
     }
-    
-    // Close files
-    inputFile.close();
-    outputFile.close();
-    
-    cout << endl << "Done! Commented code saved as: " << outputFileName << endl;
-    cout << "// ============================================================================" << endl;
-    
-    return 0;
+    if (ifPiece != NO_PIECE)
+    {
+        compiled.pieces[ifPiece].covered = (uint16_t)(compiled.pieceCount - ifPiece - 1);
+    }
+    compiled.errorLine = 0;
+    return compiled;
+} // CompileCommentTemplate
+
+
+
+/*
+ * TemplateMarker
+ * This function gives the static text a template starts with, up to its
+ * first slot and without leading blank lines. Text that starts this way
+ * is taken to be a header written with the template.
+ * Input: compiled [IN] - the template
+ * Return: string_view - returns the marker, empty if the template starts
+ *                       with a slot. No side effects.
+ */
+string_view TemplateMarker(const CommentTemplate& compiled)
+{
+    if (compiled.pieceCount == 0 || compiled.pieces[0].kind != PIECE_TEXT)
+    {
+        return string_view();
+    }
+    string_view text(compiled.text + compiled.pieces[0].offset, compiled.pieces[0].length);
+    size_t start = text.find_first_not_of('\n');
+    return (start == string_view::npos) ? string_view() : text.substr(start);
+} // TemplateMarker
+
+
+
+/*
+ * RenderTemplatePieces
+ * This function writes a run of compiled template pieces.
+ * Input: compiled [IN] - the template
+ *        first [IN] - first piece to write
+ *        last [IN] - one past the last piece
+ *        values [IN/OUT] - the slot values; {param} is set to each line
+ *                          in turn and restored
+ *        emptySlots [IN] - bit per slot whose value is empty
+ *        column [IN/OUT] - column the output is at
+ *        output [IN/OUT] - writer the text is queued on
+ * Return: void - no return value. Side effect: queues output.
+ */
+void RenderTemplatePieces(const CommentTemplate& compiled, size_t first, size_t last, string_view* values,
+                          unsigned emptySlots, size_t& column, COutputWriter& output)
+{
+    for (size_t pieceIndex = first; pieceIndex < last; pieceIndex++)
+    {
+        const TemplatePiece& piece = compiled.pieces[pieceIndex];
+        switch (piece.kind)
+        {
+            case PIECE_TEXT:
+                output.AddText(string_view(compiled.text + piece.offset, piece.length));
+                column = (piece.column >= 0) ? (size_t)piece.column : column + piece.length;
+                break;
+            case PIECE_SLOT:
+                output.AddText(values[piece.slot]);
+                column += values[piece.slot].length();
+                break;
+            case PIECE_RULE:
+                if (column < COMMENT_RULE_WIDTH)
+                {
+                    output.AddRepeated('=', COMMENT_RULE_WIDTH - column);
+                    column = COMMENT_RULE_WIDTH;
+                }
+                break;
+            case PIECE_IF:
+                if ((piece.mask & emptySlots) != 0)
+                {
+                    pieceIndex += piece.covered;
+                }
+                break;
+            case PIECE_EACH:
+            {
+                string_view parameters = values[SLOT_PARAM];
+                size_t lineStart = 0;
+                while (!parameters.empty() && lineStart <= parameters.length())
+                {
+                    size_t lineEnd = parameters.find('\n', lineStart);
+                    if (lineEnd == string_view::npos)
+                    {
+                        lineEnd = parameters.length();
+                    }
+                    values[SLOT_PARAM] = parameters.substr(lineStart, lineEnd - lineStart);
+                    RenderTemplatePieces(compiled, pieceIndex + 1, pieceIndex + 1 + piece.covered, values,
+                                         emptySlots, column, output);
+                    lineStart = lineEnd + 1;
+                }
+                values[SLOT_PARAM] = parameters;
+                pieceIndex += piece.covered;
+                break;
+            }
+        }
+    }
+} // RenderTemplatePieces
+
+
+
+/*
+ * RenderCommentTemplate
+ * This function writes a header from a compiled template, starting at
+ * the beginning of a line.
+ * Input: compiled [IN] - the template
+ *        values [IN] - a value for every TemplateSlot
+ *        output [IN/OUT] - writer the header is queued on
+ * Return: void - no return value. Side effect: queues output.
+ */
+void RenderCommentTemplate(const CommentTemplate& compiled, const string_view* values, COutputWriter& output)
+{
+    string_view slotValues[SLOT_COUNT];
+    unsigned emptySlots = 0;
+    for (int slot = 0; slot < SLOT_COUNT; slot++)
+    {
+        slotValues[slot] = values[slot];
+        emptySlots |= values[slot].empty() ? (1u << slot) : 0;
+    }
+    size_t column = 0;
+    RenderTemplatePieces(compiled, 0, compiled.pieceCount, slotValues, emptySlots, column, output);
+} // RenderCommentTemplate
+
+
+
+/*
+ * Built-in comment styles
+ * Compiled by the compiler, so choosing one costs nothing at run time.
+ * "course" is the format of the coding guidelines, "doxygen" uses
+ * @-commands, and "plain" is a block comment in the style of this file.
+ */
+constexpr CommentTemplate COURSE_FILE_TEMPLATE = CompileCommentTemplate(
+    "// ============================================================================\n"
+    "// file: {file}\n"
+    "// ============================================================================\n"
+    "// Programmer: {programmer}\n"
+    "// Date: {date}\n"
+    "// Class: {class}\n"
+    "// Time: {time}\n"
+    "// Instructor: {instructor}\n"
+    "// Project: {project}\n"
+    "//\n"
+    "// Description:\n"
+    "//      {description}\n"
+    "//\n"
+    "// ============================================================================\n"
+    "\n");
+
+constexpr CommentTemplate COURSE_FUNCTION_TEMPLATE = CompileCommentTemplate(
+    "\n"
+    "\n"
+    "// ==== {name} {rule}\n"
+    "//\n"
+    "// {description}\n"
+    "//\n"
+    "{?param}// Input:\n"
+    "//      {param}\n"
+    "{?param}//\n"
+    "{?return}// Output:\n"
+    "{?return}//      {return}\n"
+    "{?return}//\n"
+    "// ============================================================================\n"
+    "\n");
+
+constexpr CommentTemplate DOXYGEN_FILE_TEMPLATE = CompileCommentTemplate(
+    "/**\n"
+    " * @file {file}\n"
+    " * @author {programmer}\n"
+    " * @date {date}\n"
+    "{?project} * @brief {project}\n"
+    "{?description} *\n"
+    "{?description} * {description}\n"
+    " */\n"
+    "\n");
+
+constexpr CommentTemplate DOXYGEN_FUNCTION_TEMPLATE = CompileCommentTemplate(
+    "\n"
+    "\n"
+    "/**\n"
+    " * @brief {description}\n"
+    "{?param} *\n"
+    " * @param {param}\n"
+    "{?return} *\n"
+    "{?return} * @return {return}\n"
+    " */\n");
+
+constexpr CommentTemplate PLAIN_FILE_TEMPLATE = CompileCommentTemplate(
+    "/*\n"
+    " * File: {file}\n"
+    " * Programmer: {programmer}\n"
+    " * Date: {date}\n"
+    "{?project} * Project: {project}\n"
+    "{?description} * Description: {description}\n"
+    " */\n"
+    "\n");
+
+constexpr CommentTemplate PLAIN_FUNCTION_TEMPLATE = CompileCommentTemplate(
+    "\n"
+    "\n"
+    "/*\n"
+    " * {name}\n"
+    " * {description}\n"
+    "{?param} * Input:\n"
+    " *     {param}\n"
+    "{?return} * Return: {return}\n"
+    " */\n"
+    "\n");
+
+static_assert(COURSE_FILE_TEMPLATE.error == nullptr && COURSE_FUNCTION_TEMPLATE.error == nullptr &&
+              DOXYGEN_FILE_TEMPLATE.error == nullptr && DOXYGEN_FUNCTION_TEMPLATE.error == nullptr &&
+              PLAIN_FILE_TEMPLATE.error == nullptr && PLAIN_FUNCTION_TEMPLATE.error == nullptr,
+              "a built-in comment template does not compile");
+
+struct BuiltInCommentStyle
+{
+    const char* name;
+    const CommentTemplate* fileHeader;
+    const CommentTemplate* functionHeader;
+};
+
+const BuiltInCommentStyle BUILT_IN_COMMENT_STYLES[] =
+{
+    {"course", &COURSE_FILE_TEMPLATE, &COURSE_FUNCTION_TEMPLATE},
+    {"doxygen", &DOXYGEN_FILE_TEMPLATE, &DOXYGEN_FUNCTION_TEMPLATE},
+    {"plain", &PLAIN_FILE_TEMPLATE, &PLAIN_FUNCTION_TEMPLATE}
+};
+
+
+
+/*
+ * CommentStyle
+ * How generated headers look: the two templates and the file header
+ * fields that stay the same from file to file.
+ */
+struct CommentStyle
+{
+    CommentTemplate fileHeader = COURSE_FILE_TEMPLATE;
+    CommentTemplate functionHeader = COURSE_FUNCTION_TEMPLATE;
+    string programmer = "Lin Aung";
+    string className = "CSCI 123 (\"Intro to Programming Using C++\")";
+    string time = "MW 11:45am";
+    string instructor = "Luciano Rodriguez";
+};
+
+// Used when no spec chooses a style
+const CommentStyle DEFAULT_COMMENT_STYLE;
+
+
+
+/*
+ * CreateFileHeader
+ * This function writes the file header comment block to output, in the
+ * style's file header template.
+ * Input: output [IN/OUT] - writer to queue the header on
+ *        style [IN] - the header template and the fixed header fields
+ *        fileName [IN] - original filename to include in header
+ *        date [IN] - current date string
+ *        project [IN] - project name
+ *        description [IN] - program description
+ * Return: void - no return value. Side effect: queues formatted header
+ *                block on the output writer.
+ */
+void CreateFileHeader(COutputWriter& output, const CommentStyle& style, string_view fileName,
+                      string_view date, string_view project, string_view description)
+{
+    string_view values[SLOT_COUNT];
+    values[SLOT_FILE] = fileName;
+    values[SLOT_DATE] = date;
+    values[SLOT_PROJECT] = project;
+    values[SLOT_DESCRIPTION] = description;
+    values[SLOT_PROGRAMMER] = style.programmer;
+    values[SLOT_CLASS] = style.className;
+    values[SLOT_TIME] = style.time;
+    values[SLOT_INSTRUCTOR] = style.instructor;
+    RenderCommentTemplate(style.fileHeader, values, output);
+} // CreateFileHeader
+
+
+
+/*
+ * HasFileHeader
+ * This function checks if source already starts with the file header
+ * CreateFileHeader writes, so annotating it again does not add another.
+ * Input: source [IN] - the source code text
+ *        sourceLength [IN] - size of source in bytes
+ *        style [IN] - the style the header would be written in
+ * Return: bool - returns true if the header is there. No side effects.
+ */
+bool HasFileHeader(const char* source, size_t sourceLength, const CommentStyle& style)
+{
+    string_view marker = TemplateMarker(style.fileHeader);
+    return (!marker.empty() && string_view(source, sourceLength).compare(0, marker.length(), marker) == 0);
+} // HasFileHeader
+
+
+
+/*
+ * CreateFunctionHeader
+ * This function creates a function comment header in the style's
+ * function header template.
+ * Input: output [IN/OUT] - writer to queue the comment on
+ *        style [IN] - the header template
+ *        functionName [IN] - name of the function
+ *        description [IN] - what the function does
+ *        parameters [IN] - parameter descriptions with modes, one per line
+ *        returnDesc [IN] - description of return value
+ * Return: void - no return value. Side effect: queues formatted function
+ *                comment block on the output writer.
+ */
+void CreateFunctionHeader(COutputWriter& output, const CommentStyle& style, string_view functionName,
+                          string_view description, string_view parameters, string_view returnDesc)
+{
+    string_view values[SLOT_COUNT];
+    values[SLOT_NAME] = functionName;
+    values[SLOT_DESCRIPTION] = description;
+    values[SLOT_PARAM] = parameters;
+    values[SLOT_RETURN] = returnDesc;
+    RenderCommentTemplate(style.functionHeader, values, output);
+} // CreateFunctionHeader
+
+
+
+/*
+ * LineFeature
+ * Bits returned by ClassifyLine. Keywords only count as whole words,
+ * so "do" in "double" or "cin" in "principal" is not a hit. The
+ * if/while/for/switch bits also need a '(' after the keyword.
+ */
+enum LineFeature
+{
+    LINE_OPEN_PAREN  = 1 << 0,
+    LINE_CLOSE_PAREN = 1 << 1,
+    LINE_SEMICOLON   = 1 << 2,
+    LINE_IF          = 1 << 3,
+    LINE_ELSE        = 1 << 4,
+    LINE_WHILE       = 1 << 5,
+    LINE_FOR         = 1 << 6,
+    LINE_SWITCH      = 1 << 7,
+    LINE_DO          = 1 << 8,
+    LINE_COUT        = 1 << 9,
+    LINE_CIN         = 1 << 10,
+    LINE_PRINTF      = 1 << 11,
+    LINE_SCANF       = 1 << 12,
+    LINE_GETLINE     = 1 << 13,
+    LINE_BASIC_TYPE  = 1 << 14,   // int, string, double, float, char, bool
+    LINE_FUNCTION_DEFINITION = 1 << 15,   // set from the scope tree, not by ClassifyLine
+    
+    LINE_PAREN_CONTROL = LINE_IF | LINE_WHILE | LINE_FOR | LINE_SWITCH,
+    LINE_CONTROL = LINE_PAREN_CONTROL | LINE_ELSE | LINE_DO,
+    LINE_IO = LINE_COUT | LINE_CIN | LINE_PRINTF | LINE_SCANF | LINE_GETLINE
+};
+
+
+
+/*
+ * LineKeyword
+ * One keyword the classifier knows, with the feature bit it sets.
+ */
+struct LineKeyword
+{
+    const char* text;
+    size_t length;
+    unsigned feature;
+};
+
+
+
+/*
+ * FindLineKeyword
+ * This function looks up one identifier in the keyword table. The table
+ * is bucketed by word length so most words are rejected with a switch
+ * and at most a few compares.
+ * Input: word [IN] - start of the identifier
+ *        length [IN] - length of the identifier
+ * Return: unsigned - returns the feature bit for the keyword, or 0 if
+ *                    the word is not a keyword. No side effects.
+ */
+unsigned FindLineKeyword(const char* word, size_t length)
+{
+    static const LineKeyword twoLetters[] = {
+        {"if", 2, LINE_IF}, {"do", 2, LINE_DO}
+    };
+    static const LineKeyword threeLetters[] = {
+        {"for", 3, LINE_FOR}, {"cin", 3, LINE_CIN}, {"int", 3, LINE_BASIC_TYPE}
+    };
+    static const LineKeyword fourLetters[] = {
+        {"else", 4, LINE_ELSE}, {"cout", 4, LINE_COUT}, {"char", 4, LINE_BASIC_TYPE},
+        {"bool", 4, LINE_BASIC_TYPE}
+    };
+    static const LineKeyword fiveLetters[] = {
+        {"while", 5, LINE_WHILE}, {"scanf", 5, LINE_SCANF}, {"float", 5, LINE_BASIC_TYPE}
+    };
+    static const LineKeyword sixLetters[] = {
+        {"switch", 6, LINE_SWITCH}, {"printf", 6, LINE_PRINTF}, {"fscanf", 6, LINE_SCANF},
+        {"string", 6, LINE_BASIC_TYPE}, {"double", 6, LINE_BASIC_TYPE}
+    };
+    static const LineKeyword sevenLetters[] = {
+        {"fprintf", 7, LINE_PRINTF}, {"getline", 7, LINE_GETLINE}
+    };
+    
+    const LineKeyword* bucket = nullptr;
+    size_t bucketSize = 0;
+    switch (length)
+    {
+        case 2: bucket = twoLetters; bucketSize = sizeof(twoLetters) / sizeof(LineKeyword); break;
+        case 3: bucket = threeLetters; bucketSize = sizeof(threeLetters) / sizeof(LineKeyword); break;
+        case 4: bucket = fourLetters; bucketSize = sizeof(fourLetters) / sizeof(LineKeyword); break;
+        case 5: bucket = fiveLetters; bucketSize = sizeof(fiveLetters) / sizeof(LineKeyword); break;
+        case 6: bucket = sixLetters; bucketSize = sizeof(sixLetters) / sizeof(LineKeyword); break;
+        case 7: bucket = sevenLetters; bucketSize = sizeof(sevenLetters) / sizeof(LineKeyword); break;
+        default: return 0;
+    }
+    
+    for (size_t i = 0; i < bucketSize; i++)
+    {
+        if (bucket[i].text[0] == word[0] && memcmp(bucket[i].text, word, length) == 0)
+        {
+            return bucket[i].feature;
+        }
+    }
+    return 0;
+} // FindLineKeyword
+
+
+
+/*
+ * IsIdentifierChar
+ * This function checks if a character can be part of a C++ identifier.
+ * Input: c [IN] - the character to check
+ * Return: bool - returns true for letters, digits and '_', false
+ *                otherwise. No side effects.
+ */
+inline bool IsIdentifierChar(char c)
+{
+    return isalnum((unsigned char)c) || c == '_';
+} // IsIdentifierChar
+
+
+
+/*
+ * ClassifyLine
+ * This function finds every keyword and punctuation feature of a line
+ * in a single pass. Identifiers are cut at word boundaries and looked up
+ * once each, instead of searching the line again for every keyword.
+ * Input: line [IN] - the code line to examine
+ * Return: unsigned - returns a bitmask of LineFeature values.
+ *                    No side effects.
+ */
+unsigned ClassifyLine(string_view line)
+{
+    unsigned features = 0;
+    size_t length = line.length();
+    const char* text = line.data();
+    size_t i = 0;
+    
+    while (i < length)
+    {
+        char c = text[i];
+        if (IsIdentifierChar(c))
+        {
+            // Take the whole word; words starting with a digit are numbers
+            size_t wordStart = i;
+            while (i < length && IsIdentifierChar(text[i]))
+            {
+                i++;
+            }
+            if (isdigit((unsigned char)c))
+            {
+                continue;
+            }
+            
+            unsigned keyword = FindLineKeyword(text + wordStart, i - wordStart);
+            if (keyword & LINE_PAREN_CONTROL)
+            {
+                // if/while/for/switch only count when followed by '('
+                size_t next = i;
+                while (next < length && (text[next] == ' ' || text[next] == '\t'))
+                {
+                    next++;
+                }
+                if (next >= length || text[next] != '(')
+                {
+                    keyword = 0;
+                }
+            }
+            features |= keyword;
+            continue;
+        }
+        
+        if (c == '(') features |= LINE_OPEN_PAREN;
+        else if (c == ')') features |= LINE_CLOSE_PAREN;
+        else if (c == ';') features |= LINE_SEMICOLON;
+        i++;
+    }
+    
+    return features;
+} // ClassifyLine
+
+
+
+/*
+ * IsLikelyFunctionStart
+ * This function determines if a line looks like start of a function.
+ * Uses better heuristics to avoid false positives.
+ * Input: lineFeatures [IN] - ClassifyLine result for the code line
+ * Return: bool - returns true if line appears to be function definition,
+ *                false otherwise. No side effects.
+ */
+bool IsLikelyFunctionStart(unsigned lineFeatures)
+{
+    // Must have parentheses and not end with semicolon
+    if (!(lineFeatures & LINE_OPEN_PAREN) || !(lineFeatures & LINE_CLOSE_PAREN))
+    {
+        return false;
+    }
+    
+    if (lineFeatures & LINE_SEMICOLON)
+    {
+        return false;
+    }
+    
+    // Exclude control structures and I/O statements
+    return !(lineFeatures & (LINE_PAREN_CONTROL | LINE_IO));
+} // IsLikelyFunctionStart
+
+
+
+/*
+ * IsFunctionDefinition
+ * This function checks if a line holds the name of a function whose
+ * body follows, as the scope tree found it.
+ * Input: lineFeatures [IN] - features recorded for the code line
+ * Return: bool - returns true for a function definition line, false
+ *                otherwise. No side effects.
+ */
+bool IsFunctionDefinition(unsigned lineFeatures)
+{
+    return (lineFeatures & LINE_FUNCTION_DEFINITION) != 0;
+} // IsFunctionDefinition
+
+
+
+/*
+ * IsIOStatement
+ * This function checks if a line contains input/output operations.
+ * Looks for cout, cin, printf, scanf, etc.
+ * Input: lineFeatures [IN] - ClassifyLine result for the code line
+ * Return: bool - returns true if line contains I/O operations,
+ *                false otherwise. No side effects.
+ */
+bool IsIOStatement(unsigned lineFeatures)
+{
+    return (lineFeatures & LINE_IO) != 0;
+} // IsIOStatement
+
+
+
+/*
+ * IsControlStatement
+ * This function checks if a line contains control flow statements.
+ * Looks for if, while, for, switch, etc.
+ * Input: lineFeatures [IN] - ClassifyLine result for the code line
+ * Return: bool - returns true if line contains control statements,
+ *                false otherwise. No side effects.
+ */
+bool IsControlStatement(unsigned lineFeatures)
+{
+    return (lineFeatures & LINE_CONTROL) != 0;
+} // IsControlStatement
+
+
+
+/*
+ * IsVariableDeclaration
+ * This function checks if a line declares a variable of a basic type.
+ * Looks for a type keyword and a semicolon but no function call.
+ * Input: lineFeatures [IN] - ClassifyLine result for the code line
+ * Return: bool - returns true if line looks like a variable declaration,
+ *                false otherwise. No side effects.
+ */
+bool IsVariableDeclaration(unsigned lineFeatures)
+{
+    return ((lineFeatures & LINE_BASIC_TYPE) &&
+            (lineFeatures & LINE_SEMICOLON) &&
+            !(lineFeatures & LINE_OPEN_PAREN));
+} // IsVariableDeclaration
+
+
+
+/*
+ * CArena
+ * A bump allocator for everything that lives exactly as long as one
+ * file: allocating is a pointer bump, nothing is freed on its own, and
+ * Reset makes the whole arena free again for the next file. Blocks are
+ * kept across resets, so a batch run settles on a few blocks per thread
+ * instead of churning the heap.
+ */
+class CArena
+{
+public:
+    CArena();
+    CArena(const CArena&) = delete;
+    CArena& operator=(const CArena&) = delete;
+    ~CArena();
+    
+    void* Allocate(size_t size, size_t alignment);
+    string_view CopyText(string_view text);
+    void Reset();
+    size_t BytesUsed() const;
+    size_t BytesReserved() const;
+    
+private:
+    struct Block
+    {
+        char* data;
+        size_t size;
+    };
+    
+    vector<Block> m_blocks;
+    size_t m_blockIndex;          // block allocations come from
+    size_t m_offset;              // first free byte in that block
+    size_t m_bytesUsed;           // since the last Reset
+};
+
+// Size of the first block; later ones double, up to a request's size
+const size_t ARENA_BLOCK_SIZE = 64 * 1024;
+
+
+
+/*
+ * CArena::CArena
+ * This function creates an empty arena. No memory is taken until the
+ * first allocation.
+ * Input: None
+ * Return: none - constructor. No side effects.
+ */
+CArena::CArena()
+    : m_blockIndex(0), m_offset(0), m_bytesUsed(0)
+{
+} // CArena::CArena
+
+
+
+/*
+ * CArena::~CArena
+ * This function gives every block back to the heap.
+ * Input: None
+ * Return: none - destructor. No side effects.
+ */
+CArena::~CArena()
+{
+    for (const Block& block : m_blocks)
+    {
+        ::operator delete(block.data);
+    }
+} // CArena::~CArena
+
+
+
+/*
+ * CArena::Allocate
+ * This function hands out memory from the current block, moving on to a
+ * later block (or a new one) when it does not fit.
+ * Input: size [IN] - bytes wanted
+ *        alignment [IN] - alignment wanted, a power of two
+ * Return: void* - returns the memory; it stays valid until Reset.
+ */
+void* CArena::Allocate(size_t size, size_t alignment)
+{
+    while (m_blockIndex < m_blocks.size())
+    {
+        const Block& block = m_blocks[m_blockIndex];
+        size_t start = (m_offset + alignment - 1) & ~(alignment - 1);
+        if (start + size <= block.size)
+        {
+            m_bytesUsed += start + size - m_offset;
+            m_offset = start + size;
+            return block.data + start;
+        }
+        m_blockIndex++;
+        m_offset = 0;
+    }
+    
+    // No kept block has room, so add one twice the size of the last
+    size_t blockSize = m_blocks.empty() ? ARENA_BLOCK_SIZE : m_blocks.back().size * 2;
+    if (blockSize < size + alignment)
+    {
+        blockSize = size + alignment;
+    }
+    Block block;
+    block.data = (char*)::operator new(blockSize);
+    block.size = blockSize;
+    m_blocks.push_back(block);
+    m_blockIndex = m_blocks.size() - 1;
+    
+    // operator new memory suits any fundamental alignment
+    m_bytesUsed += size;
+    m_offset = size;
+    return block.data;
+} // CArena::Allocate
+
+
+
+/*
+ * CArena::CopyText
+ * This function copies text into the arena.
+ * Input: text [IN] - the text to keep
+ * Return: string_view - returns the copy, valid until Reset.
+ */
+string_view CArena::CopyText(string_view text)
+{
+    if (text.empty())
+    {
+        return string_view();
+    }
+    char* copy = (char*)Allocate(text.length(), 1);
+    memcpy(copy, text.data(), text.length());
+    return string_view(copy, text.length());
+} // CArena::CopyText
+
+
+
+/*
+ * CArena::Reset
+ * This function frees everything at once. Blocks are kept for reuse.
+ * Input: None
+ * Return: void - no return value. Side effect: every earlier allocation
+ *                is invalid.
+ */
+void CArena::Reset()
+{
+    m_blockIndex = 0;
+    m_offset = 0;
+    m_bytesUsed = 0;
+} // CArena::Reset
+
+
+
+/*
+ * CArena::BytesUsed
+ * This function tells how much was allocated since the last Reset,
+ * counting alignment padding.
+ * Input: None
+ * Return: size_t - returns the byte count. No side effects.
+ */
+size_t CArena::BytesUsed() const
+{
+    return m_bytesUsed;
+} // CArena::BytesUsed
+
+
+
+/*
+ * CArena::BytesReserved
+ * This function tells how much heap memory the arena holds.
+ * Input: None
+ * Return: size_t - returns the total size of all blocks.
+ */
+size_t CArena::BytesReserved() const
+{
+    size_t total = 0;
+    for (const Block& block : m_blocks)
+    {
+        total += block.size;
+    }
+    return total;
+} // CArena::BytesReserved
+
+
+
+/*
+ * ArenaAllocator
+ * Lets standard containers take their memory from a CArena. Freeing is
+ * a no-op; the arena's Reset frees it all.
+ */
+template <typename T>
+struct ArenaAllocator
+{
+    typedef T value_type;
+    
+    CArena* arena;
+    
+    explicit ArenaAllocator(CArena& owner) : arena(&owner) {}
+    template <typename U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {}
+    
+    T* allocate(size_t count)
+    {
+        return (T*)arena->Allocate(count * sizeof(T), alignof(T));
+    }
+    void deallocate(T*, size_t) {}
+    
+    template <typename U>
+    bool operator==(const ArenaAllocator<U>& other) const { return arena == other.arena; }
+    template <typename U>
+    bool operator!=(const ArenaAllocator<U>& other) const { return arena != other.arena; }
+};
+
+template <typename T>
+using ArenaVector = vector<T, ArenaAllocator<T>>;
+
+
+
+/*
+ * LineSpan
+ * One source line found by ScanSourceLines: where it sits in the buffer
+ * (without its '\n') and how many structural characters it holds.
+ */
+struct LineSpan
+{
+    size_t start = 0;
+    size_t length = 0;
+    int openBraces = 0;
+    int closeBraces = 0;
+    int openParens = 0;
+    int closeParens = 0;
+    int semicolons = 0;
+    bool hasQuote = false;        // " or ' somewhere on the line
+    bool hasCommentStart = false; // // or /* somewhere on the line
+    bool hasCode = true;          // false for a line of only comment text
+    bool endsInCode = true;       // lexer is back in code at the line end
+};
+
+
+
+/*
+ * Lexer
+ * The block scanners count every brace, even ones inside strings or
+ * comments. Lines that hold a quote or a comment, or that start inside a
+ * block comment or raw string, are run again through a small state
+ * machine that only counts characters of real code. Both of its tables
+ * are built at compile time: one maps each byte to a character class,
+ * the other maps (mode, class) to the next mode and an action.
+ */
+enum LexMode
+{
+    LEX_CODE,
+    LEX_SLASH,              // '/' seen in code, could start a comment
+    LEX_LINE_COMMENT,
+    LEX_BLOCK_COMMENT,
+    LEX_BLOCK_STAR,         // '*' seen inside a block comment
+    LEX_STRING,
+    LEX_STRING_ESCAPE,
+    LEX_CHAR,
+    LEX_CHAR_ESCAPE,
+    LEX_RAW_STRING,
+    LEX_MODE_COUNT
+};
+
+enum LexClass
+{
+    LEX_CLASS_OTHER,
+    LEX_CLASS_SPACE,
+    LEX_CLASS_OPEN_BRACE,
+    LEX_CLASS_CLOSE_BRACE,
+    LEX_CLASS_OPEN_PAREN,
+    LEX_CLASS_CLOSE_PAREN,
+    LEX_CLASS_SEMICOLON,
+    LEX_CLASS_DOUBLE_QUOTE,
+    LEX_CLASS_SINGLE_QUOTE,
+    LEX_CLASS_SLASH,
+    LEX_CLASS_STAR,
+    LEX_CLASS_BACKSLASH,
+    LEX_CLASS_COUNT
+};
+
+enum LexAction
+{
+    LEX_ACT_NONE,
+    LEX_ACT_CODE,           // a code character
+    LEX_ACT_COUNT,          // a code character the line counts
+    LEX_ACT_COMMENT,        // a comment starts
+    LEX_ACT_DIVIDE,         // the '/' was code; redo this char as code
+    LEX_ACT_DOUBLE_QUOTE,   // a string starts, maybe a raw one
+    LEX_ACT_SINGLE_QUOTE,   // a char literal or a digit separator
+    LEX_ACT_RAW_CLOSE       // ')' in a raw string, maybe its end
+};
+
+struct LexStep
+{
+    unsigned char next;
+    unsigned char action;
+};
+
+struct LexTables
+{
+    unsigned char classOf[256];
+    LexStep steps[LEX_MODE_COUNT][LEX_CLASS_COUNT];
+};
+
+// Longest raw string delimiter the standard allows
+const int MAX_RAW_DELIMITER = 16;
+
+/*
+ * LexerState
+ * Where the lexer is at the start of the next line.
+ */
+struct LexerState
+{
+    LexMode mode = LEX_CODE;
+    int rawDelimiterLength = 0;
+    char rawDelimiter[MAX_RAW_DELIMITER] = {};
+};
+
+
+
+/*
+ * BuildLexTables
+ * This function fills the character class and transition tables. It
+ * only runs at compile time.
+ * Input: none
+ * Return: LexTables - returns the finished tables.
+ */
+constexpr LexTables BuildLexTables()
+{
+    LexTables tables = {};
+    
+    tables.classOf[(unsigned char)' '] = LEX_CLASS_SPACE;
+    tables.classOf[(unsigned char)'\t'] = LEX_CLASS_SPACE;
+    tables.classOf[(unsigned char)'\r'] = LEX_CLASS_SPACE;
+    tables.classOf[(unsigned char)'\v'] = LEX_CLASS_SPACE;
+    tables.classOf[(unsigned char)'\f'] = LEX_CLASS_SPACE;
+    tables.classOf[(unsigned char)'{'] = LEX_CLASS_OPEN_BRACE;
+    tables.classOf[(unsigned char)'}'] = LEX_CLASS_CLOSE_BRACE;
+    tables.classOf[(unsigned char)'('] = LEX_CLASS_OPEN_PAREN;
+    tables.classOf[(unsigned char)')'] = LEX_CLASS_CLOSE_PAREN;
+    tables.classOf[(unsigned char)';'] = LEX_CLASS_SEMICOLON;
+    tables.classOf[(unsigned char)'"'] = LEX_CLASS_DOUBLE_QUOTE;
+    tables.classOf[(unsigned char)'\''] = LEX_CLASS_SINGLE_QUOTE;
+    tables.classOf[(unsigned char)'/'] = LEX_CLASS_SLASH;
+    tables.classOf[(unsigned char)'*'] = LEX_CLASS_STAR;
+    tables.classOf[(unsigned char)'\\'] = LEX_CLASS_BACKSLASH;
+    
+    // Every mode stays put on a character it does not care about
+    for (int mode = 0; mode < LEX_MODE_COUNT; mode++)
+    {
+        for (int charClass = 0; charClass < LEX_CLASS_COUNT; charClass++)
+        {
+            tables.steps[mode][charClass] = LexStep{(unsigned char)mode, LEX_ACT_NONE};
+        }
+    }
+    
+    for (int charClass = LEX_CLASS_OTHER; charClass < LEX_CLASS_COUNT; charClass++)
+    {
+        tables.steps[LEX_CODE][charClass] = LexStep{LEX_CODE, LEX_ACT_CODE};
+        tables.steps[LEX_SLASH][charClass] = LexStep{LEX_CODE, LEX_ACT_DIVIDE};
+        tables.steps[LEX_BLOCK_STAR][charClass] = LexStep{LEX_BLOCK_COMMENT, LEX_ACT_NONE};
+        tables.steps[LEX_STRING_ESCAPE][charClass] = LexStep{LEX_STRING, LEX_ACT_NONE};
+        tables.steps[LEX_CHAR_ESCAPE][charClass] = LexStep{LEX_CHAR, LEX_ACT_NONE};
+    }
+    tables.steps[LEX_CODE][LEX_CLASS_SPACE] = LexStep{LEX_CODE, LEX_ACT_NONE};
+    tables.steps[LEX_CODE][LEX_CLASS_OPEN_BRACE] = LexStep{LEX_CODE, LEX_ACT_COUNT};
+    tables.steps[LEX_CODE][LEX_CLASS_CLOSE_BRACE] = LexStep{LEX_CODE, LEX_ACT_COUNT};
+    tables.steps[LEX_CODE][LEX_CLASS_OPEN_PAREN] = LexStep{LEX_CODE, LEX_ACT_COUNT};
+    tables.steps[LEX_CODE][LEX_CLASS_CLOSE_PAREN] = LexStep{LEX_CODE, LEX_ACT_COUNT};
+    tables.steps[LEX_CODE][LEX_CLASS_SEMICOLON] = LexStep{LEX_CODE, LEX_ACT_COUNT};
+    tables.steps[LEX_CODE][LEX_CLASS_DOUBLE_QUOTE] = LexStep{LEX_STRING, LEX_ACT_DOUBLE_QUOTE};
+    tables.steps[LEX_CODE][LEX_CLASS_SINGLE_QUOTE] = LexStep{LEX_CHAR, LEX_ACT_SINGLE_QUOTE};
+    tables.steps[LEX_CODE][LEX_CLASS_SLASH] = LexStep{LEX_SLASH, LEX_ACT_NONE};
+    
+    tables.steps[LEX_SLASH][LEX_CLASS_SLASH] = LexStep{LEX_LINE_COMMENT, LEX_ACT_COMMENT};
+    tables.steps[LEX_SLASH][LEX_CLASS_STAR] = LexStep{LEX_BLOCK_COMMENT, LEX_ACT_COMMENT};
+    
+    tables.steps[LEX_BLOCK_COMMENT][LEX_CLASS_STAR] = LexStep{LEX_BLOCK_STAR, LEX_ACT_NONE};
+    tables.steps[LEX_BLOCK_STAR][LEX_CLASS_STAR] = LexStep{LEX_BLOCK_STAR, LEX_ACT_NONE};
+    tables.steps[LEX_BLOCK_STAR][LEX_CLASS_SLASH] = LexStep{LEX_CODE, LEX_ACT_NONE};
+    
+    tables.steps[LEX_STRING][LEX_CLASS_DOUBLE_QUOTE] = LexStep{LEX_CODE, LEX_ACT_NONE};
+    tables.steps[LEX_STRING][LEX_CLASS_BACKSLASH] = LexStep{LEX_STRING_ESCAPE, LEX_ACT_NONE};
+    tables.steps[LEX_CHAR][LEX_CLASS_SINGLE_QUOTE] = LexStep{LEX_CODE, LEX_ACT_NONE};
+    tables.steps[LEX_CHAR][LEX_CLASS_BACKSLASH] = LexStep{LEX_CHAR_ESCAPE, LEX_ACT_NONE};
+    
+    tables.steps[LEX_RAW_STRING][LEX_CLASS_CLOSE_PAREN] = LexStep{LEX_RAW_STRING, LEX_ACT_RAW_CLOSE};
+    return tables;
+} // BuildLexTables
+
+constexpr LexTables LEX_TABLES = BuildLexTables();
+
+
+
+/*
+ * StartsRawString
+ * This function checks if the '"' at position opens a raw string, i.e.
+ * it follows R, LR, uR, UR or u8R that is not the tail of a longer name.
+ * Input: line [IN] - the line text
+ *        position [IN] - index of the '"'
+ * Return: bool - returns true for a raw string. No side effects.
+ */
+bool StartsRawString(string_view line, size_t position)
+{
+    if (position == 0 || line[position - 1] != 'R')
+    {
+        return false;
+    }
+    size_t prefixStart = position - 1;
+    if (prefixStart >= 2 && line[prefixStart - 2] == 'u' && line[prefixStart - 1] == '8')
+    {
+        prefixStart -= 2;
+    }
+    else if (prefixStart >= 1 && (line[prefixStart - 1] == 'L' || line[prefixStart - 1] == 'u' ||
+                                  line[prefixStart - 1] == 'U'))
+    {
+        prefixStart -= 1;
+    }
+    return (prefixStart == 0 || !IsIdentifierChar(line[prefixStart - 1]));
+} // StartsRawString
+
+
+
+/*
+ * IsDigitSeparator
+ * This function checks if the '\'' at position is inside a number, like
+ * 1'000'000, rather than opening a char literal.
+ * Input: line [IN] - the line text
+ *        position [IN] - index of the '\''
+ * Return: bool - returns true for a digit separator. No side effects.
+ */
+bool IsDigitSeparator(string_view line, size_t position)
+{
+    size_t tokenStart = position;
+    while (tokenStart > 0 && IsIdentifierChar(line[tokenStart - 1]))
+    {
+        tokenStart--;
+    }
+    return (tokenStart < position && line[tokenStart] >= '0' && line[tokenStart] <= '9' &&
+            position + 1 < line.length() && IsIdentifierChar(line[position + 1]));
+} // IsDigitSeparator
+
+
+
+/*
+ * LexLine
+ * This function runs one line through the lexer and takes the braces,
+ * parens and semicolons that sit in strings or comments off the counts
+ * the block scanner found. Runs of plain code are skipped without the
+ * transition table, since the scanner already counted them.
+ * Input: buffer [IN] - the source buffer the line points into
+ *        line [IN/OUT] - the line; its counts and flags are corrected
+ *        state [IN/OUT] - lexer mode before and after the line
+ *        code [OUT] - if not null, receives line.length bytes: the
+ *                     line with string, char and comment text blanked
+ * Return: void - no return value. No side effects.
+ */
+void LexLine(const char* buffer, LineSpan& line, LexerState& state, char* code = nullptr)
+{
+    string_view text(buffer + line.start, line.length);
+    if (code != nullptr)
+    {
+        memset(code, ' ', text.length());
+    }
+    bool hasCode = false;
+    bool hasQuote = false;
+    bool hasCommentStart = false;
+    int removed[LEX_CLASS_COUNT] = {};     // counted by the scanner, but not code
+    
+    size_t position = 0;
+    while (position < text.length())
+    {
+        if (state.mode == LEX_CODE)
+        {
+            // Plain code needs no table until a quote or slash
+            unsigned char charClass = LEX_CLASS_OTHER;
+            size_t runStart = position;
+            while (position < text.length())
+            {
+                charClass = LEX_TABLES.classOf[(unsigned char)text[position]];
+                if (charClass >= LEX_CLASS_DOUBLE_QUOTE && charClass <= LEX_CLASS_SLASH)
+                {
+                    break;
+                }
+                hasCode |= (charClass != LEX_CLASS_SPACE);
+                position++;
+            }
+            if (code != nullptr)
+            {
+                memcpy(code + runStart, text.data() + runStart, position - runStart);
+            }
+            if (position == text.length())
+            {
+                break;
+            }
+        }
+        else if (state.mode == LEX_STRING)
+        {
+            // So does string text until a quote or escape
+            while (position < text.length())
+            {
+                unsigned char charClass = LEX_TABLES.classOf[(unsigned char)text[position]];
+                if (charClass == LEX_CLASS_DOUBLE_QUOTE || charClass == LEX_CLASS_BACKSLASH)
+                {
+                    break;
+                }
+                removed[charClass]++;
+                position++;
+            }
+            if (position == text.length())
+            {
+                break;
+            }
+        }
+        
+        unsigned char charClass = LEX_TABLES.classOf[(unsigned char)text[position]];
+        LexStep step = LEX_TABLES.steps[state.mode][charClass];
+        state.mode = (LexMode)step.next;
+        removed[charClass] += (step.action != LEX_ACT_COUNT);
+        
+        switch (step.action)
+        {
+            case LEX_ACT_CODE:
+            case LEX_ACT_COUNT:
+                hasCode = true;
+                if (code != nullptr)
+                {
+                    code[position] = text[position];
+                }
+                break;
+            case LEX_ACT_COMMENT:
+                hasCommentStart = true;
+                if (state.mode == LEX_LINE_COMMENT)
+                {
+                    // The rest of the line is comment
+                    for (position++; position < text.length(); position++)
+                    {
+                        removed[LEX_TABLES.classOf[(unsigned char)text[position]]]++;
+                    }
+                    continue;
+                }
+                break;
+            case LEX_ACT_DIVIDE:
+                hasCode = true;
+                removed[charClass]--;
+                continue;       // look at this character again as code
+            case LEX_ACT_DOUBLE_QUOTE:
+                hasCode = true;
+                hasQuote = true;
+                if (StartsRawString(text, position))
+                {
+                    size_t open = text.find('(', position + 1);
+                    size_t delimiterLength = (open == string_view::npos) ? 0 : open - position - 1;
+                    if (open != string_view::npos && delimiterLength <= MAX_RAW_DELIMITER)
+                    {
+                        state.mode = LEX_RAW_STRING;
+                        state.rawDelimiterLength = (int)delimiterLength;
+                        memcpy(state.rawDelimiter, text.data() + position + 1, delimiterLength);
+                        while (position < open)
+                        {
+                            removed[LEX_TABLES.classOf[(unsigned char)text[++position]]]++;
+                        }
+                    }
+                }
+                break;
+            case LEX_ACT_SINGLE_QUOTE:
+                hasCode = true;
+                if (IsDigitSeparator(text, position))
+                {
+                    state.mode = LEX_CODE;
+                }
+                else
+                {
+                    hasQuote = true;
+                }
+                break;
+            case LEX_ACT_RAW_CLOSE:
+            {
+                size_t closeEnd = position + 1 + state.rawDelimiterLength;
+                if (closeEnd < text.length() && text[closeEnd] == '"' &&
+                    text.compare(position + 1, state.rawDelimiterLength,
+                                 string_view(state.rawDelimiter, state.rawDelimiterLength)) == 0)
+                {
+                    state.mode = LEX_CODE;
+                    while (position < closeEnd)
+                    {
+                        removed[LEX_TABLES.classOf[(unsigned char)text[++position]]]++;
+                    }
+                }
+                break;
+            }
+            default:
+                break;
+        }
+        position++;
+    }
+    
+    line.openBraces -= removed[LEX_CLASS_OPEN_BRACE];
+    line.closeBraces -= removed[LEX_CLASS_CLOSE_BRACE];
+    line.openParens -= removed[LEX_CLASS_OPEN_PAREN];
+    line.closeParens -= removed[LEX_CLASS_CLOSE_PAREN];
+    line.semicolons -= removed[LEX_CLASS_SEMICOLON];
+    line.hasQuote = hasQuote;
+    line.hasCommentStart = hasCommentStart;
+    
+    // Only block comments and raw strings go on to the next line, unless
+    // a backslash continues the line
+    size_t lastIndex = text.length();
+    while (lastIndex > 0 && text[lastIndex - 1] == '\r')
+    {
+        lastIndex--;
+    }
+    bool continued = (lastIndex > 0 && text[lastIndex - 1] == '\\');
+    switch (state.mode)
+    {
+        case LEX_SLASH:
+            hasCode = true;
+            state.mode = LEX_CODE;
+            break;
+        case LEX_BLOCK_STAR:
+            state.mode = LEX_BLOCK_COMMENT;
+            break;
+        case LEX_LINE_COMMENT:
+            state.mode = continued ? LEX_LINE_COMMENT : LEX_CODE;
+            break;
+        case LEX_STRING:
+        case LEX_STRING_ESCAPE:
+            state.mode = continued ? LEX_STRING : LEX_CODE;
+            break;
+        case LEX_CHAR:
+        case LEX_CHAR_ESCAPE:
+            state.mode = continued ? LEX_CHAR : LEX_CODE;
+            break;
+        default:
+            break;
+    }
+    line.hasCode = hasCode;
+    line.endsInCode = (state.mode == LEX_CODE);
+} // LexLine
+
+
+
+/*
+ * ScanStructuralChar
+ * This function records one structural character into the current line.
+ * A '\n' closes the line and starts the next one; a line with quotes or
+ * comments, or one that starts inside a block comment or raw string, is
+ * recounted by the lexer first, while it is still in cache.
+ * Input: buffer [IN] - the whole source buffer
+ *        length [IN] - size of buffer
+ *        position [IN] - index of the structural character
+ *        line [IN/OUT] - the line being built
+ *        lines [IN/OUT] - receives finished lines
+ *        lexerState [IN/OUT] - lexer mode at the start of the line
+ * Return: void - no return value. No side effects.
+ */
+inline void ScanStructuralChar(const char* buffer, size_t length, size_t position,
+                               LineSpan& line, ArenaVector<LineSpan>& lines, LexerState& lexerState)
+{
+    switch (buffer[position])
+    {
+        case '\n':
+            line.length = position - line.start;
+            if (lexerState.mode != LEX_CODE || line.hasQuote || line.hasCommentStart)
+            {
+                LexLine(buffer, line, lexerState);
+            }
+            lines.push_back(line);
+            line = LineSpan();
+            line.start = position + 1;
+            break;
+        case '{': line.openBraces++; break;
+        case '}': line.closeBraces++; break;
+        case '(': line.openParens++; break;
+        case ')': line.closeParens++; break;
+        case ';': line.semicolons++; break;
+        case '"':
+        case '\'':
+            line.hasQuote = true;
+            break;
+        case '/':
+            if (position + 1 < length && (buffer[position + 1] == '/' || buffer[position + 1] == '*'))
+            {
+                line.hasCommentStart = true;
+            }
+            break;
+        default:
+            break;
+    }
+} // ScanStructuralChar
+
+
+
+/*
+ * ScanBlocksScalar
+ * This function is the portable scanner: one character at a time.
+ * Input: buffer [IN] - the source buffer
+ *        length [IN] - size of buffer
+ *        line [IN/OUT] - the line being built
+ *        lines [IN/OUT] - receives finished lines
+ *        lexerState [IN/OUT] - lexer mode at the start of the line
+ * Return: size_t - returns how many bytes were scanned (all of them).
+ *                  No side effects.
+ */
+size_t ScanBlocksScalar(const char* buffer, size_t length, LineSpan& line,
+                        ArenaVector<LineSpan>& lines, LexerState& lexerState)
+{
+    for (size_t position = 0; position < length; position++)
+    {
+        ScanStructuralChar(buffer, length, position, line, lines, lexerState);
+    }
+    return length;
+} // ScanBlocksScalar
+
+
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+
+/*
+ * ScanBlocksSse2
+ * This function scans 16 bytes at a time with SSE2. Blocks with no
+ * structural characters cost a few compares; hits are visited through
+ * the movemask bits.
+ * Input: buffer [IN] - the source buffer
+ *        length [IN] - size of buffer
+ *        line [IN/OUT] - the line being built
+ *        lines [IN/OUT] - receives finished lines
+ *        lexerState [IN/OUT] - lexer mode at the start of the line
+ * Return: size_t - returns how many bytes were scanned; the caller
+ *                  finishes the tail. No side effects.
+ */
+__attribute__((target("sse2")))
+size_t ScanBlocksSse2(const char* buffer, size_t length, LineSpan& line,
+                      ArenaVector<LineSpan>& lines, LexerState& lexerState)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i openBrace = _mm_set1_epi8('{');
+    const __m128i closeBrace = _mm_set1_epi8('}');
+    const __m128i openParen = _mm_set1_epi8('(');
+    const __m128i closeParen = _mm_set1_epi8(')');
+    const __m128i semicolon = _mm_set1_epi8(';');
+    const __m128i doubleQuote = _mm_set1_epi8('"');
+    const __m128i singleQuote = _mm_set1_epi8('\'');
+    const __m128i slash = _mm_set1_epi8('/');
+    
+    size_t position = 0;
+    for (; position + 16 <= length; position += 16)
+    {
+        __m128i block = _mm_loadu_si128((const __m128i*)(buffer + position));
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, newline), _mm_cmpeq_epi8(block, openBrace)),
+                         _mm_or_si128(_mm_cmpeq_epi8(block, closeBrace), _mm_cmpeq_epi8(block, openParen))),
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, closeParen), _mm_cmpeq_epi8(block, semicolon)),
+                         _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, doubleQuote),
+                                                   _mm_cmpeq_epi8(block, singleQuote)),
+                                      _mm_cmpeq_epi8(block, slash))));
+        
+        unsigned mask = (unsigned)_mm_movemask_epi8(hits);
+        while (mask != 0)
+        {
+            ScanStructuralChar(buffer, length, position + __builtin_ctz(mask), line, lines, lexerState);
+            mask &= mask - 1;
+        }
+    }
+    return position;
+} // ScanBlocksSse2
+
+
+
+/*
+ * ScanBlocksAvx2
+ * This function is ScanBlocksSse2 widened to 32 bytes with AVX2.
+ * Input: buffer [IN] - the source buffer
+ *        length [IN] - size of buffer
+ *        line [IN/OUT] - the line being built
+ *        lines [IN/OUT] - receives finished lines
+ *        lexerState [IN/OUT] - lexer mode at the start of the line
+ * Return: size_t - returns how many bytes were scanned; the caller
+ *                  finishes the tail. No side effects.
+ */
+__attribute__((target("avx2")))
+size_t ScanBlocksAvx2(const char* buffer, size_t length, LineSpan& line,
+                      ArenaVector<LineSpan>& lines, LexerState& lexerState)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i openBrace = _mm256_set1_epi8('{');
+    const __m256i closeBrace = _mm256_set1_epi8('}');
+    const __m256i openParen = _mm256_set1_epi8('(');
+    const __m256i closeParen = _mm256_set1_epi8(')');
+    const __m256i semicolon = _mm256_set1_epi8(';');
+    const __m256i doubleQuote = _mm256_set1_epi8('"');
+    const __m256i singleQuote = _mm256_set1_epi8('\'');
+    const __m256i slash = _mm256_set1_epi8('/');
+    
+    size_t position = 0;
+    for (; position + 32 <= length; position += 32)
+    {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(buffer + position));
+        __m256i hits = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, newline),
+                                            _mm256_cmpeq_epi8(block, openBrace)),
+                            _mm256_or_si256(_mm256_cmpeq_epi8(block, closeBrace),
+                                            _mm256_cmpeq_epi8(block, openParen))),
+            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, closeParen),
+                                            _mm256_cmpeq_epi8(block, semicolon)),
+                            _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, doubleQuote),
+                                                            _mm256_cmpeq_epi8(block, singleQuote)),
+                                            _mm256_cmpeq_epi8(block, slash))));
+        
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hits);
+        while (mask != 0)
+        {
+            ScanStructuralChar(buffer, length, position + __builtin_ctz(mask), line, lines, lexerState);
+            mask &= mask - 1;
+        }
+    }
+    return position;
+} // ScanBlocksAvx2
+
+#endif
+
+
+
+/*
+ * ScanSourceLines
+ * This function splits a source buffer into lines and counts braces,
+ * parens and semicolons per line in one sweep. The widest block scanner
+ * the CPU supports is picked once at run time; the lexer recounts the
+ * lines where strings or comments could hide braces. Lines follow
+ * getline rules: a final line
+ * without '\n' still counts, an empty tail does not.
+ * Input: buffer [IN] - the source text
+ *        length [IN] - size of buffer
+ *        lines [OUT] - receives one LineSpan per line
+ *        lexerState [IN/OUT] - lexer mode where buffer starts and ends,
+ *                              for input scanned in pieces
+ * Return: void - no return value. No side effects.
+ */
+void ScanSourceLines(const char* buffer, size_t length, ArenaVector<LineSpan>& lines,
+                     LexerState& lexerState)
+{
+    typedef size_t (*BlockScanner)(const char*, size_t, LineSpan&, ArenaVector<LineSpan>&, LexerState&);
+    
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    static const BlockScanner blockScanner = __builtin_cpu_supports("avx2") ? ScanBlocksAvx2 :
+                                             __builtin_cpu_supports("sse2") ? ScanBlocksSse2 :
+                                             ScanBlocksScalar;
+#else
+    static const BlockScanner blockScanner = ScanBlocksScalar;
+#endif
+    
+    lines.clear();
+    LineSpan line;
+    size_t scanned = blockScanner(buffer, length, line, lines, lexerState);
+    
+    // Finish the bytes that did not fill a whole block
+    for (size_t position = scanned; position < length; position++)
+    {
+        ScanStructuralChar(buffer, length, position, line, lines, lexerState);
+    }
+    
+    if (line.start < length)
+    {
+        line.length = length - line.start;
+        if (lexerState.mode != LEX_CODE || line.hasQuote || line.hasCommentStart)
+        {
+            LexLine(buffer, line, lexerState);
+        }
+        lines.push_back(line);
+    }
+} // ScanSourceLines
+
+
+
+/*
+ * ScanSourceLines
+ * This function scans a whole source buffer, see above.
+ * Input: buffer [IN] - the source text
+ *        length [IN] - size of buffer
+ *        lines [OUT] - receives one LineSpan per line
+ * Return: void - no return value. No side effects.
+ */
+void ScanSourceLines(const char* buffer, size_t length, ArenaVector<LineSpan>& lines)
+{
+    LexerState lexerState;
+    ScanSourceLines(buffer, length, lines, lexerState);
+} // ScanSourceLines
+
+
+
+/*
+ * TrimWhitespace
+ * This function removes leading and trailing spaces, tabs and line ends.
+ * Input: text [IN] - the text to trim
+ * Return: string_view - returns the trimmed part of text, pointing into
+ *                       the same characters. No side effects.
+ */
+string_view TrimWhitespace(string_view text)
+{
+    size_t first = text.find_first_not_of(" \t\r\n");
+    if (first == string_view::npos)
+    {
+        return string_view();
+    }
+    size_t last = text.find_last_not_of(" \t\r\n");
+    return text.substr(first, last - first + 1);
+} // TrimWhitespace
+
+
+
+/*
+ * IsYesAnswer
+ * This function checks if an answer means yes.
+ * Accepts y/Y from the prompts and yes/true from spec files.
+ * Input: answer [IN] - the answer text to check
+ * Return: bool - returns true if answer means yes, false otherwise.
+ *                No side effects.
+ */
+bool IsYesAnswer(string_view answer)
+{
+    return (answer == "y" || answer == "Y" ||
+            answer == "yes" || answer == "Yes" || answer == "YES" ||
+            answer == "true");
+} // IsYesAnswer
+
+
+
+/*
+ * ExtractFunctionName
+ * This function pulls the function name out of a definition line.
+ * Keeps class qualifiers, so "int CCounter::GetValue()" gives
+ * "CCounter::GetValue".
+ * Input: line [IN] - the function definition line
+ * Return: string_view - returns the function name inside line, or an
+ *                       empty view if none was found. No side effects.
+ */
+string_view ExtractFunctionName(string_view line)
+{
+    size_t parenPos = line.find('(');
+    if (parenPos == string_view::npos)
+    {
+        return string_view();
+    }
+    
+    // Walk back over spaces, then over the name characters
+    size_t nameEnd = parenPos;
+    while (nameEnd > 0 && (line[nameEnd - 1] == ' ' || line[nameEnd - 1] == '\t'))
+    {
+        nameEnd--;
+    }
+    size_t nameStart = nameEnd;
+    while (nameStart > 0 &&
+           (isalnum((unsigned char)line[nameStart - 1]) || line[nameStart - 1] == '_' ||
+            line[nameStart - 1] == ':' || line[nameStart - 1] == '~'))
+    {
+        nameStart--;
+    }
+    return line.substr(nameStart, nameEnd - nameStart);
+} // ExtractFunctionName
+
+
+
+/*
+ * FunctionParameter
+ * One parameter of a parsed signature, with the mode its type implies.
+ */
+struct FunctionParameter
+{
+    string type;                  // without name and default, e.g. "const string&"
+    string name;                  // empty for an unnamed parameter
+    string defaultValue;
+    const char* mode = "IN";      // "IN" or "IN/OUT"
+};
+
+/*
+ * FunctionSignature
+ * A function definition line taken apart.
+ */
+struct FunctionSignature
+{
+    string returnType;            // empty for constructors and destructors
+    vector<FunctionParameter> parameters;
+};
+
+
+
+/*
+ * FindClosingBracket
+ * This function finds the bracket that closes the one at openPos,
+ * counting (), [] and {} and skipping string and character literals.
+ * Input: text [IN] - the text to search
+ *        openPos [IN] - position of an opening bracket
+ * Return: size_t - returns the position of the closing bracket, or
+ *                  string_view::npos if it is missing. No side effects.
+ */
+size_t FindClosingBracket(string_view text, size_t openPos)
+{
+    int depth = 0;
+    for (size_t i = openPos; i < text.length(); i++)
+    {
+        char c = text[i];
+        if (c == '"' || c == '\'')
+        {
+            for (i++; i < text.length() && text[i] != c; i++)
+            {
+                if (text[i] == '\\')
+                {
+                    i++;
+                }
+            }
+        }
+        else if (c == '(' || c == '[' || c == '{')
+        {
+            depth++;
+        }
+        else if ((c == ')' || c == ']' || c == '}') && --depth == 0)
+        {
+            return i;
+        }
+    }
+    return string_view::npos;
+} // FindClosingBracket
+
+
+
+/*
+ * SplitParameterList
+ * This function splits the text between a signature's parentheses at
+ * its top-level commas. Commas inside brackets, template arguments and
+ * literals do not split; angle brackets only count before a default
+ * value, where they cannot be comparisons.
+ * Input: list [IN] - the parameter list without its parentheses
+ *        parts [OUT] - receives one untrimmed piece per parameter
+ * Return: void - no return value. No side effects.
+ */
+void SplitParameterList(string_view list, vector<string_view>& parts)
+{
+    int depth = 0;
+    bool inDefault = false;
+    size_t partStart = 0;
+    for (size_t i = 0; i < list.length(); i++)
+    {
+        char c = list[i];
+        if (c == '"' || c == '\'')
+        {
+            size_t closePos = i + 1;
+            while (closePos < list.length() && list[closePos] != c)
+            {
+                closePos += (list[closePos] == '\\') ? 2 : 1;
+            }
+            i = closePos;
+        }
+        else if (c == '(' || c == '[' || c == '{' || (c == '<' && !inDefault))
+        {
+            depth++;
+        }
+        else if (c == ')' || c == ']' || c == '}' || (c == '>' && !inDefault && depth > 0))
+        {
+            depth--;
+        }
+        else if (c == '=' && depth == 0)
+        {
+            inDefault = true;
+        }
+        else if (c == ',' && depth == 0)
+        {
+            parts.push_back(list.substr(partStart, i - partStart));
+            partStart = i + 1;
+            inDefault = false;
+        }
+    }
+    parts.push_back(list.substr(min(partStart, list.length())));
+} // SplitParameterList
+
+
+
+/*
+ * InferParameterMode
+ * This function works out a parameter's mode from its type: values,
+ * const references and pointers to const are only read, so they are
+ * IN; other references and pointers may be changed, so they are IN/OUT.
+ * Input: type [IN] - the parameter type without its name
+ * Return: const char* - returns "IN" or "IN/OUT". No side effects.
+ */
+const char* InferParameterMode(string_view type)
+{
+    // A const on the pointer itself does not protect what it points to
+    while (type.length() > 5 && type.substr(type.length() - 5) == "const" &&
+           !IsIdentifierChar(type[type.length() - 6]))
+    {
+        type = TrimWhitespace(type.substr(0, type.length() - 5));
+    }
+    if (type.empty() || (type.length() >= 2 && type.substr(type.length() - 2) == "&&"))
+    {
+        return "IN";
+    }
+    
+    char last = type.back();
+    if (last != '&' && last != '*' && last != ']')
+    {
+        return "IN";
+    }
+    
+    // Look for const between the last indirection and the one before it
+    string_view pointee = type.substr(0, type.length() - 1);
+    size_t previous = pointee.find_last_of("*&");
+    pointee = (previous == string_view::npos) ? pointee : pointee.substr(previous + 1);
+    for (size_t constPos = pointee.find("const"); constPos != string_view::npos;
+         constPos = pointee.find("const", constPos + 5))
+    {
+        bool wordStart = (constPos == 0 || !IsIdentifierChar(pointee[constPos - 1]));
+        bool wordEnd = (constPos + 5 >= pointee.length() || !IsIdentifierChar(pointee[constPos + 5]));
+        if (wordStart && wordEnd)
+        {
+            return "IN";
+        }
+    }
+    return "IN/OUT";
+} // InferParameterMode
+
+
+
+/*
+ * ParseParameter
+ * This function takes one parameter declaration apart into type, name
+ * and default value, and infers its mode. Function pointers such as
+ * "void (*done)(int)" are IN; "int values[]" is treated as a pointer.
+ * Input: text [IN] - one piece from SplitParameterList
+ *        parameter [OUT] - receives the parts
+ * Return: void - no return value. No side effects.
+ */
+void ParseParameter(string_view text, FunctionParameter& parameter)
+{
+    static const char* const typeWords[] = {
+        "int", "char", "short", "long", "float", "double", "bool", "void", "auto", "signed", "unsigned"
+    };
+    static const char* const qualifierWords[] = {
+        "const", "volatile", "struct", "class", "enum", "typename"
+    };
+    
+    // The default value starts at the first top-level '='
+    string_view declaration = TrimWhitespace(text);
+    int depth = 0;
+    for (size_t i = 0; i < declaration.length(); i++)
+    {
+        char c = declaration[i];
+        depth += (c == '(' || c == '[' || c == '{' || c == '<') ? 1 :
+                 (c == ')' || c == ']' || c == '}' || c == '>') ? -1 : 0;
+        if (c == '=' && depth == 0)
+        {
+            parameter.defaultValue = string(TrimWhitespace(declaration.substr(i + 1)));
+            declaration = TrimWhitespace(declaration.substr(0, i));
+            break;
+        }
+    }
+    
+    // Function pointer: the name sits in the first parentheses outside
+    // template arguments, after a * or &
+    size_t parenPos = string_view::npos;
+    int angleDepth = 0;
+    for (size_t i = 0; i < declaration.length() && parenPos == string_view::npos; i++)
+    {
+        angleDepth += (declaration[i] == '<') ? 1 : (declaration[i] == '>') ? -1 : 0;
+        parenPos = (declaration[i] == '(' && angleDepth == 0) ? i : string_view::npos;
+    }
+    size_t closePos = (parenPos == string_view::npos) ? string_view::npos
+                                                      : FindClosingBracket(declaration, parenPos);
+    string_view inner;
+    if (closePos != string_view::npos)
+    {
+        inner = declaration.substr(parenPos + 1, closePos - parenPos - 1);
+    }
+    if (inner.find_first_of("*&") != string_view::npos)
+    {
+        size_t nameEnd = inner.length();
+        while (nameEnd > 0 && !IsIdentifierChar(inner[nameEnd - 1]))
+        {
+            nameEnd--;
+        }
+        size_t nameStart = nameEnd;
+        while (nameStart > 0 && IsIdentifierChar(inner[nameStart - 1]))
+        {
+            nameStart--;
+        }
+        parameter.name = string(inner.substr(nameStart, nameEnd - nameStart));
+        parameter.type = string(declaration.substr(0, parenPos + 1 + nameStart)) +
+                         string(declaration.substr(parenPos + 1 + nameEnd));
+        parameter.mode = "IN";
+        return;
+    }
+    
+    // Arrays pass a pointer to their first element
+    string_view arraySuffix;
+    size_t bracketPos = declaration.find('[');
+    if (bracketPos != string_view::npos)
+    {
+        arraySuffix = declaration.substr(bracketPos);
+        declaration = TrimWhitespace(declaration.substr(0, bracketPos));
+    }
+    
+    size_t nameStart = declaration.length();
+    while (nameStart > 0 && IsIdentifierChar(declaration[nameStart - 1]))
+    {
+        nameStart--;
+    }
+    string_view name = declaration.substr(nameStart);
+    string_view type = TrimWhitespace(declaration.substr(0, nameStart));
+    
+    // A type alone, such as "unsigned int", "const Foo" or "std::string",
+    // has no name
+    bool unnamed = name.empty() || type.empty() || type.back() == ':';
+    for (const char* typeWord : typeWords)
+    {
+        unnamed = unnamed || name == typeWord;
+    }
+    for (const char* qualifierWord : qualifierWords)
+    {
+        unnamed = unnamed || type == qualifierWord;
+    }
+    if (unnamed)
+    {
+        type = declaration;
+        name = string_view();
+    }
+    
+    parameter.name = string(name);
+    parameter.type = string(type) + string(arraySuffix.empty() ? "" : "[]");
+    parameter.mode = InferParameterMode(parameter.type);
+} // ParseParameter
+
+
+
+/*
+ * ParseFunctionSignature
+ * This function takes a function definition line apart: its return type
+ * and every parameter, including templates, default values and function
+ * pointers.
+ * Input: line [IN] - the function definition line
+ *        signature [OUT] - receives the return type and parameters
+ * Return: bool - returns true if the whole parameter list is on the
+ *                line and was read, false otherwise. No side effects.
+ */
+bool ParseFunctionSignature(string_view line, FunctionSignature& signature)
+{
+    static const char* const specifiers[] = {
+        "static", "inline", "virtual", "explicit", "constexpr", "friend", "extern"
+    };
+    
+    // The parameter list is the first parenthesis, except in operator()
+    string_view text = TrimWhitespace(line);
+    size_t operatorPos = text.find("operator()");
+    size_t parenPos = text.find('(', (operatorPos == string_view::npos) ? 0 : operatorPos + 10);
+    if (parenPos == string_view::npos)
+    {
+        return false;
+    }
+    size_t closePos = FindClosingBracket(text, parenPos);
+    if (closePos == string_view::npos)
+    {
+        return false;
+    }
+    
+    // Return type: what is left before the name
+    string_view name = ExtractFunctionName(text.substr(0, parenPos + 1));
+    if (operatorPos != string_view::npos)
+    {
+        name = text.substr(0, operatorPos + 10);
+        size_t nameStart = name.find_last_of(" \t*&");
+        name = (nameStart == string_view::npos) ? name : name.substr(nameStart + 1);
+    }
+    string_view returnType = TrimWhitespace(text.substr(0, name.data() - text.data()));
+    if (returnType.compare(0, 8, "template") == 0)
+    {
+        size_t anglePos = returnType.find('<');
+        int depth = 0;
+        for (size_t i = anglePos; anglePos != string_view::npos && i < returnType.length(); i++)
+        {
+            depth += (returnType[i] == '<') ? 1 : (returnType[i] == '>') ? -1 : 0;
+            if (depth == 0)
+            {
+                returnType = TrimWhitespace(returnType.substr(i + 1));
+                break;
+            }
+        }
+    }
+    for (bool removed = true; removed; )
+    {
+        removed = false;
+        for (const char* specifier : specifiers)
+        {
+            size_t length = strlen(specifier);
+            if (returnType.compare(0, length, specifier) == 0 &&
+                (returnType.length() == length || !IsIdentifierChar(returnType[length])))
+            {
+                returnType = TrimWhitespace(returnType.substr(length));
+                removed = true;
+            }
+        }
+    }
+    
+    // auto Name(...) -> Type
+    size_t arrowPos = text.find("->", closePos);
+    if (returnType == "auto" && arrowPos != string_view::npos)
+    {
+        returnType = text.substr(arrowPos + 2);
+        returnType = TrimWhitespace(returnType.substr(0, returnType.find_first_of("{;")));
+    }
+    signature.returnType = string(returnType);
+    
+    string_view list = TrimWhitespace(text.substr(parenPos + 1, closePos - parenPos - 1));
+    signature.parameters.clear();
+    if (list.empty() || list == "void")
+    {
+        return true;
+    }
+    vector<string_view> parts;
+    SplitParameterList(list, parts);
+    for (string_view part : parts)
+    {
+        FunctionParameter parameter;
+        ParseParameter(part, parameter);
+        signature.parameters.push_back(parameter);
+    }
+    return true;
+} // ParseFunctionSignature
+
+
+
+/*
+ * GetTodaysDate
+ * This function formats the current local date for the file header.
+ * Input: None
+ * Return: string - returns today's date as MM/DD/YYYY. No side effects.
+ */
+string GetTodaysDate()
+{
+    time_t now = time(nullptr);
+    char dateText[16];
+    strftime(dateText, sizeof(dateText), "%m/%d/%Y", localtime(&now));
+    return dateText;
+} // GetTodaysDate
+
+
+
+const uint64_t HASH_SEED = 14695981039346656037ULL;   // FNV-1a offset basis
+
+
+
+/*
+ * HashBytes
+ * This function computes a 64-bit FNV-1a hash of some bytes.
+ * Input: data [IN] - the bytes to hash
+ *        length [IN] - number of bytes
+ *        seed [IN] - starting value, to chain several pieces together
+ * Return: uint64_t - returns the hash. No side effects.
+ */
+uint64_t HashBytes(const char* data, size_t length, uint64_t seed = HASH_SEED)
+{
+    uint64_t hash = seed;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+} // HashBytes
+
+
+
+/*
+ * SiteSpec
+ * Answers for one detected site, as written in a batch spec file.
+ * Function sites use the header fields, line sites use comment.
+ */
+struct SiteSpec
+{
+    bool addComment = true;       // header or line comment wanted
+    bool addEndComment = false;   // "end of" comment after function body
+    bool hasEndAnswer = false;    // end given here, else use [defaults]
+    string functionName;
+    string description;
+    string parameters;            // one "name [MODE] -- desc" per line
+    string returnDesc;
+    string comment;
+};
+
+
+
+/*
+ * SiteSpecMap
+ * Site answers by key. The transparent comparator lets lookups use a
+ * string_view into the source without building a string.
+ */
+typedef map<string, SiteSpec, less<>> SiteSpecMap;
+
+
+
+/*
+ * AnnotationSpec
+ * Everything batch mode needs to answer without a terminal: the file
+ * header fields, per-site answers and the defaults for unmatched sites.
+ * Function sites are keyed by name, qualified name or signature; I/O,
+ * control and variable sites by their trimmed source line.
+ */
+struct AnnotationSpec
+{
+    string date;
+    string project;
+    string description;
+    string outputFile;
+    CommentStyle style;           // [style] and the fixed [header] fields
+    
+    SiteSpecMap functions;
+    SiteSpecMap ioLines;
+    SiteSpecMap controlLines;
+    SiteSpecMap variableLines;
+    
+    SiteSpec defaults;            // used for functions not in the spec
+    uint64_t fingerprint = 0;     // hash of the spec text, for the cache
+};
+
+
+
+/*
+ * SiteKind
+ * The kinds of single-line sites that can get a comment.
+ */
+enum SiteKind
+{
+    SITE_IO,
+    SITE_CONTROL,
+    SITE_VARIABLE
+};
+
+
+
+/*
+ * ParseAnnotationSpec
+ * This function reads batch spec text into an AnnotationSpec.
+ * The format is INI-like:
+ *     [header]              date, project, description, output,
+ *                           programmer, class, time, instructor
+ *     [style]               name (course, doxygen or plain), file,
+ *                           function
+ *     [defaults]            header, description, return, end
+ *     [function NAME]       header, name, description, param, return, end
+ *     [io LINE]             comment
+ *     [control LINE]        comment
+ *     [variable LINE]       comment
+ * Lines starting with # are ignored and param may repeat. So do file
+ * and function in [style]: each adds a line to the file or function
+ * header template (see CompileCommentTemplate), replacing the one of
+ * the named style; a leading | keeps the spaces after it. Headers for
+ * unmatched functions ([defaults] header = yes) need a description.
+ * Input: specFile [IN/OUT] - the spec text
+ *        specPath [IN] - names the spec in error messages
+ *        spec [OUT] - receives the parsed answers
+ *        errorMessage [OUT] - receives the first error, with its line
+ *                             number
+ * Return: bool - returns true if the text was parsed, false otherwise.
+ *                No side effects.
+ */
+bool ParseAnnotationSpec(istream& specFile, const string& specPath, AnnotationSpec& spec, string& errorMessage)
+{
+    // Unmatched functions are skipped unless [defaults] says otherwise
+    spec.defaults.addComment = false;
+    
+    string specLine;
+    int lineNumber = 0;
+    int defaultsHeaderLine = 0;         // where [defaults] turned headers on
+    string section;
+    SiteSpec* currentSite = nullptr;
+    
+    // Template lines from [style], and the spec line of each
+    string templateText[2];
+    vector<int> templateLines[2];
+    
+    spec.fingerprint = HASH_SEED;
+    while (getline(specFile, specLine))
+    {
+        lineNumber++;
+        spec.fingerprint = HashBytes(specLine.data(), specLine.length(), spec.fingerprint);
+        spec.fingerprint = HashBytes("\n", 1, spec.fingerprint);
+        string trimmed(TrimWhitespace(specLine));
+        if (trimmed.empty() || trimmed[0] == '#')
+        {
+            continue;
+        }
+        
+        // Section header: [kind] or [kind key]
+        if (trimmed[0] == '[')
+        {
+            if (trimmed[trimmed.length() - 1] != ']')
+            {
+                errorMessage = specPath + ":" + to_string(lineNumber) + ": missing ']'";
+                return false;
+            }
+            string inside = trimmed.substr(1, trimmed.length() - 2);
+            size_t spacePos = inside.find(' ');
+            section = inside.substr(0, spacePos);
+            string key = (spacePos == string::npos) ? "" : string(TrimWhitespace(inside.substr(spacePos + 1)));
+            
+            currentSite = nullptr;
+            if (section == "defaults")
+            {
+                currentSite = &spec.defaults;
+            }
+            else if (section == "function" || section == "io" ||
+                     section == "control" || section == "variable")
+            {
+                if (key.empty())
+                {
+                    errorMessage = specPath + ":" + to_string(lineNumber) + ": [" + section +
+                                   "] needs a name or line";
+                    return false;
+                }
+                SiteSpecMap& sites = (section == "function") ? spec.functions :
+                                     (section == "io") ? spec.ioLines :
+                                     (section == "control") ? spec.controlLines :
+                                     spec.variableLines;
+                currentSite = &sites[key];
+            }
+            else if (section != "header" && section != "style")
+            {
+                errorMessage = specPath + ":" + to_string(lineNumber) + ": unknown section [" +
+                               section + "]";
+                return false;
+            }
+            continue;
+        }
+        
+        // Field: key = value
+        size_t equalsPos = trimmed.find('=');
+        if (equalsPos == string::npos || section.empty())
+        {
+            errorMessage = specPath + ":" + to_string(lineNumber) + ": expected key = value";
+            return false;
+        }
+        string key(TrimWhitespace(string_view(trimmed).substr(0, equalsPos)));
+        string value(TrimWhitespace(string_view(trimmed).substr(equalsPos + 1)));
+        
+        if (section == "header")
+        {
+            if (key == "date") spec.date = value;
+            else if (key == "project") spec.project = value;
+            else if (key == "description") spec.description = value;
+            else if (key == "output") spec.outputFile = value;
+            else if (key == "programmer") spec.style.programmer = value;
+            else if (key == "class") spec.style.className = value;
+            else if (key == "time") spec.style.time = value;
+            else if (key == "instructor") spec.style.instructor = value;
+            else
+            {
+                errorMessage = specPath + ":" + to_string(lineNumber) + ": unknown header field '" +
+                               key + "'";
+                return false;
+            }
+        }
+        else if (section == "style")
+        {
+            if (key == "name")
+            {
+                const BuiltInCommentStyle* found = nullptr;
+                for (const BuiltInCommentStyle& builtIn : BUILT_IN_COMMENT_STYLES)
+                {
+                    if (value == builtIn.name)
+                    {
+                        found = &builtIn;
+                        break;
+                    }
+                }
+                if (found == nullptr)
+                {
+                    errorMessage = specPath + ":" + to_string(lineNumber) + ": unknown style '" + value +
+                                   "' (course, doxygen or plain)";
+                    return false;
+                }
+                spec.style.fileHeader = *found->fileHeader;
+                spec.style.functionHeader = *found->functionHeader;
+            }
+            else if (key == "file" || key == "function")
+            {
+                int which = (key == "file") ? 0 : 1;
+                string_view line = (value.compare(0, 1, "|") == 0) ? string_view(value).substr(1) : value;
+                templateText[which].append(line.data(), line.length());
+                templateText[which] += '\n';
+                templateLines[which].push_back(lineNumber);
+            }
+            else
+            {
+                errorMessage = specPath + ":" + to_string(lineNumber) + ": unknown style field '" +
+                               key + "'";
+                return false;
+            }
+        }
+        else if (key == "header")
+        {
+            currentSite->addComment = IsYesAnswer(value);
+            defaultsHeaderLine = (currentSite == &spec.defaults) ? lineNumber : defaultsHeaderLine;
+        }
+        else if (key == "end")
+        {
+            currentSite->addEndComment = IsYesAnswer(value);
+            currentSite->hasEndAnswer = true;
+        }
+        else if (key == "name") currentSite->functionName = value;
+        else if (key == "description") currentSite->description = value;
+        else if (key == "return") currentSite->returnDesc = value;
+        else if (key == "comment") currentSite->comment = value;
+        else if (key == "param")
+        {
+            if (!currentSite->parameters.empty())
+            {
+                currentSite->parameters += "\n";
+            }
+            currentSite->parameters += value;
+        }
+        else
+        {
+            errorMessage = specPath + ":" + to_string(lineNumber) + ": unknown field '" + key + "'";
+            return false;
+        }
+    }
+    
+    // Every unmatched function gets the same description, so it has to
+    // be given rather than invented
+    if (spec.defaults.addComment && spec.defaults.description.empty())
+    {
+        errorMessage = specPath + ":" + to_string(defaultsHeaderLine) +
+                       ": [defaults] header = yes needs a description";
+        return false;
+    }
+    
+    // Templates of the spec's own replace those of the named style
+    for (int which = 0; which < 2; which++)
+    {
+        if (templateText[which].empty())
+        {
+            continue;
+        }
+        CommentTemplate& compiled = (which == 0) ? spec.style.fileHeader : spec.style.functionHeader;
+        compiled = CompileCommentTemplate(templateText[which]);
+        if (compiled.error != nullptr)
+        {
+            errorMessage = specPath + ":" + to_string(templateLines[which][compiled.errorLine]) + ": " +
+                           compiled.error;
+            return false;
+        }
+    }
+    return true;
+} // ParseAnnotationSpec
+
+
+
+/*
+ * LoadAnnotationSpec
+ * This function reads a batch spec file into an AnnotationSpec, in the
+ * format ParseAnnotationSpec describes.
+ * Input: specPath [IN] - path of the spec file
+ *        spec [OUT] - receives the parsed answers
+ * Return: bool - returns true if the file was read and parsed, false
+ *                otherwise. Side effect: prints errors with line numbers.
+ */
+bool LoadAnnotationSpec(const string& specPath, AnnotationSpec& spec)
+{
+    ifstream specFile(specPath);
+    if (!specFile.is_open())
+    {
+        cout << "Error: Cannot open spec file " << specPath << endl;
+        return false;
+    }
+    string errorMessage;
+    if (!ParseAnnotationSpec(specFile, specPath, spec, errorMessage))
+    {
+        cout << "Error: " << errorMessage << endl;
+        return false;
+    }
+    return true;
+} // LoadAnnotationSpec
+
+
+
+/*
+ * FunctionAnswers
+ * What to do for one detected function: its header comment fields and
+ * whether to mark the closing brace.
+ */
+struct FunctionAnswers
+{
+    bool addHeader = false;
+    bool addEndComment = false;
+    string name;
+    string description;
+    string parameters;
+    string returnDesc;
+};
+
+
+
+/*
+ * AskFunctionAnswers
+ * This function prompts the user about a detected function definition.
+ * When the signature can be read, every named parameter is asked about
+ * with its mode already filled in, and a void function is not asked
+ * what it returns.
+ * Input: line [IN] - the function definition line
+ *        head [IN] - the whole head, which may span lines
+ *        siteIndex [IN] - how many sites of the file came before it
+ *        siteCount [IN] - number of sites in the file, for the progress
+ * Return: FunctionAnswers - returns the user's answers. The end comment
+ *                           is asked later, when the body closes.
+ *                           Side effect: displays prompts to user.
+ */
+FunctionAnswers AskFunctionAnswers(string_view line, string_view head, size_t siteIndex, size_t siteCount)
+{
+    FunctionAnswers answers;
+    cout << "[" << siteIndex + 1 << "/" << siteCount << "] Found function: " << line << endl;
+    
+    string answer;
+    cout << "Add function comment? (y/n): ";
+    ReadAnswer(answer);
+    
+    if (answer == "y" || answer == "Y")
+    {
+        answers.addHeader = true;
+        
+        cout << "Enter function name: ";
+        ReadAnswer(answers.name);
+        
+        cout << "What does this function do? ";
+        ReadAnswer(answers.description);
+        
+        FunctionSignature signature;
+        bool parsed = ParseFunctionSignature(head, signature);
+        string hasParams;
+        if (parsed)
+        {
+            for (const FunctionParameter& parameter : signature.parameters)
+            {
+                if (parameter.name.empty())
+                {
+                    continue;
+                }
+                string paramDesc;
+                cout << "What does '" << parameter.name << "' [" << parameter.mode << "] do? ";
+                ReadAnswer(paramDesc);
+                if (!answers.parameters.empty())
+                {
+                    answers.parameters += '\n';
+                }
+                answers.parameters += parameter.name + " [" + parameter.mode + "] -- " + paramDesc;
+            }
+        }
+        else
+        {
+            cout << "Does this function have parameters? (y/n): ";
+            ReadAnswer(hasParams);
+        }
+        
+        if (hasParams == "y" || hasParams == "Y")
+        {
+            string paramName;
+            string paramDesc;
+            
+            cout << "Enter parameter name: ";
+            ReadAnswer(paramName);
+            
+            cout << "What does '" << paramName << "' do? ";
+            ReadAnswer(paramDesc);
+            
+            string paramMode = GetValidParameterMode(paramName);
+            
+            answers.parameters = paramName + " [" + paramMode + "] -- " + paramDesc;
+        }
+        
+        if (!parsed)
+        {
+            cout << "What does this function return? (or Enter for void): ";
+            ReadAnswer(answers.returnDesc);
+        }
+        else if (!signature.returnType.empty() && signature.returnType != "void")
+        {
+            cout << "What does this function return (" << signature.returnType << ")? ";
+            ReadAnswer(answers.returnDesc);
+        }
+    }
+    else
+    {
+        // Still need to get function name for end detection
+        cout << "Enter function name for end detection (or Enter to skip): ";
+        ReadAnswer(answers.name);
+    }
+    
+    cout << endl;
+    return answers;
+} // AskFunctionAnswers
+
+
+
+/*
+ * LookupFunctionAnswers
+ * This function answers a detected function from the batch spec.
+ * Tries the full signature, then the qualified name, then the plain
+ * name. Unmatched functions use the [defaults] section. A header
+ * with no param lines lists the parameters read from the head, each
+ * with its inferred mode.
+ * Input: spec [IN] - the loaded batch spec
+ *        line [IN] - the function definition line
+ *        head [IN] - the whole head, which may span lines
+ * Return: FunctionAnswers - returns the answers for this function.
+ *                           No side effects.
+ */
+FunctionAnswers LookupFunctionAnswers(const AnnotationSpec& spec, string_view line, string_view head)
+{
+    string_view qualifiedName = ExtractFunctionName(line);
+    string_view plainName = qualifiedName;
+    size_t scopePos = qualifiedName.rfind("::");
+    if (scopePos != string_view::npos)
+    {
+        plainName = qualifiedName.substr(scopePos + 2);
+    }
+    
+    const SiteSpec* site = &spec.defaults;
+    SiteSpecMap::const_iterator found = spec.functions.find(TrimWhitespace(line));
+    if (found == spec.functions.end())
+    {
+        found = spec.functions.find(qualifiedName);
+    }
+    if (found == spec.functions.end())
+    {
+        found = spec.functions.find(plainName);
+    }
+    if (found != spec.functions.end())
+    {
+        site = &found->second;
+    }
+    
+    FunctionAnswers answers;
+    answers.addHeader = site->addComment;
+    answers.addEndComment = site->hasEndAnswer ? site->addEndComment
+                                               : spec.defaults.addEndComment;
+    
+    // Copy text only when something will be written, so skipped
+    // functions cost no allocations
+    if (answers.addHeader || answers.addEndComment)
+    {
+        answers.name = site->functionName.empty() ? string(qualifiedName) : site->functionName;
+    }
+    if (answers.addHeader)
+    {
+        answers.description = site->description;
+        answers.parameters = site->parameters;
+        answers.returnDesc = site->returnDesc;
+        
+        FunctionSignature signature;
+        if (answers.parameters.empty() && ParseFunctionSignature(head, signature))
+        {
+            for (const FunctionParameter& parameter : signature.parameters)
+            {
+                if (parameter.name.empty())
+                {
+                    continue;
+                }
+                if (!answers.parameters.empty())
+                {
+                    answers.parameters += '\n';
+                }
+                answers.parameters += parameter.name + " [" + parameter.mode + "]";
+            }
+        }
+    }
+    return answers;
+} // LookupFunctionAnswers
+
+
+
+/*
+ * LineAnswer
+ * A remembered answer for an I/O, control or variable statement.
+ */
+struct LineAnswer
+{
+    bool addComment = false;
+    string comment;
+};
+
+
+
+/*
+ * ReusePolicy
+ * When an earlier answer exists for a statement: use it without asking,
+ * show it and let Enter keep it, or ignore it and ask again.
+ */
+enum ReusePolicy
+{
+    REUSE_ALWAYS,
+    REUSE_CONFIRM,
+    REUSE_NEVER
+};
+
+
+
+/*
+ * CAnnotationCache
+ * Remembers the annotated output of every function from earlier runs,
+ * keyed by file path and a hash of the function's source text. When a
+ * function has not changed, its old output is reused and nothing is
+ * asked. Lookups only read what was loaded, so worker threads can share
+ * one cache; results of this run are stored under a lock. It also
+ * keeps the answers given for single statements, keyed by a hash of the
+ * normalized line, so they can be offered again anywhere.
+ */
+class CAnnotationCache
+{
+public:
+    bool Load(const string& cachePath);
+    bool Save(const string& cachePath) const;
+    const string* Find(const string& filePath, uint64_t functionHash) const;
+    void Store(const string& filePath, map<uint64_t, string>& functionOutputs);
+    bool FindAnswer(uint64_t lineKey, LineAnswer& answer) const;
+    void StoreAnswer(uint64_t lineKey, bool addComment, const string& comment);
+    
+private:
+    typedef map<uint64_t, string> FunctionOutputs;
+    
+    map<string, FunctionOutputs> m_previous;   // loaded at start, read-only
+    map<string, FunctionOutputs> m_current;    // files annotated this run
+    map<uint64_t, LineAnswer> m_answers;       // by normalized line, any file
+    mutable mutex m_lock;
+};
+
+
+
+/*
+ * CAnnotationCache::Load
+ * This function reads the cache file. A missing file is an empty cache;
+ * a damaged one is ignored with a warning.
+ * Input: cachePath [IN] - path of the cache file
+ * Return: bool - returns true if the cache was read or did not exist,
+ *                false if it was damaged. Side effect: prints a warning.
+ */
+bool CAnnotationCache::Load(const string& cachePath)
+{
+    ifstream cacheFile(cachePath, ios::binary);
+    if (!cacheFile.is_open())
+    {
+        return true;
+    }
+    cacheFile.seekg(0, ios::end);
+    streamoff fileSize = cacheFile.tellg();
+    cacheFile.seekg(0, ios::beg);
+    
+    string line;
+    getline(cacheFile, line);
+    if (line != "commentgen-cache 1")
+    {
+        cout << "Warning: ignoring unknown cache file " << cachePath << endl;
+        return false;
+    }
+    
+    // Records are "file <length>", "function <hash> <length>" or
+    // "answer <hash> <0|1> <length>", each followed by that many bytes
+    // and a newline
+    FunctionOutputs* currentFile = nullptr;
+    while (getline(cacheFile, line))
+    {
+        istringstream record(line);
+        string kind;
+        uint64_t recordHash = 0;
+        int addComment = 0;
+        size_t length = 0;
+        record >> kind;
+        if (kind == "function" || kind == "answer")
+        {
+            record >> hex >> recordHash >> dec;
+        }
+        if (kind == "answer")
+        {
+            record >> addComment;
+        }
+        record >> length;
+        
+        // A length the rest of the file cannot hold is damage, not a
+        // reason to allocate
+        bool valid = record && (kind == "file" || kind == "function" || kind == "answer") &&
+                     !(kind == "function" && currentFile == nullptr) &&
+                     length < (size_t)(fileSize - cacheFile.tellg());
+        string contents;
+        if (valid)
+        {
+            contents.resize(length);
+            valid = cacheFile.read(&contents[0], (streamsize)length) && cacheFile.get() == '\n';
+        }
+        if (!valid)
+        {
+            cout << "Warning: ignoring damaged cache file " << cachePath << endl;
+            m_previous.clear();
+            m_answers.clear();
+            return false;
+        }
+        
+        if (kind == "file")
+        {
+            currentFile = &m_previous[contents];
+        }
+        else if (kind == "function")
+        {
+            (*currentFile)[recordHash] = contents;
+        }
+        else
+        {
+            m_answers[recordHash].addComment = (addComment != 0);
+            m_answers[recordHash].comment = contents;
+        }
+    }
+    return true;
+} // CAnnotationCache::Load
+
+
+
+/*
+ * CAnnotationCache::Save
+ * This function writes the cache: this run's files plus any older files
+ * that were not annotated this time. It writes a uniquely named
+ * temporary file first and renames it, so an interrupted save keeps the
+ * old cache and two runs saving at once cannot mix their writes.
+ * Input: cachePath [IN] - path of the cache file
+ * Return: bool - returns true if the cache was written, false otherwise.
+ *                Side effect: replaces the cache file.
+ */
+bool CAnnotationCache::Save(const string& cachePath) const
+{
+    lock_guard<mutex> guard(m_lock);
+    string temporaryPath;
+    if (!CreateTemporaryFile(cachePath + ".tmp.XXXXXX", temporaryPath))
+    {
+        return false;
+    }
+    ofstream cacheFile(temporaryPath, ios::binary | ios::trunc);
+    if (!cacheFile.is_open())
+    {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+    
+    cacheFile << "commentgen-cache 1\n";
+    for (int pass = 0; pass < 2; pass++)
+    {
+        const map<string, FunctionOutputs>& files = (pass == 0) ? m_current : m_previous;
+        for (const auto& file : files)
+        {
+            if (pass == 1 && m_current.count(file.first) > 0)
+            {
+                continue;
+            }
+            cacheFile << "file " << file.first.length() << "\n" << file.first << "\n";
+            for (const auto& function : file.second)
+            {
+                cacheFile << "function " << hex << function.first << dec << " "
+                          << function.second.length() << "\n" << function.second << "\n";
+            }
+        }
+    }
+    for (const auto& answer : m_answers)
+    {
+        cacheFile << "answer " << hex << answer.first << dec << " " << (answer.second.addComment ? 1 : 0)
+                  << " " << answer.second.comment.length() << "\n" << answer.second.comment << "\n";
+    }
+    
+    cacheFile.close();
+    if (!cacheFile || rename(temporaryPath.c_str(), cachePath.c_str()) != 0)
+    {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+    return true;
+} // CAnnotationCache::Save
+
+
+
+/*
+ * CAnnotationCache::Find
+ * This function looks up the earlier output of a function.
+ * Input: filePath [IN] - absolute path of the source file
+ *        functionHash [IN] - hash of the function's source text
+ * Return: const string* - returns the cached output, or nullptr if the
+ *                         function is new or changed. No side effects.
+ */
+const string* CAnnotationCache::Find(const string& filePath, uint64_t functionHash) const
+{
+    map<string, FunctionOutputs>::const_iterator file = m_previous.find(filePath);
+    if (file == m_previous.end())
+    {
+        return nullptr;
+    }
+    FunctionOutputs::const_iterator function = file->second.find(functionHash);
+    return (function == file->second.end()) ? nullptr : &function->second;
+} // CAnnotationCache::Find
+
+
+
+/*
+ * CAnnotationCache::Store
+ * This function records the functions of one file from this run,
+ * replacing what the file had before. Functions that no longer exist
+ * drop out of the cache.
+ * Input: filePath [IN] - absolute path of the source file
+ *        functionOutputs [IN/OUT] - output per function hash; emptied
+ * Return: void - no return value. No side effects.
+ */
+void CAnnotationCache::Store(const string& filePath, map<uint64_t, string>& functionOutputs)
+{
+    lock_guard<mutex> guard(m_lock);
+    m_current[filePath].swap(functionOutputs);
+} // CAnnotationCache::Store
+
+
+
+/*
+ * CAnnotationCache::FindAnswer
+ * This function looks up the answer given earlier for a statement. The
+ * answer is copied while the lock is held, since another thread may
+ * store a new one for the same statement at any time.
+ * Input: lineKey [IN] - hash of the site kind and normalized line
+ *        answer [OUT] - receives a copy of the earlier answer
+ * Return: bool - returns true if there is an earlier answer, false
+ *                otherwise. No side effects.
+ */
+bool CAnnotationCache::FindAnswer(uint64_t lineKey, LineAnswer& answer) const
+{
+    lock_guard<mutex> guard(m_lock);
+    map<uint64_t, LineAnswer>::const_iterator found = m_answers.find(lineKey);
+    if (found == m_answers.end())
+    {
+        return false;
+    }
+    answer = found->second;
+    return true;
+} // CAnnotationCache::FindAnswer
+
+
+
+/*
+ * CAnnotationCache::StoreAnswer
+ * This function remembers the answer for a statement, replacing any
+ * earlier one. It is offered again later in this run and in later runs.
+ * Input: lineKey [IN] - hash of the site kind and normalized line
+ *        addComment [IN] - whether the user wanted a comment
+ *        comment [IN] - the comment text
+ * Return: void - no return value. No side effects.
+ */
+void CAnnotationCache::StoreAnswer(uint64_t lineKey, bool addComment, const string& comment)
+{
+    lock_guard<mutex> guard(m_lock);
+    LineAnswer& answer = m_answers[lineKey];
+    answer.addComment = addComment;
+    answer.comment = comment;
+} // CAnnotationCache::StoreAnswer
+
+
+
+/*
+ * ChangedFile
+ * What a --changed run may touch in one file: the lines that differ
+ * from the revision, as 0-based inclusive ranges in line order, and
+ * whether the file is new since then.
+ */
+struct LineRange
+{
+    size_t firstLine;
+    size_t lastLine;
+};
+
+struct ChangedFile
+{
+    vector<LineRange> ranges;
+    bool added = false;
+};
+
+
+
+/*
+ * AnnotationSession
+ * Where answers come from while annotating, and the optional cache of
+ * earlier runs.
+ */
+struct AnnotationSession
+{
+    const AnnotationSpec* spec = nullptr;   // nullptr: ask the user
+    CAnnotationCache* cache = nullptr;      // nullptr: no reuse
+    uint64_t cacheSeed = 0;                 // mixes the answer source into hashes
+    ReusePolicy reusePolicy = REUSE_CONFIRM; // for remembered statement answers
+    int splitThreads = 1;                   // threads one large file may be cut across
+    const map<string, ChangedFile>* changedFiles = nullptr;   // --changed, by CacheKeyPath;
+                                                              // nullptr: whole files
+};
+
+// Files from this size on are cut up when there are threads to spare,
+// into this many pieces per thread so the threads finish together
+const size_t SPLIT_MIN_FILE_BYTES = 1 << 20;
+const size_t SPLIT_CHUNKS_PER_THREAD = 4;
+
+
+
+/*
+ * NormalizeCodeLine
+ * This function trims a code line and collapses every run of spaces and
+ * tabs to one space, so the same statement matches at any indent.
+ * Input: line [IN] - the code line
+ *        normalized [OUT] - receives the normalized text
+ * Return: void - no return value. No side effects.
+ */
+void NormalizeCodeLine(string_view line, string& normalized)
+{
+    normalized.clear();
+    line = TrimWhitespace(line);
+    bool lastWasSpace = false;
+    for (char c : line)
+    {
+        bool isSpace = (c == ' ' || c == '\t' || c == '\r');
+        if (!isSpace || !lastWasSpace)
+        {
+            normalized += isSpace ? ' ' : c;
+        }
+        lastWasSpace = isSpace;
+    }
+} // NormalizeCodeLine
+
+
+
+/*
+ * GetLineComment
+ * This function decides whether an I/O, control or variable line gets
+ * a comment, either by asking the user or from the batch spec. When
+ * asking, answers are remembered by normalized line so the same
+ * statement is only asked about once, in this run and later ones.
+ * Input: session [IN] - batch spec or answer cache and reuse policy
+ *        kind [IN] - which kind of site the line is
+ *        line [IN] - the code line
+ *        comment [OUT] - receives the comment text
+ * Return: bool - returns true if a comment should be written, false
+ *                otherwise. Side effect: prompts user when interactive.
+ */
+bool GetLineComment(const AnnotationSession& session, SiteKind kind, string_view line,
+                    string& comment)
+{
+    const AnnotationSpec* spec = session.spec;
+    if (spec != nullptr)
+    {
+        const SiteSpecMap& sites = (kind == SITE_IO) ? spec->ioLines :
+                                   (kind == SITE_CONTROL) ? spec->controlLines :
+                                   spec->variableLines;
+        SiteSpecMap::const_iterator found = sites.find(TrimWhitespace(line));
+        if (found == sites.end() || found->second.comment.empty())
+        {
+            return false;
+        }
+        comment = found->second.comment;
+        return true;
+    }
+    
+    const char* foundText = (kind == SITE_IO) ? "Found I/O statement: " :
+                            (kind == SITE_CONTROL) ? "Found control statement: " :
+                            "Found variable: ";
+    const char* addText = (kind == SITE_IO) ? "Add comment for this I/O? (y/n): " :
+                          (kind == SITE_CONTROL) ? "Add comment for this control statement? (y/n): " :
+                          "Add variable comment? (y/n): ";
+    const char* askText = (kind == SITE_IO) ? "What does this I/O do? " :
+                          (kind == SITE_CONTROL) ? "What does this control statement do? " :
+                          "What is this variable for? ";
+    
+    cout << foundText << line << endl;
+    
+    // Look for an earlier answer to the same statement
+    uint64_t answerKey = 0;
+    LineAnswer earlier;
+    bool hasEarlier = false;
+    if (session.cache != nullptr && session.reusePolicy != REUSE_NEVER)
+    {
+        string normalized;
+        NormalizeCodeLine(line, normalized);
+        answerKey = HashBytes(normalized.data(), normalized.length(), HASH_SEED + kind);
+        hasEarlier = session.cache->FindAnswer(answerKey, earlier);
+    }
+    
+    if (hasEarlier)
+    {
+        string earlierText = earlier.addComment ? "// " + earlier.comment : "no comment";
+        bool keep = true;
+        if (session.reusePolicy == REUSE_ALWAYS)
+        {
+            cout << "Using earlier answer: " << earlierText << endl;
+        }
+        else
+        {
+            string answer;
+            cout << "Earlier answer: " << earlierText << endl;
+            cout << "Keep it? (Y/n): ";
+            ReadAnswer(answer);
+            keep = (answer.empty() || answer == "y" || answer == "Y");
+        }
+        
+        if (keep)
+        {
+            comment = earlier.comment;
+            cout << endl;
+            return earlier.addComment;
+        }
+    }
+    
+    string answer;
+    cout << addText;
+    ReadAnswer(answer);
+    
+    bool addComment = (answer == "y" || answer == "Y");
+    if (addComment)
+    {
+        cout << askText;
+        ReadAnswer(comment);
+    }
+    cout << endl;
+    
+    if (session.cache != nullptr)
+    {
+        if (answerKey == 0)
+        {
+            string normalized;
+            NormalizeCodeLine(line, normalized);
+            answerKey = HashBytes(normalized.data(), normalized.length(), HASH_SEED + kind);
+        }
+        session.cache->StoreAnswer(answerKey, addComment, comment);
+    }
+    return addComment;
+} // GetLineComment
+
+
+
+/*
+ * IsCommentLine
+ * This function checks if a line holds only comment text, including
+ * lines inside a block comment. Such lines are copied as they are.
+ * Input: span [IN] - scanner info for the line
+ * Return: bool - returns true for comment lines, false otherwise.
+ *                No side effects.
+ */
+bool IsCommentLine(const LineSpan& span)
+{
+    return !span.hasCode;
+} // IsCommentLine
+
+
+
+/*
+ * WriteSourceLine
+ * This function queues an unchanged source line and its line end.
+ * The '\n' is taken from the source when there is one, so runs of
+ * unchanged lines stay one contiguous span.
+ * Input: output [IN/OUT] - writer to queue the line on
+ *        source [IN] - the source code text
+ *        sourceLength [IN] - size of source in bytes
+ *        span [IN] - the line to write
+ * Return: void - no return value. Side effect: queues output.
+ */
+void WriteSourceLine(COutputWriter& output, const char* source, size_t sourceLength,
+                     const LineSpan& span)
+{
+    if (span.start + span.length < sourceLength)
+    {
+        output.AddSource(source + span.start, span.length + 1);
+    }
+    else
+    {
+        // Last line had no '\n' in the file
+        output.AddSource(source + span.start, span.length);
+        output.AddText("\n");
+    }
+} // WriteSourceLine
+
+
+
+/*
+ * ExistingDoc
+ * What kind of documentation sits right in front of a function.
+ */
+enum ExistingDoc
+{
+    DOC_NONE,       // nothing usable, ask as usual
+    DOC_CONVERT,    // a /* Name / description / Input: / Return: */ block
+    DOC_KEEP        // a header this program already wrote
+};
+
+
+
+/*
+ * StartsDocComment
+ * This function checks if a comment line could start a function's
+ * documentation: a block comment, a "// ==== Name" header line, or the
+ * first line of the current style's function header.
+ * Input: line [IN] - the comment line
+ *        headerMarker [IN] - what the style's headers start with
+ * Return: bool - returns true if the line should be held back until
+ *                the next line of code shows what follows it.
+ */
+bool StartsDocComment(string_view line, string_view headerMarker)
+{
+    string_view text = TrimWhitespace(line);
+    string_view markerLine = headerMarker.substr(0, headerMarker.find('\n'));
+    return (text.compare(0, 2, "/*") == 0 || text.compare(0, 8, "// ==== ") == 0 ||
+            (!markerLine.empty() && text.compare(0, markerLine.length(), markerLine) == 0));
+} // StartsDocComment
+
+
+
+/*
+ * StartsWithMarker
+ * This function checks if any line of some text starts with a marker.
+ * Input: text [IN] - the lines to look at
+ *        marker [IN] - the text to look for, may span lines
+ * Return: bool - returns true if a line starts with marker.
+ *                No side effects.
+ */
+bool StartsWithMarker(string_view text, string_view marker)
+{
+    for (size_t found = text.find(marker); found != string_view::npos; found = text.find(marker, found + 1))
+    {
+        if (found == 0 || text[found - 1] == '\n')
+        {
+            return true;
+        }
+    }
+    return false;
+} // StartsWithMarker
+
+
+
+/*
+ * AddParameterLine
+ * This function adds one line of an Input: section to the parameter
+ * text. A line with a mode like [IN] or a " - " starts a new parameter;
+ * anything else continues the one before it.
+ * Input: text [IN] - the trimmed line
+ *        parameters [IN/OUT] - parameter descriptions, one per line
+ * Return: void - no return value. No side effects.
+ */
+void AddParameterLine(string_view text, string& parameters)
+{
+    if (text.empty())
+    {
+        return;
+    }
+    bool startsParameter = (text.find(" [") != string_view::npos || text.find(" - ") != string_view::npos);
+    if (!parameters.empty())
+    {
+        parameters += startsParameter ? '\n' : ' ';
+    }
+    parameters.append(text.data(), text.length());
+} // AddParameterLine
+
+
+
+/*
+ * ParseExistingDoc
+ * This function reads the comment lines held in front of a function.
+ * Lines with a header this program wrote, in the course style or the
+ * current one, are kept as they are. A block comment in the style of
+ * this file - name, description, Input:, Return: - is mapped onto the
+ * fields of CreateFunctionHeader.
+ * Input: heldLines [IN] - the comment and blank lines, '\n' terminated
+ *        headerMarker [IN] - what the current style's headers start with
+ *        answers [OUT] - receives the header fields for DOC_CONVERT
+ * Return: ExistingDoc - returns what the held lines turned out to be.
+ *                       No side effects.
+ */
+ExistingDoc ParseExistingDoc(string_view heldLines, string_view headerMarker, FunctionAnswers& answers)
+{
+    if (StartsWithMarker(heldLines, "// ==== ") ||
+        (!headerMarker.empty() && StartsWithMarker(heldLines, headerMarker)))
+    {
+        return DOC_KEEP;
+    }
+    
+    // Only one block comment, with nothing but blank lines after it
+    size_t blockStart = heldLines.find("/*");
+    size_t blockEnd = heldLines.find("*/", blockStart + 2);
+    if (blockStart == string_view::npos || blockEnd == string_view::npos ||
+        !TrimWhitespace(heldLines.substr(blockEnd + 2)).empty())
+    {
+        return DOC_NONE;
+    }
+    string_view block = heldLines.substr(blockStart + 2, blockEnd - blockStart - 2);
+    
+    enum { FIELD_NAME, FIELD_DESCRIPTION, FIELD_INPUT, FIELD_RETURN } field = FIELD_NAME;
+    size_t lineStart = 0;
+    while (lineStart < block.length())
+    {
+        size_t lineEnd = block.find('\n', lineStart);
+        if (lineEnd == string_view::npos)
+        {
+            lineEnd = block.length();
+        }
+        string_view text = TrimWhitespace(block.substr(lineStart, lineEnd - lineStart));
+        lineStart = lineEnd + 1;
+        
+        // Drop the " * " margin, and a second '*' of a /** block
+        while (!text.empty() && text[0] == '*')
+        {
+            text = TrimWhitespace(text.substr(1));
+        }
+        if (text.empty())
+        {
+            continue;
+        }
+        
+        if (text.compare(0, 6, "Input:") == 0)
+        {
+            field = FIELD_INPUT;
+            text = TrimWhitespace(text.substr(6));
+        }
+        else if (text.compare(0, 7, "Return:") == 0)
+        {
+            field = FIELD_RETURN;
+            text = TrimWhitespace(text.substr(7));
+        }
+        
+        switch (field)
+        {
+            case FIELD_NAME:
+                // A name is one word, e.g. main or CCounter::Increment
+                if (text.find_first_of(" \t") != string_view::npos)
+                {
+                    return DOC_NONE;
+                }
+                answers.name = string(text);
+                field = FIELD_DESCRIPTION;
+                break;
+            case FIELD_DESCRIPTION:
+                if (!answers.description.empty())
+                {
+                    answers.description += ' ';
+                }
+                answers.description.append(text.data(), text.length());
+                break;
+            case FIELD_INPUT:
+                AddParameterLine(text, answers.parameters);
+                break;
+            case FIELD_RETURN:
+                if (!answers.returnDesc.empty() && !text.empty())
+                {
+                    answers.returnDesc += ' ';
+                }
+                answers.returnDesc.append(text.data(), text.length());
+                break;
+        }
+    }
+    
+    if (answers.name.empty() ||
+        (answers.description.empty() && answers.parameters.empty() && answers.returnDesc.empty()))
+    {
+        return DOC_NONE;
+    }
+    answers.addHeader = true;
+    return DOC_CONVERT;
+} // ParseExistingDoc
+
+
+
+/*
+ * DocumentSite
+ * A code line that starts a function or may get a line comment, with
+ * what ClassifyLine found in it.
+ */
+struct DocumentSite
+{
+    size_t lineIndex;
+    unsigned features;
+    size_t node;                  // a function's node in the scope tree, else NO_SCOPE
+};
+
+const size_t NO_FUNCTION_END = (size_t)-1;
+const size_t NO_SCOPE = (size_t)-1;
+
+/*
+ * DocumentScope
+ * A function found in the file: where its documentation and body are,
+ * and what was done about its header.
+ */
+struct DocumentScope
+{
+    size_t docLine;               // first line of its documentation, or startLine
+    size_t startLine;
+    size_t endLine;               // NO_FUNCTION_END until the closing line is seen
+    string_view name;             // empty when no name was given
+    ExistingDoc existingDoc;
+    bool addedHeader;
+    bool fromCache;
+};
+
+/*
+ * ScopeNode
+ * One pair of braces in the scope tree, in the order they open. Classes
+ * cover struct, union and enum too; namespaces cover extern "C" blocks.
+ */
+enum ScopeKind
+{
+    SCOPE_NAMESPACE,
+    SCOPE_CLASS,
+    SCOPE_FUNCTION,
+    SCOPE_LAMBDA,
+    SCOPE_BLOCK                   // control bodies, initializers and the rest
+};
+
+struct ScopeNode
+{
+    ScopeKind kind;
+    size_t parent;                // NO_SCOPE at file level or opened in an earlier piece
+    size_t headLine;              // first line of its head, e.g. a template line
+    size_t nameLine;              // line with a function's name, else openLine
+    size_t openLine;
+    size_t endLine;               // NO_FUNCTION_END until the '}' is seen
+    size_t depth;                 // scopes around it, with those open from earlier pieces
+    string_view name;             // qualified, e.g. "shapes::CCounter::Increment";
+                                  // empty for lambdas, blocks and anonymous scopes
+};
+
+
+
+/*
+ * CSymbolTable
+ * The classes and namespaces seen so far, by qualified name, in an
+ * open-addressing hash table. The names are kept in one string, so a
+ * lookup is a hash and, nearly always, one compare.
+ */
+class CSymbolTable
+{
+public:
+    void Add(string_view qualifiedName, ScopeKind kind);
+    bool Find(string_view qualifiedName, ScopeKind& kind) const;
+    
+private:
+    struct Slot
+    {
+        uint64_t hash;
+        size_t nameOffset;
+        size_t nameLength;
+        ScopeKind kind;
+        bool used;
+    };
+    
+    size_t FindSlot(string_view qualifiedName, uint64_t hash) const;
+    void Grow();
+    
+    vector<Slot> m_slots;         // a power of two, at most half full
+    string m_names;
+    size_t m_count = 0;
+};
+
+
+
+/*
+ * ScopeState
+ * What the scope tree builder carries from one line, or one piece of a
+ * stream, to the next: the scopes still open, the qualifier they make
+ * and the symbols seen so far.
+ */
+struct ScopeFrame
+{
+    ScopeKind kind;
+    size_t node;                  // index in the current tree, or NO_SCOPE
+    size_t prefixLength;          // length of ScopeState::prefix before it opened
+    bool resumeHead;              // a braced initializer inside a head
+    size_t headLine;              // where that head started
+    size_t headOffset;
+};
+
+struct HeadToken
+{
+    string_view text;
+    size_t lineIndex;
+};
+
+struct BraceEvent
+{
+    char symbol;                  // '{', '}' or ';'
+    size_t position;
+};
+
+struct ScopeState
+{
+    vector<ScopeFrame> frames;
+    string prefix;                // qualified name of the innermost class or namespace
+    CSymbolTable symbols;
+    bool inDirective = false;     // the last line was a preprocessor line ending in '\'
+    
+    // Reused for every line and head, so scanning does not allocate
+    vector<BraceEvent> events;
+    vector<HeadToken> tokens;
+    string nameScratch;
+    string qualifiedScratch;
+};
+
+
+
+/*
+ * CSymbolTable::Add
+ * This function records a class or namespace. A name added twice keeps
+ * its first kind.
+ * Input: qualifiedName [IN] - e.g. "shapes::CCounter"
+ *        kind [IN] - SCOPE_CLASS or SCOPE_NAMESPACE
+ * Return: void - no return value. No side effects.
+ */
+void CSymbolTable::Add(string_view qualifiedName, ScopeKind kind)
+{
+    if ((m_count + 1) * 2 > m_slots.size())
+    {
+        Grow();
+    }
+    uint64_t hash = HashBytes(qualifiedName.data(), qualifiedName.length());
+    Slot& slot = m_slots[FindSlot(qualifiedName, hash)];
+    if (slot.used)
+    {
+        return;
+    }
+    slot.hash = hash;
+    slot.nameOffset = m_names.length();
+    slot.nameLength = qualifiedName.length();
+    slot.kind = kind;
+    slot.used = true;
+    m_names.append(qualifiedName.data(), qualifiedName.length());
+    m_count++;
+} // CSymbolTable::Add
+
+
+
+/*
+ * CSymbolTable::Find
+ * This function looks up a class or namespace.
+ * Input: qualifiedName [IN] - the fully qualified name
+ *        kind [OUT] - receives its kind when found
+ * Return: bool - returns true if the name was added, false otherwise.
+ *                No side effects.
+ */
+bool CSymbolTable::Find(string_view qualifiedName, ScopeKind& kind) const
+{
+    if (m_count == 0)
+    {
+        return false;
+    }
+    const Slot& slot = m_slots[FindSlot(qualifiedName, HashBytes(qualifiedName.data(), qualifiedName.length()))];
+    if (slot.used)
+    {
+        kind = slot.kind;
+    }
+    return slot.used;
+} // CSymbolTable::Find
+
+
+
+/*
+ * CSymbolTable::FindSlot
+ * This function probes for a name: the slot holding it, or the empty
+ * slot it would go in.
+ * Input: qualifiedName [IN] - the name
+ *        hash [IN] - its HashBytes value
+ * Return: size_t - returns the slot index. No side effects.
+ */
+size_t CSymbolTable::FindSlot(string_view qualifiedName, uint64_t hash) const
+{
+    size_t mask = m_slots.size() - 1;
+    size_t index = (size_t)hash & mask;
+    while (m_slots[index].used &&
+           (m_slots[index].hash != hash ||
+            string_view(m_names).substr(m_slots[index].nameOffset, m_slots[index].nameLength) != qualifiedName))
+    {
+        index = (index + 1) & mask;
+    }
+    return index;
+} // CSymbolTable::FindSlot
+
+
+
+/*
+ * CSymbolTable::Grow
+ * This function doubles the table and places every name again.
+ * Input: none
+ * Return: void - no return value. No side effects.
+ */
+void CSymbolTable::Grow()
+{
+    vector<Slot> oldSlots(m_slots.empty() ? 32 : m_slots.size() * 2, Slot{});
+    oldSlots.swap(m_slots);
+    size_t mask = m_slots.size() - 1;
+    for (const Slot& slot : oldSlots)
+    {
+        if (slot.used)
+        {
+            size_t index = (size_t)slot.hash & mask;
+            while (m_slots[index].used)
+            {
+                index = (index + 1) & mask;
+            }
+            m_slots[index] = slot;
+        }
+    }
+} // CSymbolTable::Grow
+
+
+
+/*
+ * PendingInsertion
+ * A change decided while annotating and applied when the document is
+ * written. Insertions are kept in line order; the ones on the same line
+ * apply in the order they were made, before the line is written.
+ */
+enum InsertionKind
+{
+    INSERT_TEXT,                  // text as it is
+    INSERT_FUNCTION_HEADER,       // CreateFunctionHeader, text is the name
+    INSERT_LINE_COMMENT,          // "    // text"
+    INSERT_END_COMMENT,           // the line ends with an end of "text" comment
+    INSERT_SKIP_LINES,            // this line and count - 1 more are left out
+    INSERT_START_CAPTURE,         // the output from here is cached under hash
+    INSERT_STOP_CAPTURE           // ends it; count 1 keeps it, 0 drops it
+};
+
+struct PendingInsertion
+{
+    size_t lineIndex;
+    InsertionKind kind;
+    size_t count;
+    uint64_t hash;
+    string_view text;
+    string_view description;
+    string_view parameters;
+    string_view returnDesc;
+    const CommentStyle* style;    // of a function header
+};
+
+
+
+/*
+ * SourceDocument
+ * The in-memory model of one file, or one piece of a stream: its lines,
+ * its scope tree, the sites and functions in them and the insertions
+ * decided for them.
+ * All of it lives in one arena and is gone after the arena's Reset.
+ */
+struct SourceDocument
+{
+    SourceDocument(CArena& owner, const char* text, size_t textLength)
+        : arena(owner), source(text), sourceLength(textLength),
+          lines(ArenaAllocator<LineSpan>(owner)), sites(ArenaAllocator<DocumentSite>(owner)),
+          scopes(ArenaAllocator<DocumentScope>(owner)),
+          scopeTree(ArenaAllocator<ScopeNode>(owner)),
+          carriedScopeEnds(ArenaAllocator<size_t>(owner)),
+          insertions(ArenaAllocator<PendingInsertion>(owner))
+    {
+    }
+    
+    CArena& arena;
+    const char* source;
+    size_t sourceLength;
+    ArenaVector<LineSpan> lines;
+    ArenaVector<DocumentSite> sites;
+    ArenaVector<DocumentScope> scopes;
+    ArenaVector<ScopeNode> scopeTree;
+    ArenaVector<size_t> carriedScopeEnds;   // by depth, where each scope an earlier
+                                            // piece left open closes, or NO_FUNCTION_END
+    ArenaVector<PendingInsertion> insertions;
+};
+
+// Each thread models one file at a time in its own arena
+thread_local CArena g_documentArena;
+
+
+
+/*
+ * AddInsertion
+ * This function records a change to make before a line.
+ * Input: document [IN/OUT] - the document to change
+ *        lineIndex [IN] - line the change goes before (or on); may be
+ *                         one past the last line
+ *        kind [IN] - what kind of change
+ * Return: PendingInsertion& - returns the new insertion, to fill in its
+ *                             text, count or hash.
+ */
+PendingInsertion& AddInsertion(SourceDocument& document, size_t lineIndex, InsertionKind kind)
+{
+    PendingInsertion insertion = {};
+    insertion.lineIndex = lineIndex;
+    insertion.kind = kind;
+    document.insertions.push_back(insertion);
+    return document.insertions.back();
+} // AddInsertion
+
+
+
+/*
+ * SkipBlanks
+ * This function skips spaces and tabs. It is much cheaper than
+ * find_first_not_of on the short lines the scope tree looks at.
+ * Input: text [IN] - the line text
+ *        position [IN] - where to start
+ * Return: size_t - returns the index of the first other character, or
+ *                  text.length(). No side effects.
+ */
+inline size_t SkipBlanks(string_view text, size_t position)
+{
+    while (position < text.length() && (text[position] == ' ' || text[position] == '\t'))
+    {
+        position++;
+    }
+    return position;
+} // SkipBlanks
+
+
+
+/*
+ * CollectBraceEvents
+ * This function lists the braces and semicolons of one line's code in
+ * the order they appear. A line the quick walk cannot read the way the
+ * lexer did, e.g. one that starts inside a block comment, gets its
+ * events from the lexer's counts instead: closes first when the line
+ * starts with '}', then opens, then semicolons.
+ * Input: text [IN] - the line text
+ *        span [IN] - scanner info for the line
+ *        events [OUT] - receives the events
+ * Return: void - no return value. No side effects.
+ */
+void CollectBraceEvents(string_view text, const LineSpan& span, vector<BraceEvent>& events)
+{
+    events.clear();
+    int openCount = 0;
+    int closeCount = 0;
+    int semicolonCount = 0;
+    size_t position = 0;
+    while (position < text.length())
+    {
+        char c = text[position];
+        if (c == '/' && position + 1 < text.length() && text[position + 1] == '/')
+        {
+            break;
+        }
+        if (c == '/' && position + 1 < text.length() && text[position + 1] == '*')
+        {
+            size_t commentEnd = text.find("*/", position + 2);
+            position = (commentEnd == string_view::npos) ? text.length() : commentEnd + 2;
+            continue;
+        }
+        if (c == '"' && StartsRawString(text, position))
+        {
+            break;
+        }
+        if (c == '"' || (c == '\'' && !IsDigitSeparator(text, position)))
+        {
+            position++;
+            while (position < text.length() && text[position] != c)
+            {
+                position += (text[position] == '\\') ? 2 : 1;
+            }
+            position++;
+            continue;
+        }
+        if (c == '{' || c == '}' || c == ';')
+        {
+            events.push_back(BraceEvent{c, position});
+            openCount += (c == '{');
+            closeCount += (c == '}');
+            semicolonCount += (c == ';');
+        }
+        position++;
+    }
+    if (openCount == span.openBraces && closeCount == span.closeBraces && semicolonCount == span.semicolons)
+    {
+        return;
+    }
+    
+    events.clear();
+    size_t openPosition = min(text.find('{'), text.length());
+    size_t closePosition = min(text.find('}'), text.length());
+    bool closeFirst = (TrimWhitespace(text).substr(0, 1) == "}");
+    for (int i = 0; closeFirst && i < span.closeBraces; i++)
+    {
+        events.push_back(BraceEvent{'}', closePosition});
+    }
+    for (int i = 0; i < span.openBraces; i++)
+    {
+        events.push_back(BraceEvent{'{', openPosition});
+    }
+    for (int i = 0; !closeFirst && i < span.closeBraces; i++)
+    {
+        events.push_back(BraceEvent{'}', closePosition});
+    }
+    if (span.semicolons > 0)
+    {
+        events.push_back(BraceEvent{';', text.length()});
+    }
+} // CollectBraceEvents
+
+
+
+/*
+ * TokenizeScopeHead
+ * This function splits the code in front of a '{' into tokens: names,
+ * "::", "->", literals and single punctuation characters. Comments and
+ * preprocessor lines are left out.
+ * Input: document [IN] - the scanned document
+ *        headLine [IN] - line the head starts on
+ *        headOffset [IN] - where in that line it starts
+ *        braceLine [IN] - line of the '{'
+ *        bracePosition [IN] - where in that line the '{' is
+ *        tokens [OUT] - receives the tokens
+ * Return: void - no return value. No side effects.
+ */
+void TokenizeScopeHead(const SourceDocument& document, size_t headLine, size_t headOffset,
+                       size_t braceLine, size_t bracePosition, vector<HeadToken>& tokens)
+{
+    tokens.clear();
+    for (size_t lineIndex = headLine; lineIndex <= braceLine; lineIndex++)
+    {
+        const LineSpan& span = document.lines[lineIndex];
+        if (IsCommentLine(span))
+        {
+            continue;
+        }
+        string_view text(document.source + span.start, span.length);
+        size_t position = (lineIndex == headLine) ? min(headOffset, text.length()) : 0;
+        size_t end = (lineIndex == braceLine) ? bracePosition : text.length();
+        size_t first = SkipBlanks(text, 0);
+        if (position == 0 && first < text.length() && text[first] == '#')
+        {
+            continue;
+        }
+        
+        while (position < end)
+        {
+            char c = text[position];
+            size_t tokenStart = position;
+            if (c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f')
+            {
+                position++;
+                continue;
+            }
+            if (c == '/' && position + 1 < end && text[position + 1] == '/')
+            {
+                break;
+            }
+            if (c == '/' && position + 1 < end && text[position + 1] == '*')
+            {
+                size_t commentEnd = text.find("*/", position + 2);
+                position = (commentEnd == string_view::npos) ? end : commentEnd + 2;
+                continue;
+            }
+            
+            if (c == '"' || (c == '\'' && !IsDigitSeparator(text, position)))
+            {
+                position++;
+                while (position < end && text[position] != c)
+                {
+                    position += (text[position] == '\\') ? 2 : 1;
+                }
+                position = min(position + 1, end);
+            }
+            else if (IsIdentifierChar(c) || (c == '~' && position + 1 < end && IsIdentifierChar(text[position + 1])))
+            {
+                position++;
+                while (position < end && IsIdentifierChar(text[position]))
+                {
+                    position++;
+                }
+            }
+            else if (position + 1 < end && ((c == ':' && text[position + 1] == ':') ||
+                                            (c == '-' && text[position + 1] == '>')))
+            {
+                position += 2;
+            }
+            else
+            {
+                position++;
+            }
+            tokens.push_back(HeadToken{text.substr(tokenStart, position - tokenStart), lineIndex});
+        }
+    }
+} // TokenizeScopeHead
+
+
+
+/*
+ * IsWordToken
+ * This function checks if a head token is a name or keyword.
+ * Input: text [IN] - the token
+ * Return: bool - returns true for words, including "~Name", false
+ *                otherwise. No side effects.
+ */
+bool IsWordToken(string_view text)
+{
+    return !text.empty() && (IsIdentifierChar(text[0]) || text[0] == '~');
+} // IsWordToken
+
+
+
+const size_t NO_TOKEN = (size_t)-1;
+
+/*
+ * IsDeclaratorParen
+ * This function checks if a '(' in a head can open a function's
+ * parameter list: it follows the function's name, or an operator.
+ * Input: tokens [IN] - the head
+ *        index [IN] - index of the '(' token
+ *        operatorIndex [IN] - index of an "operator" token before it, or
+ *                             NO_TOKEN
+ * Return: bool - returns true for a possible parameter list, false
+ *                otherwise. No side effects.
+ */
+bool IsDeclaratorParen(const vector<HeadToken>& tokens, size_t index, size_t operatorIndex)
+{
+    static const string_view notNames[] = {
+        "decltype", "alignas", "alignof", "sizeof", "noexcept", "__attribute__", "__declspec",
+        "throw", "return", "if", "while", "for", "switch", "catch"
+    };
+    
+    if (index == 0)
+    {
+        return false;
+    }
+    if (operatorIndex != NO_TOKEN && index - operatorIndex <= 4)
+    {
+        // The "()" right after the word names operator()
+        return !(index == operatorIndex + 1 && index + 2 < tokens.size() &&
+                 tokens[index + 1].text == ")" && tokens[index + 2].text == "(");
+    }
+    string_view previous = tokens[index - 1].text;
+    if (!IsWordToken(previous))
+    {
+        return false;
+    }
+    for (string_view notName : notNames)
+    {
+        if (previous == notName)
+        {
+            return false;
+        }
+    }
+    return true;
+} // IsDeclaratorParen
+
+
+
+/*
+ * ScopeHead
+ * What ClassifyScopeHead found besides the kind.
+ */
+struct ScopeHead
+{
+    size_t nameFirst = NO_TOKEN;  // tokens of the written name, e.g. CCounter :: Increment
+    size_t nameLast = NO_TOKEN;
+    size_t nameLine = 0;          // line of a function's name
+    bool memberInitializer = false;   // the '{' is a braced initializer inside the head
+};
+
+
+
+/*
+ * ClassifyScopeHead
+ * This function decides what a '{' opens from the tokens in front of
+ * it, back to the last ';', '{' or '}'. The rules, in order: a brace
+ * inside parentheses belongs to a lambda or a braced argument, after
+ * which the head goes on; a control
+ * keyword opens a block; then come namespaces and extern "C", lambdas,
+ * initializers after '=', and class keys. Inside a function every other
+ * brace is a block; elsewhere a name followed by '(' makes a function.
+ * Input: tokens [IN] - the head, from TokenizeScopeHead
+ *        parentKind [IN] - kind of the enclosing scope
+ *        head [OUT] - the written name and, for functions, its line
+ * Return: ScopeKind - returns the kind of the new scope. No side effects.
+ */
+ScopeKind ClassifyScopeHead(const vector<HeadToken>& tokens, ScopeKind parentKind, ScopeHead& head)
+{
+    static const string_view controlWords[] = {
+        "if", "else", "for", "while", "do", "switch", "try", "catch"
+    };
+    static const string_view trailingWords[] = {
+        "const", "volatile", "override", "final", "noexcept", "mutable", "try"
+    };
+    
+    head = ScopeHead();
+    if (tokens.empty())
+    {
+        return SCOPE_BLOCK;
+    }
+    
+    // One pass finds everything the rules look at
+    int parenDepth = 0;
+    int angleDepth = 0;
+    size_t declarator = NO_TOKEN;
+    size_t declaratorClose = NO_TOKEN;
+    size_t classKey = NO_TOKEN;
+    size_t namespaceKey = NO_TOKEN;
+    size_t operatorKey = NO_TOKEN;
+    bool hasIntroducer = false;
+    bool hasAssignment = false;
+    bool hasInitializerList = false;
+    bool externC = false;
+    for (size_t i = 0; i < tokens.size(); i++)
+    {
+        string_view text = tokens[i].text;
+        string_view previous = (i > 0) ? tokens[i - 1].text : string_view();
+        bool topLevel = (parenDepth == 0 && angleDepth == 0);
+        if (IsWordToken(text))
+        {
+            // Only a few words matter, and most names fail on the first letter
+            switch (text[0])
+            {
+                case 'c':
+                case 's':
+                case 'u':
+                case 'e':
+                    if (topLevel && classKey == NO_TOKEN &&
+                        (text == "class" || text == "struct" || text == "union" || text == "enum"))
+                    {
+                        classKey = i;
+                    }
+                    externC |= (text == "extern" && i + 1 < tokens.size() && tokens[i + 1].text[0] == '"');
+                    break;
+                case 'n':
+                    namespaceKey = (text == "namespace") ? i : namespaceKey;
+                    break;
+                case 'o':
+                    operatorKey = (text == "operator") ? i : operatorKey;
+                    break;
+            }
+            continue;
+        }
+        
+        switch (text[0])
+        {
+            case '(':
+                if (topLevel && declarator == NO_TOKEN && IsDeclaratorParen(tokens, i, operatorKey))
+                {
+                    declarator = i;
+                }
+                parenDepth++;
+                break;
+            case ')':
+                parenDepth -= (parenDepth > 0);
+                if (parenDepth == 0 && declarator != NO_TOKEN && declaratorClose == NO_TOKEN)
+                {
+                    declaratorClose = i;
+                }
+                break;
+            case '<':
+                angleDepth += (parenDepth == 0 && IsWordToken(previous) && previous != "operator");
+                break;
+            case '>':
+                angleDepth -= (parenDepth == 0 && angleDepth > 0);
+                break;
+            case '[':
+            {
+                // An introducer, unless it indexes something or is half of [[
+                bool indexes = (IsWordToken(previous) && previous != "return" && previous != "throw") ||
+                               previous == ")" || previous == "]" || previous == "[";
+                hasIntroducer |= (!indexes && (i + 1 == tokens.size() || tokens[i + 1].text != "["));
+                break;
+            }
+            case '=':
+                hasAssignment |= topLevel;
+                break;
+            case ':':
+                hasInitializerList |= (text.length() == 1 && topLevel && declaratorClose != NO_TOKEN);
+                break;
+        }
+    }
+    
+    if (parenDepth > 0)
+    {
+        // A braced argument, e.g. "= {}" or "int{3}" in a parameter list;
+        // the head goes on after it
+        head.memberInitializer = !hasIntroducer;
+        return hasIntroducer ? SCOPE_LAMBDA : SCOPE_BLOCK;
+    }
+    for (string_view word : controlWords)
+    {
+        if (tokens[0].text == word)
+        {
+            return SCOPE_BLOCK;
+        }
+    }
+    if (namespaceKey != NO_TOKEN)
+    {
+        for (size_t i = namespaceKey + 1;
+             i < tokens.size() && (IsWordToken(tokens[i].text) || tokens[i].text == "::"); i++)
+        {
+            head.nameFirst = (head.nameFirst == NO_TOKEN) ? i : head.nameFirst;
+            head.nameLast = i;
+        }
+        return SCOPE_NAMESPACE;
+    }
+    if (externC && declarator == NO_TOKEN)
+    {
+        return SCOPE_NAMESPACE;
+    }
+    if (hasIntroducer)
+    {
+        return SCOPE_LAMBDA;
+    }
+    if (hasAssignment && operatorKey == NO_TOKEN)
+    {
+        return SCOPE_BLOCK;
+    }
+    
+    if (classKey != NO_TOKEN && declarator == NO_TOKEN)
+    {
+        // The name is the last word before a base list, so macros and
+        // attributes in front of it do not count; template arguments of
+        // a specialization are skipped
+        int depth = 0;
+        for (size_t i = classKey + 1; i < tokens.size() && !(depth == 0 && tokens[i].text == ":"); i++)
+        {
+            string_view text = tokens[i].text;
+            depth += (text == "<" || text == "(" || text == "[") - (text == ">" || text == ")" || text == "]");
+            if (depth != 0 || !IsWordToken(text) || text == "final" || text == "class" || text == "struct")
+            {
+                continue;
+            }
+            if (head.nameLast != NO_TOKEN && tokens[i - 1].text == "::")
+            {
+                head.nameLast = i;
+            }
+            else
+            {
+                head.nameFirst = i;
+                head.nameLast = i;
+            }
+        }
+        return SCOPE_CLASS;
+    }
+    
+    if (parentKind == SCOPE_FUNCTION || parentKind == SCOPE_LAMBDA || parentKind == SCOPE_BLOCK ||
+        declarator == NO_TOKEN)
+    {
+        return SCOPE_BLOCK;
+    }
+    
+    // A function; its name may be qualified, e.g. CCounter::Increment
+    size_t nameFirst = (operatorKey != NO_TOKEN && declarator - operatorKey <= 4) ? operatorKey : declarator - 1;
+    while (nameFirst >= 2 && tokens[nameFirst - 1].text == "::")
+    {
+        size_t qualifier = nameFirst - 2;
+        if (tokens[qualifier].text == ">")
+        {
+            // Skip the template arguments, e.g. Pair<T>::Swap
+            int depth = 0;
+            size_t open = qualifier + 1;
+            while (open > 0)
+            {
+                open--;
+                depth += (tokens[open].text == ">") - (tokens[open].text == "<");
+                if (depth == 0)
+                {
+                    break;
+                }
+            }
+            if (depth != 0 || open == 0)
+            {
+                break;
+            }
+            qualifier = open - 1;
+        }
+        if (!IsWordToken(tokens[qualifier].text))
+        {
+            break;
+        }
+        nameFirst = qualifier;
+    }
+    head.nameFirst = nameFirst;
+    head.nameLast = declarator - 1;
+    head.nameLine = tokens[declarator - 1].lineIndex;
+    
+    // "Name() : member{1}" - this brace starts member's initializer, and
+    // the body is still to come
+    if (hasInitializerList)
+    {
+        string_view last = tokens.back().text;
+        bool trailing = false;
+        for (string_view word : trailingWords)
+        {
+            trailing |= (last == word);
+        }
+        head.memberInitializer = (IsWordToken(last) && !trailing) || last == ">";
+    }
+    return head.memberInitializer ? SCOPE_BLOCK : SCOPE_FUNCTION;
+} // ClassifyScopeHead
+
+
+
+/*
+ * NameScope
+ * This function works out the qualified name of a new namespace, class
+ * or function. Namespaces and classes extend the qualifier and go into
+ * the symbol table; a function written as Class::Name is looked up
+ * from the innermost enclosing namespace outwards, so a definition of
+ * CCounter::Increment inside namespace shapes is named after
+ * shapes::CCounter when that class was seen.
+ * Input: document [IN/OUT] - the name is copied into its arena
+ *        state [IN/OUT] - qualifier and symbol table
+ *        kind [IN] - kind of the new scope
+ *        head [IN] - from ClassifyScopeHead, on state.tokens
+ * Return: string_view - returns the qualified name, or an empty view for
+ *                       lambdas, blocks and anonymous scopes.
+ */
+string_view NameScope(SourceDocument& document, ScopeState& state, ScopeKind kind, const ScopeHead& head)
+{
+    if (head.nameFirst == NO_TOKEN || kind == SCOPE_LAMBDA || kind == SCOPE_BLOCK)
+    {
+        return string_view();
+    }
+    // Template arguments are left out, so Box<T>::Get is a member of Box
+    string& written = state.nameScratch;
+    written.clear();
+    int angleDepth = 0;
+    for (size_t i = head.nameFirst; i <= head.nameLast; i++)
+    {
+        string_view text = state.tokens[i].text;
+        string_view previous = (i > head.nameFirst) ? state.tokens[i - 1].text : string_view();
+        if (text == "<" && (angleDepth > 0 || (IsWordToken(previous) && previous != "operator")))
+        {
+            angleDepth++;
+            continue;
+        }
+        if (angleDepth > 0)
+        {
+            angleDepth -= (text == ">");
+            continue;
+        }
+        if (IsWordToken(text) && IsWordToken(previous))
+        {
+            written += ' ';
+        }
+        written.append(text.data(), text.length());
+    }
+    
+    if (kind != SCOPE_FUNCTION)
+    {
+        size_t nameStart = state.prefix.empty() ? 0 : state.prefix.length() + 2;
+        state.prefix += state.prefix.empty() ? "" : "::";
+        state.prefix += written;
+        
+        // Each level of "namespace a::b" is a namespace of its own
+        for (size_t split = state.prefix.find("::", nameStart);
+             kind == SCOPE_NAMESPACE && split != string::npos; split = state.prefix.find("::", split + 2))
+        {
+            state.symbols.Add(string_view(state.prefix).substr(0, split), kind);
+        }
+        state.symbols.Add(state.prefix, kind);
+        return document.arena.CopyText(state.prefix);
+    }
+    
+    string& qualified = state.qualifiedScratch;
+    size_t split = written.rfind("::");
+    if (split != string::npos)
+    {
+        string_view qualifier = string_view(written).substr(0, split);
+        size_t prefixLength = state.prefix.length();
+        while (true)
+        {
+            qualified.assign(state.prefix, 0, prefixLength);
+            qualified += (prefixLength == 0) ? "" : "::";
+            qualified.append(qualifier.data(), qualifier.length());
+            ScopeKind found;
+            if (state.symbols.Find(qualified, found))
+            {
+                qualified += string_view(written).substr(split);
+                return document.arena.CopyText(qualified);
+            }
+            if (prefixLength == 0)
+            {
+                break;
+            }
+            size_t outer = string_view(state.prefix).substr(0, prefixLength).rfind("::");
+            prefixLength = (outer == string_view::npos) ? 0 : outer;
+        }
+    }
+    qualified = state.prefix;
+    qualified += state.prefix.empty() ? "" : "::";
+    qualified += written;
+    return document.arena.CopyText(qualified);
+} // NameScope
+
+
+
+/*
+ * IsAccessSpecifier
+ * This function checks if a line is only "public:", "protected:" or
+ * "private:", perhaps with a comment after it.
+ * Input: trimmed [IN] - the line without surrounding white space
+ * Return: bool - returns true for an access specifier line, false
+ *                otherwise. No side effects.
+ */
+bool IsAccessSpecifier(string_view trimmed)
+{
+    static const string_view specifiers[] = {"public", "protected", "private"};
+    for (string_view specifier : specifiers)
+    {
+        if (trimmed.substr(0, specifier.length()) == specifier)
+        {
+            string_view rest = TrimWhitespace(trimmed.substr(specifier.length()));
+            return (rest.substr(0, 1) == ":" && (rest.length() == 1 || rest.substr(1, 2) == "//" ||
+                                                 TrimWhitespace(rest.substr(1)).substr(0, 2) == "//"));
+        }
+    }
+    return false;
+} // IsAccessSpecifier
+
+
+
+/*
+ * BuildScopeTree
+ * This function builds the document's scope tree in one pass over the
+ * lines. The code since the last ';', '{' or '}' is the head of the
+ * next brace; ClassifyScopeHead reads it when the brace comes, and
+ * every line belongs to at most one head, so the pass stays linear.
+ * Preprocessor lines and access specifiers are not part of any head.
+ * Input: document [IN/OUT] - scanned document; receives the tree
+ *        state [IN/OUT] - scopes left open by the previous piece of the
+ *                         file, and the ones this piece leaves open
+ * Return: void - no return value. No side effects.
+ */
+void BuildScopeTree(SourceDocument& document, ScopeState& state)
+{
+    size_t openCount = 0;
+    for (const LineSpan& span : document.lines)
+    {
+        openCount += span.openBraces;
+    }
+    document.scopeTree.reserve(openCount);
+    
+    // Scopes open from an earlier piece are not in this tree; where they
+    // close is kept by depth
+    for (ScopeFrame& frame : state.frames)
+    {
+        frame.node = NO_SCOPE;
+        frame.resumeHead = false;
+    }
+    document.carriedScopeEnds.assign(state.frames.size(), NO_FUNCTION_END);
+    size_t headLine = 0;
+    size_t headOffset = 0;
+    bool headHasCode = false;
+    
+    for (size_t lineIndex = 0; lineIndex < document.lines.size(); lineIndex++)
+    {
+        const LineSpan& span = document.lines[lineIndex];
+        if (IsCommentLine(span))
+        {
+            continue;
+        }
+        string_view text(document.source + span.start, span.length);
+        size_t first = SkipBlanks(text, 0);
+        char firstChar = (first < text.length()) ? text[first] : '\0';
+        bool directive = state.inDirective || firstChar == '#';
+        if (directive || (firstChar == 'p' && IsAccessSpecifier(TrimWhitespace(text))))
+        {
+            string_view trimmed = TrimWhitespace(text);
+            state.inDirective = directive && !trimmed.empty() && trimmed.back() == '\\';
+            if (!headHasCode)
+            {
+                headLine = lineIndex + 1;
+                headOffset = 0;
+            }
+            continue;
+        }
+        if (span.openBraces == 0 && span.closeBraces == 0 && span.semicolons == 0)
+        {
+            headHasCode = true;
+            continue;
+        }
+        
+        CollectBraceEvents(text, span, state.events);
+        for (const BraceEvent& event : state.events)
+        {
+            bool resumed = false;
+            if (event.symbol == '{')
+            {
+                TokenizeScopeHead(document, headLine, headOffset, lineIndex, event.position, state.tokens);
+                ScopeKind parentKind = state.frames.empty() ? SCOPE_NAMESPACE : state.frames.back().kind;
+                ScopeHead head;
+                ScopeKind kind = ClassifyScopeHead(state.tokens, parentKind, head);
+                
+                ScopeFrame frame = {};
+                frame.kind = kind;
+                frame.node = document.scopeTree.size();
+                frame.prefixLength = state.prefix.length();
+                frame.resumeHead = head.memberInitializer;
+                frame.headLine = headLine;
+                frame.headOffset = headOffset;
+                
+                ScopeNode node = {};
+                node.kind = kind;
+                node.parent = state.frames.empty() ? NO_SCOPE : state.frames.back().node;
+                node.headLine = state.tokens.empty() ? lineIndex : state.tokens.front().lineIndex;
+                node.nameLine = (kind == SCOPE_FUNCTION) ? head.nameLine : lineIndex;
+                node.openLine = lineIndex;
+                node.endLine = NO_FUNCTION_END;
+                node.depth = state.frames.size();
+                node.name = NameScope(document, state, kind, head);
+                document.scopeTree.push_back(node);
+                state.frames.push_back(frame);
+                resumed = head.memberInitializer;
+            }
+            else if (event.symbol == '}' && !state.frames.empty())
+            {
+                ScopeFrame frame = state.frames.back();
+                state.frames.pop_back();
+                if (frame.node != NO_SCOPE)
+                {
+                    document.scopeTree[frame.node].endLine = lineIndex;
+                }
+                else if (state.frames.size() < document.carriedScopeEnds.size())
+                {
+                    document.carriedScopeEnds[state.frames.size()] = lineIndex;
+                }
+                state.prefix.resize(frame.prefixLength);
+                if (frame.resumeHead)
+                {
+                    // The function head goes on after a member's initializer
+                    headLine = frame.headLine;
+                    headOffset = frame.headOffset;
+                    resumed = true;
+                }
+            }
+            if (!resumed)
+            {
+                headLine = lineIndex;
+                headOffset = event.position + 1;
+            }
+        }
+        headHasCode = true;
+        if (headLine == lineIndex)
+        {
+            size_t rest = SkipBlanks(text, min(headOffset, text.length()));
+            headHasCode = rest < text.length() && text[rest] != '\r' && text.substr(rest, 2) != "//";
+        }
+    }
+} // BuildScopeTree
+
+
+
+/*
+ * CountSourceLines
+ * This function counts the lines of a source buffer, at most one more
+ * than ScanSourceLines will find.
+ * Input: source [IN] - the source code text
+ *        sourceLength [IN] - size of source in bytes
+ * Return: size_t - returns the number of '\n' plus one. No side effects.
+ */
+size_t CountSourceLines(const char* source, size_t sourceLength)
+{
+    size_t lineCount = 1;
+    for (const char* newline = source;
+         (newline = (const char*)memchr(newline, '\n', source + sourceLength - newline));
+         newline++)
+    {
+        lineCount++;
+    }
+    return lineCount;
+} // CountSourceLines
+
+
+
+/*
+ * BuildDocument
+ * This function splits a document's source into lines, builds its
+ * scope tree and records the lines that start a function or may need a
+ * comment. Lines with strings or comments are classified with that
+ * text blanked, so a keyword inside it asks nothing.
+ * Input: document [IN/OUT] - document whose source is set
+ *        lexerState [IN/OUT] - lexer mode where the source starts
+ *        scopeState [IN/OUT] - scopes open where the source starts
+ *        traceDetail [IN] - names the source in trace spans
+ * Return: void - no return value. No side effects.
+ */
+void BuildDocument(SourceDocument& document, LexerState& lexerState, ScopeState& scopeState,
+                   string_view traceDetail)
+{
+    LexerState classifyState = lexerState;
+    {
+        TRACE_SPAN("scan", traceDetail);
+        
+        // Count the lines first so the arena holds one array, not a trail
+        // of outgrown copies
+        document.lines.reserve(CountSourceLines(document.source, document.sourceLength));
+        ScanSourceLines(document.source, document.sourceLength, document.lines, lexerState);
+    }
+    COUNT_STAT(STAT_LINES, document.lines.size());
+    {
+        TRACE_SPAN("scopes", traceDetail);
+        BuildScopeTree(document, scopeState);
+    }
+    
+    TRACE_SPAN("classify", traceDetail);
+    size_t nodeIndex = 0;
+    string codeText;
+    for (size_t lineIndex = 0; lineIndex < document.lines.size(); lineIndex++)
+    {
+        const LineSpan& span = document.lines[lineIndex];
+        string_view lineText(document.source + span.start, span.length);
+        
+        // Lex again the lines the scanner lexed, keeping only their code
+        if (classifyState.mode != LEX_CODE || span.hasQuote || span.hasCommentStart)
+        {
+            LineSpan lexedSpan = span;
+            codeText.resize(span.length);
+            LexLine(document.source, lexedSpan, classifyState, &codeText[0]);
+            lineText = codeText;
+        }
+        if (IsCommentLine(span))
+        {
+            continue;
+        }
+        unsigned features = ClassifyLine(lineText);
+        
+        // Function name lines come in tree order
+        while (nodeIndex < document.scopeTree.size() &&
+               (document.scopeTree[nodeIndex].kind != SCOPE_FUNCTION ||
+                document.scopeTree[nodeIndex].nameLine < lineIndex))
+        {
+            nodeIndex++;
+        }
+        size_t functionNode = NO_SCOPE;
+        if (nodeIndex < document.scopeTree.size() && document.scopeTree[nodeIndex].nameLine == lineIndex)
+        {
+            features |= LINE_FUNCTION_DEFINITION;
+            functionNode = nodeIndex;
+        }
+        if (IsFunctionDefinition(features) || IsIOStatement(features) ||
+            IsControlStatement(features) || IsVariableDeclaration(features))
+        {
+            document.sites.push_back(DocumentSite{lineIndex, features, functionNode});
+        }
+    }
+    (void)traceDetail;
+} // BuildDocument
+
+
+
+/*
+ * FindFunctionEnd
+ * This function finds the line where a function body closes, from the
+ * scope tree, so braces in its head, such as a "= {}" default, do not
+ * count.
+ * Input: document [IN] - the scanned document
+ *        siteIndex [IN] - index of the function in document.sites
+ * Return: size_t - returns the index of the closing line, or
+ *                  NO_FUNCTION_END if the document ends first or
+ *                  another function starts inside it. No side effects.
+ */
+size_t FindFunctionEnd(const SourceDocument& document, size_t siteIndex)
+{
+    size_t endLine = document.scopeTree[document.sites[siteIndex].node].endLine;
+    for (size_t nextSite = siteIndex + 1;
+         endLine != NO_FUNCTION_END && nextSite < document.sites.size() &&
+         document.sites[nextSite].lineIndex <= endLine; nextSite++)
+    {
+        if (IsFunctionDefinition(document.sites[nextSite].features))
+        {
+            return NO_FUNCTION_END;
+        }
+    }
+    return endLine;
+} // FindFunctionEnd
+
+
+
+// Held comment text beyond this is let through as is: no real doc
+// block is this large, and holding it would defeat streaming
+const size_t MAX_HELD_TEXT = 1 << 20;
+
+/*
+ * AnnotationState
+ * Where the annotation stands between two lines of a file, so a file
+ * can be annotated in pieces as it streams in.
+ */
+struct AnnotationState
+{
+    bool inFunction = false;
+    size_t functionDepth = 0;           // scope depth of its body, found in the tree
+    bool functionDocumented = false;    // asks nothing until it ends
+    string lastFunctionName;
+    bool addEndComment = false;
+    size_t openScope = NO_SCOPE;        // in the current document
+    
+    // Comment lines held back until we know if a function follows them
+    bool holding = false;
+    size_t heldStart = 0;               // first held line in the document
+    string heldLines;                   // held text from earlier pieces
+    
+    // Output of each function this run, for the cache
+    bool capturing = false;             // started and not yet stopped
+    map<uint64_t, string> functionOutputs;
+    string capturedFunction;
+    uint64_t capturedHash = 0;
+};
+
+
+
+/*
+ * HeldText
+ * This function gives all the held comment text up to a line: what an
+ * earlier piece of the stream left, then the held lines of this one.
+ * Input: document [IN] - the current document
+ *        state [IN] - holds the held lines
+ *        endLine [IN] - first line after the held ones
+ *        scratch [OUT] - used when the text has to be joined
+ * Return: string_view - returns the held text. No side effects.
+ */
+string_view HeldText(const SourceDocument& document, const AnnotationState& state,
+                     size_t endLine, string& scratch)
+{
+    size_t start = document.lines[state.heldStart].start;
+    size_t end = (endLine < document.lines.size()) ? document.lines[endLine].start : document.sourceLength;
+    string_view heldHere(document.source + start, end - start);
+    if (state.heldLines.empty())
+    {
+        return heldHere;
+    }
+    scratch = state.heldLines;
+    scratch.append(heldHere.data(), heldHere.length());
+    return scratch;
+} // HeldText
+
+
+
+/*
+ * FunctionHeadText
+ * This function gives the head of a function, from its first line
+ * through the line its body opens on. A head whose parameter list
+ * closes on the name line is that line; a longer one is joined into
+ * scratch with its comments blanked.
+ * Input: document [IN] - the current document
+ *        nodeIndex [IN] - the function's node in the scope tree
+ *        scratch [OUT] - holds a joined head
+ * Return: string_view - returns the head text. No side effects.
+ */
+string_view FunctionHeadText(const SourceDocument& document, size_t nodeIndex, string& scratch)
+{
+    const ScopeNode& node = document.scopeTree[nodeIndex];
+    const LineSpan& nameSpan = document.lines[node.nameLine];
+    if (node.headLine == node.nameLine && nameSpan.openParens > 0 && nameSpan.openParens == nameSpan.closeParens)
+    {
+        return string_view(document.source + nameSpan.start, nameSpan.length);
+    }
+    
+    scratch.clear();
+    LexerState lexerState = {};
+    for (size_t lineIndex = node.headLine; lineIndex <= node.openLine; lineIndex++)
+    {
+        LineSpan lexedSpan = document.lines[lineIndex];
+        size_t position = scratch.length();
+        scratch.resize(position + lexedSpan.length);
+        LexLine(document.source, lexedSpan, lexerState, &scratch[position]);
+        scratch += ' ';
+    }
+    return scratch;
+} // FunctionHeadText
+
+
+
+/*
+ * ReleaseHeldLines
+ * This function lets held comment lines through unchanged. Lines held
+ * in this document stay where they are; text an earlier piece of the
+ * stream held goes out in front of them.
+ * Input: document [IN/OUT] - the current document
+ *        state [IN/OUT] - holds the held lines
+ * Return: void - no return value. No side effects.
+ */
+void ReleaseHeldLines(SourceDocument& document, AnnotationState& state)
+{
+    if (!state.heldLines.empty())
+    {
+        AddInsertion(document, state.heldStart, INSERT_TEXT).text = document.arena.CopyText(state.heldLines);
+        state.heldLines.clear();
+    }
+    state.holding = false;
+} // ReleaseHeldLines
+
+
+
+/*
+ * AnnotateLines
+ * This function decides what to add to a document's lines: function
+ * headers, line comments and end comments. Each function ends where
+ * the scope tree closes its body, so only that brace is asked about,
+ * whatever braces its head or body hold. A header goes above the
+ * head's first line, such as a template line. The decisions are
+ * recorded as insertions; EmitDocument writes them out.
+ * Input: document [IN/OUT] - the document, from BuildDocument
+ *        state [IN/OUT] - where the previous piece of the file left off
+ *        session [IN] - where answers come from and the optional cache
+ *        filePath [IN] - absolute path of the source, for the cache
+ *        lastPiece [IN] - true if no more of the file follows
+ * Return: void - Side effects: records insertions and scopes, prompts
+ *                user when interactive.
+ */
+void AnnotateLines(SourceDocument& document, AnnotationState& state,
+                   const AnnotationSession& session, const string& filePath, bool lastPiece)
+{
+    const AnnotationSpec* spec = session.spec;
+    const CommentStyle& style = (spec != nullptr) ? spec->style : DEFAULT_COMMENT_STYLE;
+    string_view headerMarker = TemplateMarker(style.functionHeader);
+    const ArenaVector<LineSpan>& lineSpans = document.lines;
+    const ArenaVector<DocumentSite>& sites = document.sites;
+    size_t siteIndex = 0;
+    size_t headStart = NO_FUNCTION_END;
+    string heldScratch;
+    string headScratch;
+    
+    // A function an earlier piece left open may close in this one
+    size_t functionEnd = NO_FUNCTION_END;
+    if (state.inFunction && state.functionDepth < document.carriedScopeEnds.size())
+    {
+        functionEnd = document.carriedScopeEnds[state.functionDepth];
+    }
+    
+    for (size_t lineIndex = 0; lineIndex < lineSpans.size(); lineIndex++)
+    {
+        const LineSpan& span = lineSpans[lineIndex];
+        string_view currentLine(document.source + span.start, span.length);
+        
+        // Skip existing comments, holding back any that may document
+        // the next function
+        if (IsCommentLine(span) || (state.holding && TrimWhitespace(currentLine).empty()))
+        {
+            if (!state.holding && StartsDocComment(currentLine, headerMarker))
+            {
+                state.holding = true;
+                state.heldStart = lineIndex;
+            }
+            continue;
+        }
+        
+        while (siteIndex < sites.size() && sites[siteIndex].lineIndex < lineIndex)
+        {
+            siteIndex++;
+        }
+        
+        // Lines of a function's head before its name, such as
+        // "template <typename T>", get the header above them
+        if (siteIndex < sites.size() && IsFunctionDefinition(sites[siteIndex].features) &&
+            lineIndex < sites[siteIndex].lineIndex && lineIndex != functionEnd &&
+            document.scopeTree[sites[siteIndex].node].headLine <= lineIndex)
+        {
+            headStart = min(headStart, lineIndex);
+            continue;
+        }
+        unsigned lineFeatures = 0;
+        if (siteIndex < sites.size() && sites[siteIndex].lineIndex == lineIndex)
+        {
+            lineFeatures = sites[siteIndex].features;
+        }
+        size_t headLine = (headStart < lineIndex && IsFunctionDefinition(lineFeatures)) ? headStart : lineIndex;
+        headStart = NO_FUNCTION_END;
+        
+        // Held comments that do not document a function stay unchanged;
+        // one inside the head is not its documentation
+        FunctionAnswers docAnswers;
+        ExistingDoc existingDoc = DOC_NONE;
+        string_view heldText;
+        size_t docLine = headLine;
+        if (state.holding)
+        {
+            if (IsFunctionDefinition(lineFeatures) && state.heldStart <= headLine)
+            {
+                heldText = HeldText(document, state, headLine, heldScratch);
+                existingDoc = ParseExistingDoc(heldText, headerMarker, docAnswers);
+            }
+            if (existingDoc == DOC_NONE)
+            {
+                ReleaseHeldLines(document, state);
+            }
+            else
+            {
+                docLine = state.heldStart;
+            }
+        }
+        
+        // Detect function definitions
+        if (IsFunctionDefinition(lineFeatures))
+        {
+            COUNT_STAT(STAT_FUNCTIONS, 1);
+            
+            // A new function start ends any unfinished capture
+            if (state.capturing)
+            {
+                AddInsertion(document, docLine, INSERT_STOP_CAPTURE).count = 0;
+                state.capturing = false;
+            }
+            
+            DocumentScope scope = {};
+            scope.docLine = docLine;
+            scope.startLine = lineIndex;
+            scope.endLine = NO_FUNCTION_END;
+            scope.existingDoc = existingDoc;
+            
+            // Unchanged functions reuse their earlier output without asking
+            size_t endIndex = (session.cache != nullptr) ? FindFunctionEnd(document, siteIndex) : NO_FUNCTION_END;
+            if (endIndex != NO_FUNCTION_END)
+            {
+                const LineSpan& endSpan = lineSpans[endIndex];
+                size_t hashStart = lineSpans[headLine].start;
+                uint64_t functionHash = HashBytes(document.source + hashStart,
+                                                  endSpan.start + endSpan.length - hashStart,
+                                                  session.cacheSeed);
+                if (existingDoc != DOC_NONE)
+                {
+                    // The documentation is part of the cached output
+                    functionHash = HashBytes(heldText.data(), heldText.length(), functionHash);
+                }
+                const string* cachedOutput = session.cache->Find(filePath, functionHash);
+                if (cachedOutput != nullptr)
+                {
+                    if (spec == nullptr)
+                    {
+                        cout << "Unchanged function, keeping its comments: " << currentLine << endl << endl;
+                    }
+                    AddInsertion(document, docLine, INSERT_SKIP_LINES).count = endIndex + 1 - docLine;
+                    AddInsertion(document, docLine, INSERT_TEXT).text = *cachedOutput;
+                    state.functionOutputs[functionHash] = *cachedOutput;
+                    state.heldLines.clear();
+                    state.holding = false;
+                    
+                    scope.endLine = endIndex;
+                    scope.fromCache = true;
+                    document.scopes.push_back(scope);
+                    
+                    state.inFunction = false;
+                    state.functionDocumented = false;
+                    state.lastFunctionName = "";
+                    lineIndex = endIndex;
+                    continue;
+                }
+                
+                AddInsertion(document, docLine, INSERT_START_CAPTURE).hash = functionHash;
+                state.capturing = true;
+            }
+            
+            FunctionAnswers answers;
+            if (existingDoc == DOC_NONE)
+            {
+                string_view head = FunctionHeadText(document, sites[siteIndex].node, headScratch);
+                answers = (spec != nullptr) ? LookupFunctionAnswers(*spec, currentLine, head)
+                                            : AskFunctionAnswers(currentLine, head, siteIndex, sites.size());
+            }
+            else
+            {
+                // Already documented: convert or keep the header, ask nothing
+                if (spec == nullptr)
+                {
+                    cout << "Already documented, keeping its header: " << currentLine << endl << endl;
+                }
+                if (existingDoc == DOC_KEEP)
+                {
+                    ReleaseHeldLines(document, state);
+                }
+                else
+                {
+                    AddInsertion(document, state.heldStart, INSERT_SKIP_LINES).count = headLine - state.heldStart;
+                    state.heldLines.clear();
+                    state.holding = false;
+                }
+                answers = std::move(docAnswers);
+            }
+            if (answers.addHeader)
+            {
+                PendingInsertion& header = AddInsertion(document, headLine, INSERT_FUNCTION_HEADER);
+                header.style = &style;
+                header.text = document.arena.CopyText(answers.name);
+                header.description = document.arena.CopyText(answers.description);
+                header.parameters = document.arena.CopyText(answers.parameters);
+                header.returnDesc = document.arena.CopyText(answers.returnDesc);
+                scope.name = header.text;
+                scope.addedHeader = true;
+            }
+            else if (!answers.name.empty())
+            {
+                scope.name = document.arena.CopyText(answers.name);
+            }
+            document.scopes.push_back(scope);
+            state.openScope = document.scopes.size() - 1;
+            
+            // Remember function name for closing brace detection; the
+            // closing line of a documented function is left as it is
+            if (existingDoc != DOC_NONE)
+            {
+                state.lastFunctionName.clear();
+            }
+            else if (!answers.name.empty())
+            {
+                state.lastFunctionName = answers.name;
+            }
+            state.addEndComment = answers.addEndComment;
+            
+            // Mark that we're entering a function; the tree knows where
+            // it ends, or at what depth a later piece will see it end
+            const ScopeNode& functionNode = document.scopeTree[sites[siteIndex].node];
+            state.inFunction = true;
+            state.functionDocumented = (existingDoc != DOC_NONE);
+            state.functionDepth = functionNode.depth;
+            functionEnd = functionNode.endLine;
+        }
+        
+        // Detect I/O, control and variable lines
+        else if (lineFeatures != 0)
+        {
+            SiteKind kind = SITE_VARIABLE;
+            if (IsIOStatement(lineFeatures))
+            {
+                kind = SITE_IO;
+            }
+            else if (IsControlStatement(lineFeatures))
+            {
+                kind = SITE_CONTROL;
+            }
+            COUNT_STAT((kind == SITE_IO) ? STAT_IO_SITES :
+                       (kind == SITE_CONTROL) ? STAT_CONTROL_SITES : STAT_VARIABLE_SITES, 1);
+            
+            string comment;
+            if (spec == nullptr && !state.functionDocumented)
+            {
+                cout << "[" << siteIndex + 1 << "/" << sites.size() << "] ";
+            }
+            if (!state.functionDocumented && GetLineComment(session, kind, currentLine, comment))
+            {
+                AddInsertion(document, lineIndex, INSERT_LINE_COMMENT).text = document.arena.CopyText(comment);
+            }
+        }
+        
+        // Check if this line ends the function
+        if (state.inFunction && lineIndex == functionEnd)
+        {
+            // This is the end of a function - check if user wants end comment
+            if (!state.lastFunctionName.empty())
+            {
+                if (spec == nullptr)
+                {
+                    cout << "End of function '" << state.lastFunctionName << "' detected: " << currentLine << endl;
+                    string answer;
+                    cout << "Add function end comment? (y/n): ";
+                    ReadAnswer(answer);
+                    state.addEndComment = (answer == "y" || answer == "Y");
+                }
+                
+                if (state.addEndComment)
+                {
+                    AddInsertion(document, lineIndex, INSERT_END_COMMENT).text =
+                        document.arena.CopyText(state.lastFunctionName);
+                }
+                
+                if (spec == nullptr)
+                {
+                    cout << endl;
+                }
+            }
+            if (state.openScope != NO_SCOPE)
+            {
+                document.scopes[state.openScope].endLine = lineIndex;
+                state.openScope = NO_SCOPE;
+            }
+            state.inFunction = false;
+            state.functionDocumented = false;
+            state.lastFunctionName = "";
+            
+            if (state.capturing)
+            {
+                AddInsertion(document, lineIndex + 1, INSERT_STOP_CAPTURE).count = 1;
+                state.capturing = false;
+            }
+        }
+    }
+    
+    // Comments still held either go out now or wait for the next piece
+    if (state.holding)
+    {
+        size_t heldLength = state.heldLines.length() + document.sourceLength -
+                            lineSpans[state.heldStart].start;
+        if (lastPiece || heldLength > MAX_HELD_TEXT)
+        {
+            ReleaseHeldLines(document, state);
+        }
+        else
+        {
+            string_view heldHere = HeldText(document, state, lineSpans.size(), heldScratch);
+            state.heldLines.assign(heldHere.data(), heldHere.length());
+            AddInsertion(document, state.heldStart, INSERT_SKIP_LINES).count = lineSpans.size() - state.heldStart;
+            state.heldStart = 0;
+        }
+    }
+    state.openScope = NO_SCOPE;
+} // AnnotateLines
+
+
+
+/*
+ * WriteInsertionText
+ * This function queues the text an insertion adds in front of a line.
+ * Input: insertion [IN] - a text, function header or line comment
+ *        output [IN/OUT] - writer the text is queued on
+ * Return: void - no return value. Side effect: queues output.
+ */
+void WriteInsertionText(const PendingInsertion& insertion, COutputWriter& output)
+{
+    if (insertion.kind == INSERT_TEXT)
+    {
+        output.AddText(insertion.text);
+    }
+    else if (insertion.kind == INSERT_FUNCTION_HEADER)
+    {
+        CreateFunctionHeader(output, *insertion.style, insertion.text, insertion.description,
+                             insertion.parameters, insertion.returnDesc);
+    }
+    else if (insertion.kind == INSERT_LINE_COMMENT)
+    {
+        output.AddText("    // ");
+        output.AddText(insertion.text);
+        output.AddText("\n");
+    }
+} // WriteInsertionText
+
+
+
+/*
+ * EmitDocument
+ * This function writes a document's lines with its insertions applied.
+ * Unchanged lines are passed to the writer as spans of source, so the
+ * source must stay valid until the writer is flushed.
+ * Input: document [IN] - the annotated document
+ *        output [IN/OUT] - writer the commented code is queued on
+ *        state [IN/OUT] - receives the output of captured functions
+ * Return: void - no return value. Side effect: queues output.
+ */
+void EmitDocument(const SourceDocument& document, COutputWriter& output, AnnotationState& state)
+{
+    const ArenaVector<PendingInsertion>& insertions = document.insertions;
+    size_t insertionIndex = 0;
+    size_t skipUntil = 0;
+    
+    for (size_t lineIndex = 0; lineIndex <= document.lines.size(); lineIndex++)
+    {
+        string_view endCommentName;
+        bool endComment = false;
+        for (; insertionIndex < insertions.size() && insertions[insertionIndex].lineIndex == lineIndex;
+             insertionIndex++)
+        {
+            const PendingInsertion& insertion = insertions[insertionIndex];
+            switch (insertion.kind)
+            {
+                case INSERT_TEXT:
+                case INSERT_FUNCTION_HEADER:
+                case INSERT_LINE_COMMENT:
+                    WriteInsertionText(insertion, output);
+                    break;
+                case INSERT_END_COMMENT:
+                    endComment = true;
+                    endCommentName = insertion.text;
+                    break;
+                case INSERT_SKIP_LINES:
+                    skipUntil = lineIndex + insertion.count;
+                    break;
+                case INSERT_START_CAPTURE:
+                    state.capturedFunction.clear();
+                    state.capturedHash = insertion.hash;
+                    output.StartCapture(&state.capturedFunction);
+                    break;
+                case INSERT_STOP_CAPTURE:
+                    output.StopCapture();
+                    if (insertion.count != 0)
+                    {
+                        state.functionOutputs[state.capturedHash].swap(state.capturedFunction);
+                    }
+                    break;
+            }
+        }
+        
+        if (lineIndex == document.lines.size() || lineIndex < skipUntil)
+        {
+            continue;
+        }
+        const LineSpan& span = document.lines[lineIndex];
+        if (endComment)
+        {
+            // Add comment to the same line as the closing brace
+            output.AddSource(document.source + span.start, span.length);
+            output.AddText("  // end of \"");
+            output.AddText(endCommentName);
+            output.AddText("\"\n\n\n");
+        }
+        else
+        {
+            WriteSourceLine(output, document.source, document.sourceLength, span);
+        }
+    }
+} // EmitDocument
+
+
+
+// Unchanged lines shown around each change in a unified diff
+const size_t DIFF_CONTEXT_LINES = 3;
+
+/*
+ * DiffChange
+ * A run of original lines that is replaced: removedCount lines from
+ * firstLine on go, the added text comes in their place. Either part may
+ * be empty.
+ */
+struct DiffChange
+{
+    size_t firstLine;
+    size_t removedCount;
+    string added;
+};
+
+
+
+/*
+ * CollectDiffChanges
+ * This function turns a document's insertions into line changes, the
+ * way EmitDocument would apply them. A captured function's output is
+ * not needed here, so capture insertions are ignored.
+ * Input: document [IN] - the annotated document
+ *        leadingText [IN] - text to add before the first line, such as
+ *                           the file header
+ *        changes [OUT] - receives the changes in line order
+ * Return: void - no return value. No side effects.
+ */
+void CollectDiffChanges(const SourceDocument& document, string_view leadingText, vector<DiffChange>& changes)
+{
+    const ArenaVector<PendingInsertion>& insertions = document.insertions;
+    size_t lineCount = document.lines.size();
+    size_t insertionIndex = 0;
+    size_t skipUntil = 0;
+    string added(leadingText);
+    
+    // Generated text is rendered into the string, never written
+    COutputWriter renderer(-1);
+    renderer.StartCapture(&added);
+    
+    for (size_t lineIndex = 0; lineIndex <= lineCount; lineIndex++)
+    {
+        string_view endCommentName;
+        bool endComment = false;
+        for (; insertionIndex < insertions.size() && insertions[insertionIndex].lineIndex == lineIndex;
+             insertionIndex++)
+        {
+            const PendingInsertion& insertion = insertions[insertionIndex];
+            if (insertion.kind == INSERT_END_COMMENT)
+            {
+                endComment = true;
+                endCommentName = insertion.text;
+            }
+            else if (insertion.kind == INSERT_SKIP_LINES)
+            {
+                skipUntil = lineIndex + insertion.count;
+            }
+            else
+            {
+                WriteInsertionText(insertion, renderer);
+            }
+        }
+        
+        bool removed = (lineIndex < lineCount) && (lineIndex < skipUntil || endComment);
+        if (removed && lineIndex >= skipUntil)
+        {
+            const LineSpan& span = document.lines[lineIndex];
+            added.append(document.source + span.start, span.length);
+            added += "  // end of \"";
+            added.append(endCommentName.data(), endCommentName.length());
+            added += "\"\n\n\n";
+        }
+        if (!removed && added.empty())
+        {
+            continue;
+        }
+        
+        // Text after a last line without '\n' needs that line ended
+        size_t changeLine = lineIndex;
+        if (lineIndex == lineCount && lineCount > 0 &&
+            document.lines[lineCount - 1].start + document.lines[lineCount - 1].length == document.sourceLength &&
+            (changes.empty() || changes.back().firstLine + changes.back().removedCount < lineCount))
+        {
+            const LineSpan& lastSpan = document.lines[lineCount - 1];
+            added.insert(0, 1, '\n');
+            added.insert(0, document.source + lastSpan.start, lastSpan.length);
+            changeLine = lineCount - 1;
+            removed = true;
+        }
+        
+        if (changes.empty() || changes.back().firstLine + changes.back().removedCount != changeLine)
+        {
+            changes.push_back(DiffChange{changeLine, 0, string()});
+        }
+        changes.back().removedCount += removed ? 1 : 0;
+        changes.back().added += added;
+        added.clear();
+    }
+    renderer.StopCapture();
+} // CollectDiffChanges
+
+
+
+/*
+ * AddDiffLines
+ * This function adds text to a diff, one marked line per line of text.
+ * Input: text [IN] - whole lines; the last one may lack its '\n'
+ *        marker [IN] - ' ', '-' or '+'
+ *        patch [IN/OUT] - the diff being built
+ * Return: size_t - returns the number of lines added. No side effects.
+ */
+size_t AddDiffLines(string_view text, char marker, string& patch)
+{
+    size_t lineCount = 0;
+    size_t lineStart = 0;
+    while (lineStart < text.length())
+    {
+        size_t lineEnd = text.find('\n', lineStart);
+        patch += marker;
+        if (lineEnd == string_view::npos)
+        {
+            patch.append(text.data() + lineStart, text.length() - lineStart);
+            patch += "\n\\ No newline at end of file\n";
+            return lineCount + 1;
+        }
+        patch.append(text.data() + lineStart, lineEnd + 1 - lineStart);
+        lineStart = lineEnd + 1;
+        lineCount++;
+    }
+    return lineCount;
+} // AddDiffLines
+
+
+
+/*
+ * WriteUnifiedDiff
+ * This function writes the changes to one file as a unified diff with
+ * three lines of context, which git apply and patch -p1 accept. Only
+ * the changed places and their context are read from the source.
+ * Input: document [IN] - the original file's document
+ *        changes [IN] - from CollectDiffChanges
+ *        path [IN] - the file's path as it goes in the diff header
+ *        patch [IN/OUT] - receives the diff of this file
+ * Return: void - no return value. No side effects.
+ */
+void WriteUnifiedDiff(const SourceDocument& document, const vector<DiffChange>& changes,
+                      const string& path, string& patch)
+{
+    if (changes.empty())
+    {
+        return;
+    }
+    patch += "--- a/" + path + "\n+++ b/" + path + "\n";
+    
+    size_t lineCount = document.lines.size();
+    auto sourceLines = [&](size_t first, size_t end)
+    {
+        if (first >= end)
+        {
+            return string_view();
+        }
+        size_t textEnd = (end < lineCount) ? document.lines[end].start : document.sourceLength;
+        return string_view(document.source + document.lines[first].start,
+                           textEnd - document.lines[first].start);
+    };
+    
+    long long lineShift = 0;        // lines added minus removed so far
+    size_t changeIndex = 0;
+    while (changeIndex < changes.size())
+    {
+        // Changes whose context would touch go in one hunk
+        size_t lastIndex = changeIndex;
+        while (lastIndex + 1 < changes.size() &&
+               changes[lastIndex + 1].firstLine - (changes[lastIndex].firstLine + changes[lastIndex].removedCount)
+               <= 2 * DIFF_CONTEXT_LINES)
+        {
+            lastIndex++;
+        }
+        size_t hunkStart = (changes[changeIndex].firstLine > DIFF_CONTEXT_LINES)
+                           ? changes[changeIndex].firstLine - DIFF_CONTEXT_LINES : 0;
+        size_t hunkEnd = min(lineCount, changes[lastIndex].firstLine + changes[lastIndex].removedCount +
+                                        DIFF_CONTEXT_LINES);
+        
+        string body;
+        size_t oldCount = 0;
+        size_t newCount = 0;
+        size_t lineIndex = hunkStart;
+        for (size_t i = changeIndex; i <= lastIndex; i++)
+        {
+            const DiffChange& change = changes[i];
+            size_t contextCount = AddDiffLines(sourceLines(lineIndex, change.firstLine), ' ', body);
+            oldCount += contextCount;
+            newCount += contextCount;
+            oldCount += AddDiffLines(sourceLines(change.firstLine, change.firstLine + change.removedCount),
+                                     '-', body);
+            newCount += AddDiffLines(change.added, '+', body);
+            lineIndex = change.firstLine + change.removedCount;
+        }
+        size_t contextCount = AddDiffLines(sourceLines(lineIndex, hunkEnd), ' ', body);
+        oldCount += contextCount;
+        newCount += contextCount;
+        
+        // An empty side is numbered by the line before it
+        size_t oldStart = (oldCount == 0) ? hunkStart : hunkStart + 1;
+        long long newStart = (long long)hunkStart + lineShift + ((newCount == 0) ? 0 : 1);
+        patch += "@@ -" + to_string(oldStart) + "," + to_string(oldCount) + " +" +
+                 to_string(newStart) + "," + to_string(newCount) + " @@\n";
+        patch += body;
+        
+        lineShift += (long long)newCount - (long long)oldCount;
+        changeIndex = lastIndex + 1;
+    }
+} // WriteUnifiedDiff
+
+
+
+/*
+ * RecordDocumentMemory
+ * This function adds a finished document's arena use to the stats.
+ * Input: arena [IN] - the arena the document lived in
+ * Return: void - no return value. Side effect: updates the counters.
+ */
+void RecordDocumentMemory(const CArena& arena)
+{
+    COUNT_STAT(STAT_DOCUMENT_BYTES, arena.BytesUsed());
+    PEAK_STAT(STAT_DOCUMENT_PEAK, arena.BytesUsed());
+    (void)arena;
+} // RecordDocumentMemory
+
+
+
+/*
+ * AnnotateDocument
+ * This function annotates a whole scanned file: it decides what to add,
+ * queues the result and stores the function outputs in the cache.
+ * Unchanged lines are passed to the writer as spans of source, so the
+ * source must stay valid until the writer is flushed.
+ * Input: document [IN/OUT] - the file's document, from BuildDocument
+ *        output [IN/OUT] - writer the commented code is queued on
+ *        session [IN] - where answers come from and the optional cache
+ *        filePath [IN] - absolute path of the source, for the cache
+ * Return: void - Side effects: queues the annotated source, prompts
+ *                user when interactive and updates the cache.
+ */
+void AnnotateDocument(SourceDocument& document, COutputWriter& output,
+                      const AnnotationSession& session, const string& filePath)
+{
+    AnnotationState state;
+    {
+        TRACE_SPAN("annotate", filePath);
+        AnnotateLines(document, state, session, filePath, true);
+    }
+    {
+        TRACE_SPAN("emit", filePath);
+        EmitDocument(document, output, state);
+    }
+    
+    output.StopCapture();
+    if (session.cache != nullptr)
+    {
+        session.cache->Store(filePath, state.functionOutputs);
+    }
+    RecordDocumentMemory(document.arena);
+} // AnnotateDocument
+
+
+
+/*
+ * CWorkStealingPool
+ * Runs a fixed list of tasks on a set of worker threads. Each worker
+ * owns a queue and takes tasks from its back; a worker with an empty
+ * queue steals from the front of another worker's queue, so one slow
+ * file does not leave the other cores idle.
+ */
+class CWorkStealingPool
+{
+public:
+    CWorkStealingPool(int threadCount);
+    void Run(size_t taskCount, const function<void(size_t)>& task, bool dealInTurn = false);
+    
+private:
+    struct WorkerQueue
+    {
+        mutex lock;
+        deque<size_t> tasks;
+    };
+    
+    bool TakeTask(int workerIndex, size_t& taskIndex);
+    void WorkerLoop(int workerIndex, const function<void(size_t)>& task);
+    
+    int m_threadCount;
+    vector<unique_ptr<WorkerQueue>> m_queues;
+};
+
+
+
+/*
+ * CWorkStealingPool::CWorkStealingPool
+ * This constructor sets up one task queue per worker.
+ * Input: threadCount [IN] - number of workers, at least 1
+ * Return: None
+ */
+CWorkStealingPool::CWorkStealingPool(int threadCount)
+{
+    m_threadCount = (threadCount < 1) ? 1 : threadCount;
+    for (int i = 0; i < m_threadCount; i++)
+    {
+        m_queues.push_back(unique_ptr<WorkerQueue>(new WorkerQueue));
+    }
+} // CWorkStealingPool::CWorkStealingPool
+
+
+
+/*
+ * CWorkStealingPool::TakeTask
+ * This function gets the next task for a worker, from its own queue
+ * first and then by stealing from the other queues.
+ * Input: workerIndex [IN] - the worker asking for work
+ *        taskIndex [OUT] - receives the task to run
+ * Return: bool - returns true if a task was found, false when all
+ *                queues are empty. Side effect: removes the task.
+ */
+bool CWorkStealingPool::TakeTask(int workerIndex, size_t& taskIndex)
+{
+    WorkerQueue& ownQueue = *m_queues[workerIndex];
+    {
+        lock_guard<mutex> guard(ownQueue.lock);
+        if (!ownQueue.tasks.empty())
+        {
+            taskIndex = ownQueue.tasks.back();
+            ownQueue.tasks.pop_back();
+            return true;
+        }
+    }
+    
+    // Own queue is empty - steal the oldest task of another worker
+    for (int offset = 1; offset < m_threadCount; offset++)
+    {
+        WorkerQueue& victim = *m_queues[(workerIndex + offset) % m_threadCount];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.tasks.empty())
+        {
+            taskIndex = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+} // CWorkStealingPool::TakeTask
+
+
+
+/*
+ * CWorkStealingPool::WorkerLoop
+ * This function runs tasks for one worker until no work is left.
+ * Input: workerIndex [IN] - the worker running the loop
+ *        task [IN] - the function to call with each task index
+ * Return: void - no return value. Side effect: runs the tasks.
+ */
+void CWorkStealingPool::WorkerLoop(int workerIndex, const function<void(size_t)>& task)
+{
+    size_t taskIndex;
+    while (TakeTask(workerIndex, taskIndex))
+    {
+        task(taskIndex);
+    }
+} // CWorkStealingPool::WorkerLoop
+
+
+
+/*
+ * CWorkStealingPool::Run
+ * This function runs tasks 0 to taskCount-1 and waits for all of them.
+ * Tasks are dealt out in blocks so neighbouring files start together,
+ * or in turn when they are sorted biggest first: then every worker
+ * starts on one of the biggest and thieves take the smallest left.
+ * Input: taskCount [IN] - number of tasks
+ *        task [IN] - the function to call with each task index
+ *        dealInTurn [IN] - deal task i to worker i % threads
+ * Return: void - no return value. Side effect: runs the tasks on
+ *                worker threads plus the calling thread.
+ */
+void CWorkStealingPool::Run(size_t taskCount, const function<void(size_t)>& task, bool dealInTurn)
+{
+    size_t blockSize = (taskCount + m_threadCount - 1) / m_threadCount;
+    for (size_t i = 0; i < taskCount; i++)
+    {
+        // Lowest index at the back, since owners take from there
+        int workerIndex = dealInTurn ? (int)(i % m_threadCount) : (int)(i / blockSize);
+        m_queues[workerIndex]->tasks.push_front(i);
+    }
+    
+    vector<thread> workers;
+    for (int i = 1; i < m_threadCount; i++)
+    {
+        workers.push_back(thread(&CWorkStealingPool::WorkerLoop, this, i, cref(task)));
+    }
+    WorkerLoop(0, task);
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+} // CWorkStealingPool::Run
+
+
+
+/*
+ * FindChunkOffsets
+ * This function cuts a large file into pieces that can be annotated on
+ * their own. A piece only ends after a line of code that ends in ';' or
+ * '}' at brace depth 0, with the lexer back in code: nothing is open
+ * there, so a piece started from scratch sees what the whole file would.
+ * Code wrapped in a namespace has no such lines and is not cut.
+ * Input: source [IN] - the source code text
+ *        sourceLength [IN] - size of source in bytes
+ *        chunkBytes [IN] - size to aim for per piece
+ *        chunkOffsets [OUT] - receives where each piece starts; one
+ *                             entry if the file stays whole
+ * Return: void - no return value. No side effects.
+ */
+void FindChunkOffsets(const char* source, size_t sourceLength, size_t chunkBytes, vector<size_t>& chunkOffsets)
+{
+    CArena scanArena;
+    ArenaVector<LineSpan> lines{ArenaAllocator<LineSpan>(scanArena)};
+    lines.reserve(CountSourceLines(source, sourceLength));
+    ScanSourceLines(source, sourceLength, lines);
+    
+    chunkOffsets.assign(1, 0);
+    long depth = 0;
+    for (size_t lineIndex = 0; lineIndex + 1 < lines.size(); lineIndex++)
+    {
+        const LineSpan& span = lines[lineIndex];
+        if (span.openBraces != 0 || span.closeBraces != 0)
+        {
+            // Braces in a directive need not balance; cut nothing after them
+            string_view text(source + span.start, span.length);
+            size_t first = SkipBlanks(text, 0);
+            depth += span.openBraces - span.closeBraces;
+            if (depth < 0 || (first < text.length() && text[first] == '#'))
+            {
+                return;
+            }
+        }
+        size_t lineEnd = span.start + span.length + 1;
+        if (depth != 0 || lineEnd - chunkOffsets.back() < chunkBytes || !span.hasCode ||
+            span.hasCommentStart || !span.endsInCode)
+        {
+            continue;
+        }
+        string_view code = TrimWhitespace(string_view(source + span.start, span.length));
+        if (!code.empty() && (code.back() == ';' || code.back() == '}'))
+        {
+            chunkOffsets.push_back(lineEnd);
+        }
+    }
+} // FindChunkOffsets
+
+
+
+/*
+ * AnnotateChunks
+ * This function annotates the pieces of a file on several threads, each
+ * into its own queue, and then queues the results in order. The output
+ * is the same as annotating the file in one go.
+ * Input: source [IN] - the source code text
+ *        sourceLength [IN] - size of source in bytes
+ *        chunkOffsets [IN] - where each piece starts, from
+ *                            FindChunkOffsets
+ *        output [IN/OUT] - writer the commented code is queued on
+ *        session [IN] - the spec, the optional cache and the thread count
+ *        filePath [IN] - absolute path of the source, for the cache
+ * Return: size_t - returns the number of source lines processed.
+ *                  Side effects: queues the annotated source and
+ *                  updates the cache.
+ */
+size_t AnnotateChunks(const char* source, size_t sourceLength, const vector<size_t>& chunkOffsets,
+                      COutputWriter& output, const AnnotationSession& session, const string& filePath)
+{
+    size_t chunkCount = chunkOffsets.size();
+    vector<unique_ptr<COutputWriter>> parts(chunkCount);
+    vector<map<uint64_t, string>> functionOutputs(chunkCount);
+    vector<size_t> lineCounts(chunkCount);
+    
+    CWorkStealingPool pool(min(session.splitThreads, (int)chunkCount));
+    pool.Run(chunkCount, [&](size_t chunkIndex)
+    {
+        size_t chunkStart = chunkOffsets[chunkIndex];
+        size_t chunkEnd = (chunkIndex + 1 < chunkCount) ? chunkOffsets[chunkIndex + 1] : sourceLength;
+        g_documentArena.Reset();
+        SourceDocument document(g_documentArena, source + chunkStart, chunkEnd - chunkStart);
+        LexerState lexerState;
+        ScopeState scopeState;
+        BuildDocument(document, lexerState, scopeState, filePath);
+        
+        AnnotationState state;
+        {
+            TRACE_SPAN("annotate", filePath);
+            AnnotateLines(document, state, session, filePath, true);
+        }
+        parts[chunkIndex].reset(new COutputWriter(QUEUE_ONLY));
+        {
+            TRACE_SPAN("emit", filePath);
+            EmitDocument(document, *parts[chunkIndex], state);
+        }
+        parts[chunkIndex]->StopCapture();
+        functionOutputs[chunkIndex].swap(state.functionOutputs);
+        lineCounts[chunkIndex] = document.lines.size();
+        RecordDocumentMemory(g_documentArena);
+    });
+    
+    TRACE_SPAN("join", filePath);
+    size_t lineCount = 0;
+    for (size_t chunkIndex = 0; chunkIndex < chunkCount; chunkIndex++)
+    {
+        output.AddQueued(*parts[chunkIndex]);
+        lineCount += lineCounts[chunkIndex];
+        if (chunkIndex > 0)
+        {
+            functionOutputs[0].insert(functionOutputs[chunkIndex].begin(), functionOutputs[chunkIndex].end());
+        }
+    }
+    if (session.cache != nullptr)
+    {
+        session.cache->Store(filePath, functionOutputs[0]);
+    }
+    return lineCount;
+} // AnnotateChunks
+
+
+
+/*
+ * FindChangedFile
+ * This function looks up what a --changed run may touch in a file.
+ * Input: session [IN] - the session, with or without changed files
+ *        filePath [IN] - absolute path of the source, as CacheKeyPath gives
+ * Return: const ChangedFile* - returns the file's changes, or nullptr
+ *                              when the whole file is annotated.
+ *                              No side effects.
+ */
+const ChangedFile* FindChangedFile(const AnnotationSession& session, const string& filePath)
+{
+    if (session.changedFiles == nullptr)
+    {
+        return nullptr;
+    }
+    auto changed = session.changedFiles->find(filePath);
+    return (changed != session.changedFiles->end()) ? &changed->second : nullptr;
+} // FindChangedFile
+
+
+
+/*
+ * KeepChangedSites
+ * This function drops the sites a --changed run must leave alone. A
+ * function stays, with every site in its body, when any line from its
+ * name to its closing brace changed; a site outside the kept functions
+ * stays only if its own line changed. Everything else is passed through
+ * as it is, with nothing asked.
+ * Input: document [IN/OUT] - the document, from BuildDocument
+ *        changed [IN] - the lines that changed in the file
+ * Return: void - no return value. No side effects.
+ */
+void KeepChangedSites(SourceDocument& document, const ChangedFile& changed)
+{
+    const vector<LineRange>& ranges = changed.ranges;
+    auto overlaps = [&](size_t firstLine, size_t lastLine)
+    {
+        auto range = lower_bound(ranges.begin(), ranges.end(), firstLine,
+                                 [](const LineRange& candidate, size_t line)
+        {
+            return candidate.lastLine < line;
+        });
+        return range != ranges.end() && range->firstLine <= lastLine;
+    };
+    
+    vector<LineRange> keptLines(ranges);
+    for (const ScopeNode& node : document.scopeTree)
+    {
+        size_t lastLine = (node.endLine == NO_FUNCTION_END) ? document.lines.size() : node.endLine;
+        if (node.kind == SCOPE_FUNCTION && overlaps(node.nameLine, lastLine))
+        {
+            keptLines.push_back(LineRange{node.nameLine, lastLine});
+        }
+    }
+    sort(keptLines.begin(), keptLines.end(), [](const LineRange& a, const LineRange& b)
+    {
+        return a.firstLine < b.firstLine;
+    });
+    
+    // Sites and kept lines are both in line order
+    size_t rangeIndex = 0;
+    size_t keptCount = 0;
+    for (const DocumentSite& site : document.sites)
+    {
+        while (rangeIndex < keptLines.size() && keptLines[rangeIndex].lastLine < site.lineIndex)
+        {
+            rangeIndex++;
+        }
+        bool inside = false;
+        for (size_t r = rangeIndex; r < keptLines.size() && keptLines[r].firstLine <= site.lineIndex; r++)
+        {
+            if (keptLines[r].lastLine >= site.lineIndex)
+            {
+                inside = true;
+                break;
+            }
+        }
+        if (inside)
+        {
+            document.sites[keptCount++] = site;
+        }
+    }
+    document.sites.resize(keptCount);
+} // KeepChangedSites
+
+
+
+/*
+ * AnnotateSource
+ * This function annotates a whole source file held in memory, building
+ * its document in this thread's arena. A large file is cut into pieces
+ * for the session's split threads when it can be; in a --changed run
+ * only the changed functions are annotated. Unchanged lines are
+ * passed to the writer as spans of source, so source must stay valid
+ * until the writer is flushed.
+ * Input: source [IN] - the source code text
+ *        sourceLength [IN] - size of source in bytes
+ *        output [IN/OUT] - writer the commented code is queued on
+ *        session [IN] - where answers come from and the optional cache
+ *        filePath [IN] - absolute path of the source, for the cache
+ * Return: size_t - returns the number of source lines processed.
+ *                  Side effects: queues the annotated source, prompts
+ *                  user when interactive and updates the cache.
+ */
+size_t AnnotateSource(const char* source, size_t sourceLength, COutputWriter& output,
+                      const AnnotationSession& session, const string& filePath)
+{
+    // The few changed functions of a file are not worth cutting it for
+    const ChangedFile* changed = FindChangedFile(session, filePath);
+    if (changed == nullptr && session.splitThreads > 1 && sourceLength >= SPLIT_MIN_FILE_BYTES)
+    {
+        vector<size_t> chunkOffsets;
+        {
+            TRACE_SPAN("split", filePath);
+            FindChunkOffsets(source, sourceLength, sourceLength / (session.splitThreads * SPLIT_CHUNKS_PER_THREAD),
+                             chunkOffsets);
+        }
+        if (chunkOffsets.size() > 1)
+        {
+            return AnnotateChunks(source, sourceLength, chunkOffsets, output, session, filePath);
+        }
+    }
+    
+    g_documentArena.Reset();
+    SourceDocument document(g_documentArena, source, sourceLength);
+    LexerState lexerState;
+    ScopeState scopeState;
+    BuildDocument(document, lexerState, scopeState, filePath);
+    if (changed != nullptr)
+    {
+        KeepChangedSites(document, *changed);
+    }
+    AnnotateDocument(document, output, session, filePath);
+    return document.lines.size();
+} // AnnotateSource
+
+
+
+/*
+ * DefaultOutputPath
+ * This function builds the default output name for an input file by
+ * putting "commented_" in front of the file name, in the same folder.
+ * Input: inputPath [IN] - path of the input file
+ * Return: string - returns the output path, e.g. "/src/commented_a.cpp"
+ *                  for "/src/a.cpp". No side effects.
+ */
+string DefaultOutputPath(const string& inputPath)
+{
+    size_t slashPos = inputPath.rfind('/');
+    if (slashPos == string::npos)
+    {
+        return "commented_" + inputPath;
+    }
+    return inputPath.substr(0, slashPos + 1) + "commented_" + inputPath.substr(slashPos + 1);
+} // DefaultOutputPath
+
+
+
+/*
+ * IsSameFile
+ * This function tells whether two paths name one existing file, by
+ * device and inode, so links and other spellings are caught too.
+ * Input: pathA [IN] - the first path
+ *        pathB [IN] - the second path
+ * Return: bool - returns true if both exist and are the same file,
+ *                false otherwise. No side effects.
+ */
+bool IsSameFile(const string& pathA, const string& pathB)
+{
+    struct stat infoA;
+    struct stat infoB;
+    return stat(pathA.c_str(), &infoA) == 0 && stat(pathB.c_str(), &infoB) == 0 &&
+           infoA.st_dev == infoB.st_dev && infoA.st_ino == infoB.st_ino;
+} // IsSameFile
+
+
+
+/*
+ * CacheKeyPath
+ * This function gives the absolute, normalized form of a path, so the
+ * same file has the same cache key from any working directory.
+ * Input: filePath [IN] - the path as given
+ * Return: string - returns the absolute path, or filePath if it cannot
+ *                  be resolved. No side effects.
+ */
+string CacheKeyPath(const string& filePath)
+{
+    error_code errorCode;
+    filesystem::path absolutePath = filesystem::absolute(filePath, errorCode);
+    return errorCode ? filePath : absolutePath.lexically_normal().string();
+} // CacheKeyPath
+
+
+
+/*
+ * AnnotateFileFromSpec
+ * This function annotates one file in batch mode, without prompting.
+ * Safe to call from several threads at once; errors are returned
+ * instead of printed.
+ * Input: session [IN] - the loaded batch spec and optional cache
+ *        inputPath [IN] - path of the source file
+ *        outputPath [IN] - path to write the commented file to
+ *        errorMessage [OUT] - receives the reason when annotation fails
+ * Return: bool - returns true if the file was annotated, false if it
+ *                could not be opened. Side effect: writes outputPath.
+ */
+bool AnnotateFileFromSpec(const AnnotationSession& session, const string& inputPath,
+                          const string& outputPath, string& errorMessage)
+{
+    const AnnotationSpec& spec = *session.spec;
+    TRACE_SPAN("file", inputPath);
+    COUNT_STAT(STAT_FILES, 1);
+    
+    CMappedFile inputFile;
+    bool opened;
+    {
+        TRACE_SPAN("map input", inputPath);
+        opened = inputFile.Open(inputPath, errorMessage);
+    }
+    if (!opened)
+    {
+        return false;
+    }
+    
+    // Truncating the input would pull the mapping out from under us
+    if (IsSameFile(inputPath, outputPath))
+    {
+        errorMessage = "Cannot write " + outputPath + " over its own input";
+        return false;
+    }
+    int outputDescriptor = open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outputDescriptor < 0)
+    {
+        errorMessage = "Cannot create " + outputPath;
+        return false;
+    }
+    
+    // A --changed run only heads files that are new
+    COutputWriter output(outputDescriptor);
+    const ChangedFile* changed = FindChangedFile(session, CacheKeyPath(inputPath));
+    if ((changed == nullptr || changed->added) &&
+        !HasFileHeader(inputFile.Data(), inputFile.Size(), spec.style))
+    {
+        string date = spec.date.empty() ? GetTodaysDate() : spec.date;
+        CreateFileHeader(output, spec.style, inputPath, date, spec.project, spec.description);
+    }
+#ifdef CG_COUNT_ALLOCATIONS
+    size_t allocationsBefore = g_threadAllocations;
+    g_annotateLines += AnnotateSource(inputFile.Data(), inputFile.Size(), output, session,
+                                      CacheKeyPath(inputPath));
+    g_annotateAllocations += g_threadAllocations - allocationsBefore;
+#else
+    AnnotateSource(inputFile.Data(), inputFile.Size(), output, session, CacheKeyPath(inputPath));
+#endif
+    
+    bool written;
+    {
+        TRACE_SPAN("write output", outputPath);
+        written = output.Flush();
+    }
+    if (close(outputDescriptor) != 0 || !written)
+    {
+        errorMessage = "Write failed for " + outputPath;
+        return false;
+    }
+    return true;
+} // AnnotateFileFromSpec
+
+
+
+/*
+ * DiffPath
+ * This function gives the path a file has in a diff header: relative
+ * to the working directory when it is inside it, without "./".
+ * Input: filePath [IN] - the path as given
+ * Return: string - returns the path for the diff. No side effects.
+ */
+string DiffPath(const string& filePath)
+{
+    error_code errorCode;
+    filesystem::path relativePath = filesystem::proximate(filePath, errorCode);
+    if (errorCode)
+    {
+        relativePath = filePath;
+    }
+    return relativePath.lexically_normal().generic_string();
+} // DiffPath
+
+
+
+/*
+ * CollectAnnotationChanges
+ * This function annotates a document from a spec, without prompting,
+ * and gives the result as line changes; the file header comes first
+ * when the source has none (and, in a --changed run, is new).
+ * Input: document [IN/OUT] - document whose source is set
+ *        session [IN] - the spec, optional cache and changed lines
+ *        filePath [IN] - path of the source, for the header and cache
+ *        changes [OUT] - receives the changes in line order
+ * Return: void - no return value. No side effects.
+ */
+void CollectAnnotationChanges(SourceDocument& document, const AnnotationSession& session,
+                              const string& filePath, vector<DiffChange>& changes)
+{
+    const AnnotationSpec& spec = *session.spec;
+    const ChangedFile* changed = FindChangedFile(session, CacheKeyPath(filePath));
+    string fileHeader;
+    if ((changed == nullptr || changed->added) &&
+        !HasFileHeader(document.source, document.sourceLength, spec.style))
+    {
+        COutputWriter renderer(-1);
+        renderer.StartCapture(&fileHeader);
+        string date = spec.date.empty() ? GetTodaysDate() : spec.date;
+        CreateFileHeader(renderer, spec.style, filePath, date, spec.project, spec.description);
+        renderer.StopCapture();
+    }
+    
+    LexerState lexerState;
+    ScopeState scopeState;
+    BuildDocument(document, lexerState, scopeState, filePath);
+    if (changed != nullptr)
+    {
+        KeepChangedSites(document, *changed);
+    }
+    AnnotationState state;
+    {
+        TRACE_SPAN("annotate", filePath);
+        AnnotateLines(document, state, session, CacheKeyPath(filePath), true);
+    }
+    TRACE_SPAN("changes", filePath);
+    CollectDiffChanges(document, fileHeader, changes);
+} // CollectAnnotationChanges
+
+
+
+/*
+ * DiffFileFromSpec
+ * This function annotates one file in batch mode and gives the result
+ * as a unified diff against the file, instead of writing a whole copy.
+ * Safe to call from several threads at once; errors are returned
+ * instead of printed.
+ * Input: session [IN] - the loaded batch spec; the cache is not used
+ *        inputPath [IN] - path of the source file
+ *        patch [OUT] - receives the diff, empty if nothing changes
+ *        errorMessage [OUT] - receives the reason when annotation fails
+ * Return: bool - returns true if the file was annotated, false if it
+ *                could not be opened. No side effects.
+ */
+bool DiffFileFromSpec(const AnnotationSession& session, const string& inputPath,
+                      string& patch, string& errorMessage)
+{
+    TRACE_SPAN("file", inputPath);
+    COUNT_STAT(STAT_FILES, 1);
+    
+    CMappedFile inputFile;
+    bool opened;
+    {
+        TRACE_SPAN("map input", inputPath);
+        opened = inputFile.Open(inputPath, errorMessage);
+    }
+    if (!opened)
+    {
+        return false;
+    }
+    
+    g_documentArena.Reset();
+    SourceDocument document(g_documentArena, inputFile.Data(), inputFile.Size());
+    vector<DiffChange> changes;
+    CollectAnnotationChanges(document, session, inputPath, changes);
+    {
+        TRACE_SPAN("diff", inputPath);
+        WriteUnifiedDiff(document, changes, DiffPath(inputPath), patch);
+    }
+    RecordDocumentMemory(g_documentArena);
+    return true;
+} // DiffFileFromSpec
+
+
+
+/*
+ * InPlaceTarget
+ * A source file being rewritten in place: the file itself, the
+ * temporary file next to it that receives the new text, and what the
+ * new file has to keep from the old one.
+ */
+struct InPlaceTarget
+{
+    string targetPath;            // symlinks resolved, so the link stays
+    string temporaryPath;
+    struct stat fileInfo;
+};
+
+
+
+/*
+ * PrepareInPlaceTarget
+ * This function creates the temporary file for rewriting a file in
+ * place. It lives in the same directory, so the final rename cannot
+ * cross file systems; its name does not look like a source file, so one
+ * left behind by a crash is not annotated later; and it is made with
+ * mkstemp, so no other writer can share it.
+ * Input: inputPath [IN] - the file to rewrite
+ *        target [OUT] - receives the paths and the file's current state
+ *        errorMessage [OUT] - receives the reason when it cannot be done
+ * Return: bool - returns true if the file can be rewritten, false
+ *                otherwise. Side effect: creates the temporary file.
+ */
+bool PrepareInPlaceTarget(const string& inputPath, InPlaceTarget& target, string& errorMessage)
+{
+    error_code errorCode;
+    filesystem::path targetPath = filesystem::canonical(inputPath, errorCode);
+    if (errorCode || stat(targetPath.c_str(), &target.fileInfo) != 0 || !S_ISREG(target.fileInfo.st_mode))
+    {
+        errorMessage = "Cannot rewrite " + inputPath + ": not a regular file";
+        return false;
+    }
+    target.targetPath = targetPath.string();
+    string pathTemplate = (targetPath.parent_path() / ("." + targetPath.filename().string() +
+                                                       ".commentgen-XXXXXX")).string();
+    if (!CreateTemporaryFile(pathTemplate, target.temporaryPath))
+    {
+        errorMessage = "Cannot create a temporary file beside " + inputPath;
+        return false;
+    }
+    return true;
+} // PrepareInPlaceTarget
+
+
+
+/*
+ * FinishInPlaceTarget
+ * This function gives a written temporary file the permissions and,
+ * where allowed, the owner of the file it will replace.
+ * Input: target [IN] - the prepared target, temporary file written
+ *        errorMessage [OUT] - receives the reason when it fails
+ * Return: bool - returns true if the permissions were copied, false
+ *                otherwise. Side effect: changes the temporary file.
+ */
+bool FinishInPlaceTarget(const InPlaceTarget& target, string& errorMessage)
+{
+    if (chmod(target.temporaryPath.c_str(), target.fileInfo.st_mode & 07777) != 0)
+    {
+        errorMessage = "Cannot set permissions of " + target.temporaryPath;
+        return false;
+    }
+    
+    // Only root may give a file away; anyone else keeps ownership as is
+    if (chown(target.temporaryPath.c_str(), target.fileInfo.st_uid, target.fileInfo.st_gid) != 0 &&
+        errno != EPERM)
+    {
+        errorMessage = "Cannot set owner of " + target.temporaryPath;
+        return false;
+    }
+    return true;
+} // FinishInPlaceTarget
+
+
+
+/*
+ * CommitInPlaceTargets
+ * This function moves written temporary files over their sources. All
+ * of them are made durable first with one syncfs per file system,
+ * instead of one fsync per file; then each is renamed, which replaces
+ * its source atomically; then each directory is synced once so the
+ * renames last. A crash at any point leaves every source either old or
+ * new, never half written.
+ * Input: targets [IN] - the files to replace, temporary files written
+ *        errorMessages [OUT] - receives, per target, why it failed
+ * Return: size_t - returns the number of files replaced durably; a
+ *                  target whose directory cannot be synced counts as
+ *                  failed. Side effects: replaces sources, removes
+ *                  temporary files on error.
+ */
+size_t CommitInPlaceTargets(const vector<InPlaceTarget>& targets, vector<string>& errorMessages)
+{
+    errorMessages.assign(targets.size(), string());
+    
+    // One sync per file system, through the first directory on it
+    {
+        TRACE_SPAN("sync");
+        map<dev_t, bool> syncedDevices;
+        for (size_t i = 0; i < targets.size(); i++)
+        {
+            dev_t device = targets[i].fileInfo.st_dev;
+            if (syncedDevices.count(device) == 0)
+            {
+                string directory = filesystem::path(targets[i].targetPath).parent_path().string();
+                int directoryDescriptor = open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+                syncedDevices[device] = (directoryDescriptor >= 0 && syncfs(directoryDescriptor) == 0);
+                if (directoryDescriptor >= 0)
+                {
+                    close(directoryDescriptor);
+                }
+            }
+            if (!syncedDevices[device])
+            {
+                errorMessages[i] = "Cannot sync " + targets[i].temporaryPath + ", " +
+                                   targets[i].targetPath + " left unchanged";
+            }
+        }
+    }
+    
+    size_t replacedCount = 0;
+    map<string, vector<size_t>> directories;
+    {
+        TRACE_SPAN("rename");
+        for (size_t i = 0; i < targets.size(); i++)
+        {
+            if (errorMessages[i].empty() &&
+                rename(targets[i].temporaryPath.c_str(), targets[i].targetPath.c_str()) != 0)
+            {
+                errorMessages[i] = "Cannot replace " + targets[i].targetPath + ": " + strerror(errno);
+            }
+            if (!errorMessages[i].empty())
+            {
+                remove(targets[i].temporaryPath.c_str());
+                continue;
+            }
+            directories[filesystem::path(targets[i].targetPath).parent_path().string()].push_back(i);
+            replacedCount++;
+        }
+    }
+    
+    // A rename is only durable once its directory is synced
+    TRACE_SPAN("sync directories");
+    for (const auto& directory : directories)
+    {
+        int directoryDescriptor = open(directory.first.c_str(), O_RDONLY | O_DIRECTORY);
+        bool synced = (directoryDescriptor >= 0 && fsync(directoryDescriptor) == 0);
+        if (directoryDescriptor >= 0)
+        {
+            close(directoryDescriptor);
+        }
+        if (!synced)
+        {
+            for (size_t i : directory.second)
+            {
+                errorMessages[i] = "Cannot sync " + directory.first + ", " + targets[i].targetPath +
+                                   " replaced but may not survive a crash";
+                replacedCount--;
+            }
+        }
+    }
+    return replacedCount;
+} // CommitInPlaceTargets
+
+
+
+// Bytes read from the input at a time by the filter mode
+const size_t STREAM_CHUNK_SIZE = 1 << 20;
+
+/*
+ * AnnotateStream
+ * This function annotates source read from a descriptor a chunk at a
+ * time, so memory stays flat however long the input is. Each chunk is
+ * cut after its last line that ends a statement or opens or closes a
+ * block, else after its last complete line; the rest waits for the next
+ * read. Only a line longer than a chunk makes the buffer grow.
+ * Input: inputDescriptor [IN] - where the source is read from
+ *        output [IN/OUT] - writer the commented code goes to
+ *        session [IN] - where answers come from; must not prompt
+ *        startOutput [IN] - called with the first chunk before anything
+ *                           is written, e.g. to add a file header
+ *        errorMessage [OUT] - why annotating failed
+ * Return: bool - returns true if all of the input was annotated and
+ *                written, false otherwise.
+ */
+bool AnnotateStream(int inputDescriptor, COutputWriter& output, const AnnotationSession& session,
+                    const function<void(string_view)>& startOutput, string& errorMessage)
+{
+    vector<char> buffer(STREAM_CHUNK_SIZE);
+    CArena arena;
+    LexerState lexerState;
+    ScopeState scopeState;
+    AnnotationState state;
+    size_t filled = 0;
+    bool atEnd = false;
+    bool started = false;
+    
+    while (!atEnd)
+    {
+        // Fill the buffer so pipes do not cost a write per read
+        while (filled < buffer.size())
+        {
+            ssize_t bytesRead = read(inputDescriptor, buffer.data() + filled, buffer.size() - filled);
+            if (bytesRead < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (bytesRead < 0)
+            {
+                errorMessage = string("Cannot read input: ") + strerror(errno);
+                return false;
+            }
+            if (bytesRead == 0)
+            {
+                atEnd = true;
+                break;
+            }
+            filled += (size_t)bytesRead;
+        }
+        
+        // Annotate up to the last complete line; all of it at the end
+        size_t usable = filled;
+        if (!atEnd)
+        {
+            const void* lastNewline = memrchr(buffer.data(), '\n', filled);
+            if (lastNewline == nullptr)
+            {
+                buffer.resize(buffer.size() * 2);
+                continue;
+            }
+            usable = (const char*)lastNewline - buffer.data() + 1;
+            
+            // Rather cut after a line ending in ';', '{' or '}', so no
+            // function head is split between two chunks
+            for (size_t lineEnd = usable - 1; lineEnd > 0; )
+            {
+                const void* previousNewline = memrchr(buffer.data(), '\n', lineEnd);
+                size_t lineStart = (previousNewline == nullptr) ? 0 : (const char*)previousNewline - buffer.data() + 1;
+                string_view trimmed = TrimWhitespace(string_view(buffer.data() + lineStart, lineEnd - lineStart));
+                if (!trimmed.empty() && (trimmed.back() == ';' || trimmed.back() == '{' || trimmed.back() == '}'))
+                {
+                    usable = lineEnd + 1;
+                    break;
+                }
+                if (lineStart == 0)
+                {
+                    break;
+                }
+                lineEnd = lineStart - 1;
+            }
+        }
+        
+        if (!started)
+        {
+            startOutput(string_view(buffer.data(), filled));
+            started = true;
+        }
+        
+        // Each chunk gets its own document; comments held at its end
+        // are carried over as text
+        arena.Reset();
+        SourceDocument document(arena, buffer.data(), usable);
+        BuildDocument(document, lexerState, scopeState, "stdin");
+        {
+            TRACE_SPAN("annotate", "stdin");
+            AnnotateLines(document, state, session, "", atEnd);
+        }
+        {
+            TRACE_SPAN("emit", "stdin");
+            EmitDocument(document, output, state);
+        }
+        RecordDocumentMemory(arena);
+        
+        // The writer points into the buffer, so write before reusing it
+        if (!output.Flush())
+        {
+            errorMessage = "Cannot write output";
+            return false;
+        }
+        memmove(buffer.data(), buffer.data() + usable, filled - usable);
+        filled -= usable;
+    }
+    return true;
+} // AnnotateStream
+
+
+
+/*
+ * Outline index
+ * A binary index of the functions in a tree: for each source file its
+ * functions with name, signature span, body lines and doc status. It
+ * is written by --outline and read in place by --query, so lookups do
+ * not touch the sources. Layout, in native byte order:
+ *   OutlineHeader
+ *   OutlineFileRecord[fileCount]
+ *   OutlineFunctionRecord[functionCount], grouped by file
+ *   uint32_t nameOrder[functionCount], function numbers sorted by the
+ *            name without its Class:: qualifiers
+ *   text: paths and names, referenced by offset and length
+ * Each part starts on an 8-byte boundary.
+ */
+const char OUTLINE_MAGIC[8] = { 'C', 'G', 'O', 'U', 'T', 'L', 'N', '1' };
+
+struct OutlineHeader
+{
+    char magic[8];
+    uint32_t fileCount;
+    uint32_t functionCount;
+    uint64_t textOffset;
+    uint64_t textLength;
+};
+
+struct OutlineFileRecord
+{
+    uint64_t pathOffset;
+    uint32_t pathLength;
+    uint32_t firstFunction;
+    uint32_t functionCount;
+    uint32_t lineCount;
+    uint64_t sourceSize;          // size and time the file had when indexed,
+    int64_t modifiedTime;         // so unchanged files are not scanned again
+};
+
+enum DocStatus
+{
+    DOC_STATUS_UNDOCUMENTED,
+    DOC_STATUS_DOCUMENTED,        // has a comment block of its own
+    DOC_STATUS_GENERATED          // has a header this program wrote
+};
+
+struct OutlineFunctionRecord
+{
+    uint64_t nameOffset;
+    uint64_t signatureOffset;     // byte span of the signature line in the source
+    uint32_t signatureLength;
+    uint32_t nameLength;
+    uint32_t fileIndex;
+    uint32_t startLine;           // 1-based; the signature line
+    uint32_t endLine;             // closing line, 0 if the body never closes
+    uint32_t docLine;             // first line of its doc comment, or startLine
+    uint32_t docStatus;
+    uint32_t reserved;
+};
+
+/*
+ * OutlineFunction
+ * One function found while building the index.
+ */
+struct OutlineFunction
+{
+    string name;
+    uint64_t signatureOffset;
+    uint32_t signatureLength;
+    uint32_t startLine;
+    uint32_t endLine;
+    uint32_t docLine;
+    DocStatus docStatus;
+};
+
+/*
+ * OutlineFile
+ * One source file of the index being built.
+ */
+struct OutlineFile
+{
+    string path;
+    uint32_t lineCount = 0;
+    uint64_t sourceSize = 0;
+    int64_t modifiedTime = 0;
+    vector<OutlineFunction> functions;
+};
+
+
+
+/*
+ * OutlineDocument
+ * This function lists the functions of a scanned document with the
+ * same rules AnnotateLines uses: comment blocks right above a function
+ * are its documentation, and brace tracking finds where it ends.
+ * Input: document [IN] - the document, from BuildDocument
+ *        functions [OUT] - receives the functions in line order
+ * Return: void - no return value. No side effects.
+ */
+void OutlineDocument(const SourceDocument& document, vector<OutlineFunction>& functions)
+{
+    const ArenaVector<LineSpan>& lineSpans = document.lines;
+    size_t siteIndex = 0;
+    size_t nodeIndex = 0;
+    int braceDepth = 0;
+    bool inFunction = false;
+    bool holding = false;
+    size_t heldStart = 0;
+    string_view headerMarker = TemplateMarker(DEFAULT_COMMENT_STYLE.functionHeader);
+    
+    for (size_t lineIndex = 0; lineIndex < lineSpans.size(); lineIndex++)
+    {
+        const LineSpan& span = lineSpans[lineIndex];
+        string_view currentLine(document.source + span.start, span.length);
+        if (IsCommentLine(span) || (holding && TrimWhitespace(currentLine).empty()))
+        {
+            if (!holding && StartsDocComment(currentLine, headerMarker))
+            {
+                holding = true;
+                heldStart = lineIndex;
+            }
+            continue;
+        }
+        
+        while (siteIndex < document.sites.size() && document.sites[siteIndex].lineIndex < lineIndex)
+        {
+            siteIndex++;
+        }
+        if (siteIndex < document.sites.size() && document.sites[siteIndex].lineIndex == lineIndex &&
+            IsFunctionDefinition(document.sites[siteIndex].features))
+        {
+            OutlineFunction function;
+            ExistingDoc existingDoc = DOC_NONE;
+            if (holding)
+            {
+                size_t heldOffset = lineSpans[heldStart].start;
+                FunctionAnswers unused;
+                existingDoc = ParseExistingDoc(string_view(document.source + heldOffset,
+                                                           span.start - heldOffset), headerMarker, unused);
+            }
+            
+            // The scope tree knows the qualified name, e.g. "shapes::CCounter::Increment"
+            while (nodeIndex < document.scopeTree.size() &&
+                   (document.scopeTree[nodeIndex].kind != SCOPE_FUNCTION ||
+                    document.scopeTree[nodeIndex].nameLine < lineIndex))
+            {
+                nodeIndex++;
+            }
+            string_view signature = TrimWhitespace(currentLine);
+            function.name = string(ExtractFunctionName(signature));
+            if (nodeIndex < document.scopeTree.size() && !document.scopeTree[nodeIndex].name.empty())
+            {
+                function.name = string(document.scopeTree[nodeIndex].name);
+            }
+            function.signatureOffset = signature.data() - document.source;
+            function.signatureLength = (uint32_t)signature.length();
+            function.startLine = (uint32_t)lineIndex + 1;
+            function.endLine = 0;
+            function.docLine = (existingDoc == DOC_NONE) ? function.startLine : (uint32_t)heldStart + 1;
+            function.docStatus = (existingDoc == DOC_KEEP) ? DOC_STATUS_GENERATED :
+                                 (existingDoc == DOC_CONVERT) ? DOC_STATUS_DOCUMENTED
+                                                              : DOC_STATUS_UNDOCUMENTED;
+            functions.push_back(function);
+            inFunction = true;
+            braceDepth = 0;
+        }
+        holding = false;
+        
+        braceDepth += span.openBraces - span.closeBraces;
+        if (inFunction && span.closeBraces > 0 && braceDepth == 0)
+        {
+            functions.back().endLine = (uint32_t)lineIndex + 1;
+            inFunction = false;
+        }
+    }
+} // OutlineDocument
+
+
+
+/*
+ * OutlineSourceFile
+ * This function maps one source file and lists its functions.
+ * Safe to call from several threads at once.
+ * Input: file [IN/OUT] - path set; receives the functions and line count
+ *        errorMessage [OUT] - receives the reason when reading fails
+ * Return: bool - returns true if the file was read, false otherwise.
+ *                No side effects.
+ */
+bool OutlineSourceFile(OutlineFile& file, string& errorMessage)
+{
+    TRACE_SPAN("file", file.path);
+    COUNT_STAT(STAT_FILES, 1);
+    
+    CMappedFile inputFile;
+    if (!inputFile.Open(file.path, errorMessage))
+    {
+        return false;
+    }
+    g_documentArena.Reset();
+    SourceDocument document(g_documentArena, inputFile.Data(), inputFile.Size());
+    LexerState lexerState;
+    ScopeState scopeState;
+    BuildDocument(document, lexerState, scopeState, file.path);
+    {
+        TRACE_SPAN("outline", file.path);
+        OutlineDocument(document, file.functions);
+    }
+    COUNT_STAT(STAT_FUNCTIONS, file.functions.size());
+    RecordDocumentMemory(g_documentArena);
+    file.lineCount = (uint32_t)document.lines.size();
+    return true;
+} // OutlineSourceFile
+
+
+
+/*
+ * ShortFunctionName
+ * This function drops the Class:: and namespace:: qualifiers of a name.
+ * Input: name [IN] - the name as written at the definition
+ * Return: string_view - returns the part after the last "::".
+ *                       No side effects.
+ */
+string_view ShortFunctionName(string_view name)
+{
+    size_t colonPos = name.rfind("::");
+    return (colonPos == string_view::npos) ? name : name.substr(colonPos + 2);
+} // ShortFunctionName
+
+
+
+/*
+ * WriteOutlineIndex
+ * This function writes the outline index of a set of files. It writes a
+ * temporary file first and renames it, so readers never see half of it.
+ * Input: indexPath [IN] - path of the index file
+ *        files [IN] - the indexed files, in the order to store them
+ * Return: bool - returns true if the index was written, false otherwise.
+ *                Side effect: replaces the index file.
+ */
+bool WriteOutlineIndex(const string& indexPath, const vector<OutlineFile>& files)
+{
+    // Lay out the fixed-size parts first, then the text they point into
+    size_t functionCount = 0;
+    for (const OutlineFile& file : files)
+    {
+        functionCount += file.functions.size();
+    }
+    if (files.size() > UINT32_MAX || functionCount > UINT32_MAX)
+    {
+        return false;
+    }
+    
+    size_t fileTableOffset = sizeof(OutlineHeader);
+    size_t functionTableOffset = fileTableOffset + files.size() * sizeof(OutlineFileRecord);
+    size_t nameOrderOffset = functionTableOffset + functionCount * sizeof(OutlineFunctionRecord);
+    size_t textOffset = (nameOrderOffset + functionCount * sizeof(uint32_t) + 7) & ~(size_t)7;
+    
+    vector<OutlineFileRecord> fileRecords(files.size());
+    vector<OutlineFunctionRecord> functionRecords;
+    functionRecords.reserve(functionCount);
+    string text;
+    for (size_t fileIndex = 0; fileIndex < files.size(); fileIndex++)
+    {
+        const OutlineFile& file = files[fileIndex];
+        OutlineFileRecord& fileRecord = fileRecords[fileIndex];
+        fileRecord.pathOffset = text.length();
+        fileRecord.pathLength = (uint32_t)file.path.length();
+        fileRecord.firstFunction = (uint32_t)functionRecords.size();
+        fileRecord.functionCount = (uint32_t)file.functions.size();
+        fileRecord.lineCount = file.lineCount;
+        fileRecord.sourceSize = file.sourceSize;
+        fileRecord.modifiedTime = file.modifiedTime;
+        text += file.path;
+        
+        for (const OutlineFunction& function : file.functions)
+        {
+            OutlineFunctionRecord functionRecord = {};
+            functionRecord.nameOffset = text.length();
+            functionRecord.nameLength = (uint32_t)function.name.length();
+            functionRecord.signatureOffset = function.signatureOffset;
+            functionRecord.signatureLength = function.signatureLength;
+            functionRecord.fileIndex = (uint32_t)fileIndex;
+            functionRecord.startLine = function.startLine;
+            functionRecord.endLine = function.endLine;
+            functionRecord.docLine = function.docLine;
+            functionRecord.docStatus = function.docStatus;
+            functionRecords.push_back(functionRecord);
+            text += function.name;
+        }
+    }
+    
+    vector<uint32_t> nameOrder(functionCount);
+    for (size_t i = 0; i < functionCount; i++)
+    {
+        nameOrder[i] = (uint32_t)i;
+    }
+    auto shortName = [&](uint32_t functionIndex)
+    {
+        const OutlineFunctionRecord& record = functionRecords[functionIndex];
+        return ShortFunctionName(string_view(text.data() + record.nameOffset, record.nameLength));
+    };
+    stable_sort(nameOrder.begin(), nameOrder.end(), [&](uint32_t left, uint32_t right)
+    {
+        return shortName(left) < shortName(right);
+    });
+    
+    OutlineHeader header = {};
+    memcpy(header.magic, OUTLINE_MAGIC, sizeof(header.magic));
+    header.fileCount = (uint32_t)files.size();
+    header.functionCount = (uint32_t)functionCount;
+    header.textOffset = textOffset;
+    header.textLength = text.length();
+    
+    string temporaryPath;
+    if (!CreateTemporaryFile(indexPath + ".tmp.XXXXXX", temporaryPath))
+    {
+        return false;
+    }
+    ofstream indexFile(temporaryPath, ios::binary | ios::trunc);
+    if (!indexFile.is_open())
+    {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+    static const char padding[8] = {};
+    indexFile.write((const char*)&header, sizeof(header));
+    indexFile.write((const char*)fileRecords.data(), fileRecords.size() * sizeof(OutlineFileRecord));
+    indexFile.write((const char*)functionRecords.data(), functionRecords.size() * sizeof(OutlineFunctionRecord));
+    indexFile.write((const char*)nameOrder.data(), nameOrder.size() * sizeof(uint32_t));
+    indexFile.write(padding, textOffset - (nameOrderOffset + functionCount * sizeof(uint32_t)));
+    indexFile.write(text.data(), text.length());
+    
+    indexFile.close();
+    if (!indexFile || rename(temporaryPath.c_str(), indexPath.c_str()) != 0)
+    {
+        remove(temporaryPath.c_str());
+        return false;
+    }
+    return true;
+} // WriteOutlineIndex
+
+
+
+/*
+ * COutlineIndex
+ * Read-only view of an outline index file, used in place from the
+ * mapping. Open checks that every table and offset lies inside the
+ * file, so a damaged index is rejected instead of read past its end.
+ */
+class COutlineIndex
+{
+public:
+    COutlineIndex();
+    
+    bool Open(const string& indexPath, string& errorMessage);
+    uint32_t FileCount() const;
+    uint32_t FunctionCount() const;
+    const OutlineFileRecord& File(uint32_t fileIndex) const;
+    const OutlineFunctionRecord& Function(uint32_t functionIndex) const;
+    string_view FilePath(const OutlineFileRecord& file) const;
+    string_view FunctionName(const OutlineFunctionRecord& function) const;
+    void FindByName(string_view name, vector<uint32_t>& functionIndexes) const;
+    
+private:
+    CMappedFile m_file;
+    const OutlineHeader* m_header;
+    const OutlineFileRecord* m_files;
+    const OutlineFunctionRecord* m_functions;
+    const uint32_t* m_nameOrder;
+    const char* m_text;
+};
+
+
+
+/*
+ * COutlineIndex::COutlineIndex
+ * This constructor makes an empty index.
+ * Input: None
+ * Return: None
+ */
+COutlineIndex::COutlineIndex()
+{
+    m_header = nullptr;
+    m_files = nullptr;
+    m_functions = nullptr;
+    m_nameOrder = nullptr;
+    m_text = nullptr;
+} // COutlineIndex::COutlineIndex
+
+
+
+/*
+ * COutlineIndex::Open
+ * This function maps an index file and checks its layout.
+ * Input: indexPath [IN] - path of the index file
+ *        errorMessage [OUT] - receives the reason when opening fails
+ * Return: bool - returns true if the index can be used, false
+ *                otherwise. No side effects.
+ */
+bool COutlineIndex::Open(const string& indexPath, string& errorMessage)
+{
+    if (!m_file.Open(indexPath, errorMessage))
+    {
+        return false;
+    }
+    
+    const char* data = m_file.Data();
+    size_t size = m_file.Size();
+    const OutlineHeader* header = (const OutlineHeader*)data;
+    if (size < sizeof(OutlineHeader) || memcmp(header->magic, OUTLINE_MAGIC, sizeof(header->magic)) != 0)
+    {
+        errorMessage = indexPath + " is not an outline index";
+        return false;
+    }
+    
+    uint64_t functionTableOffset = sizeof(OutlineHeader) + (uint64_t)header->fileCount * sizeof(OutlineFileRecord);
+    uint64_t nameOrderOffset = functionTableOffset +
+                               (uint64_t)header->functionCount * sizeof(OutlineFunctionRecord);
+    uint64_t tablesEnd = nameOrderOffset + (uint64_t)header->functionCount * sizeof(uint32_t);
+    if (header->textOffset < tablesEnd || header->textOffset > size ||
+        header->textLength > size - header->textOffset)
+    {
+        errorMessage = indexPath + " is damaged";
+        return false;
+    }
+    
+    const OutlineFileRecord* files = (const OutlineFileRecord*)(data + sizeof(OutlineHeader));
+    const OutlineFunctionRecord* functions = (const OutlineFunctionRecord*)(data + functionTableOffset);
+    const uint32_t* nameOrder = (const uint32_t*)(data + nameOrderOffset);
+    for (uint32_t i = 0; i < header->fileCount; i++)
+    {
+        if (files[i].pathOffset + files[i].pathLength > header->textLength ||
+            (uint64_t)files[i].firstFunction + files[i].functionCount > header->functionCount)
+        {
+            errorMessage = indexPath + " is damaged";
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < header->functionCount; i++)
+    {
+        if (functions[i].nameOffset + functions[i].nameLength > header->textLength ||
+            functions[i].fileIndex >= header->fileCount || nameOrder[i] >= header->functionCount)
+        {
+            errorMessage = indexPath + " is damaged";
+            return false;
+        }
+    }
+    
+    m_header = header;
+    m_files = files;
+    m_functions = functions;
+    m_nameOrder = nameOrder;
+    m_text = data + header->textOffset;
+    return true;
+} // COutlineIndex::Open
+
+
+
+/*
+ * COutlineIndex::FileCount
+ * This function gives the number of indexed files.
+ * Input: None
+ * Return: uint32_t - returns the number of files. No side effects.
+ */
+uint32_t COutlineIndex::FileCount() const
+{
+    return (m_header != nullptr) ? m_header->fileCount : 0;
+} // COutlineIndex::FileCount
+
+
+
+/*
+ * COutlineIndex::FunctionCount
+ * This function gives the number of indexed functions.
+ * Input: None
+ * Return: uint32_t - returns the number of functions. No side effects.
+ */
+uint32_t COutlineIndex::FunctionCount() const
+{
+    return (m_header != nullptr) ? m_header->functionCount : 0;
+} // COutlineIndex::FunctionCount
+
+
+
+/*
+ * COutlineIndex::File
+ * This function gives one file record.
+ * Input: fileIndex [IN] - below FileCount()
+ * Return: const OutlineFileRecord& - returns the record. No side effects.
+ */
+const OutlineFileRecord& COutlineIndex::File(uint32_t fileIndex) const
+{
+    return m_files[fileIndex];
+} // COutlineIndex::File
+
+
+
+/*
+ * COutlineIndex::Function
+ * This function gives one function record.
+ * Input: functionIndex [IN] - below FunctionCount()
+ * Return: const OutlineFunctionRecord& - returns the record.
+ *                                        No side effects.
+ */
+const OutlineFunctionRecord& COutlineIndex::Function(uint32_t functionIndex) const
+{
+    return m_functions[functionIndex];
+} // COutlineIndex::Function
+
+
+
+/*
+ * COutlineIndex::FilePath
+ * This function gives the path of an indexed file.
+ * Input: file [IN] - a record of this index
+ * Return: string_view - returns the path, inside the mapping.
+ *                       No side effects.
+ */
+string_view COutlineIndex::FilePath(const OutlineFileRecord& file) const
+{
+    return string_view(m_text + file.pathOffset, file.pathLength);
+} // COutlineIndex::FilePath
+
+
+
+/*
+ * COutlineIndex::FunctionName
+ * This function gives the name of an indexed function.
+ * Input: function [IN] - a record of this index
+ * Return: string_view - returns the name as written at the definition,
+ *                       inside the mapping. No side effects.
+ */
+string_view COutlineIndex::FunctionName(const OutlineFunctionRecord& function) const
+{
+    return string_view(m_text + function.nameOffset, function.nameLength);
+} // COutlineIndex::FunctionName
+
+
+
+/*
+ * COutlineIndex::FindByName
+ * This function finds functions by name with a binary search of the
+ * name order. "Print" finds every Print; "CList::Print" only the one
+ * in CList.
+ * Input: name [IN] - short or qualified function name
+ *        functionIndexes [OUT] - receives the matches in index order
+ * Return: void - no return value. No side effects.
+ */
+void COutlineIndex::FindByName(string_view name, vector<uint32_t>& functionIndexes) const
+{
+    string_view shortName = ShortFunctionName(name);
+    auto shortNameOf = [&](uint32_t functionIndex)
+    {
+        return ShortFunctionName(FunctionName(m_functions[functionIndex]));
+    };
+    const uint32_t* orderEnd = m_nameOrder + FunctionCount();
+    const uint32_t* first = lower_bound(m_nameOrder, orderEnd, shortName,
+                                        [&](uint32_t functionIndex, string_view wanted)
+    {
+        return shortNameOf(functionIndex) < wanted;
+    });
+    
+    for (const uint32_t* match = first; match != orderEnd && shortNameOf(*match) == shortName; match++)
+    {
+        // A qualified name has to match its qualifiers too
+        string_view fullName = FunctionName(m_functions[*match]);
+        if (name.length() == shortName.length() || fullName == name ||
+            (fullName.length() >= name.length() + 2 &&
+             fullName.compare(fullName.length() - name.length() - 2, 2, "::") == 0 &&
+             fullName.substr(fullName.length() - name.length()) == name))
+        {
+            functionIndexes.push_back(*match);
+        }
+    }
+    sort(functionIndexes.begin(), functionIndexes.end());
+} // COutlineIndex::FindByName
+
+
+
+/*
+ * IsSourceFileName
+ * This function checks if a file name has a C or C++ source extension.
+ * Files that are already generator output (commented_*) do not count.
+ * Input: fileName [IN] - the file name without folders
+ * Return: bool - returns true for source files, false otherwise.
+ *                No side effects.
+ */
+bool IsSourceFileName(const string& fileName)
+{
+    if (fileName.find("commented_") == 0)
+    {
+        return false;
+    }
+    
+    static const char* const extensions[] = {
+        ".cpp", ".cc", ".cxx", ".c++", ".c", ".hpp", ".hh", ".hxx", ".h"
+    };
+    for (const char* extension : extensions)
+    {
+        size_t extensionLength = strlen(extension);
+        if (fileName.length() > extensionLength &&
+            fileName.compare(fileName.length() - extensionLength, extensionLength, extension) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+} // IsSourceFileName
+
+
+
+/*
+ * CollectInputFiles
+ * This function turns the command line inputs into a list of files.
+ * Directories are searched recursively for source files and patterns
+ * with * ? or [ are expanded, so huge trees need no shell expansion.
+ * Input: inputs [IN] - files, directories and glob patterns
+ *        files [OUT] - receives the sorted list of unique files; two
+ *                      spellings of one file, such as a symlink and its
+ *                      target, count as one
+ *        errors [OUT] - receives one message per input that matched nothing
+ * Return: void - no return value. No side effects.
+ */
+void CollectInputFiles(const vector<string>& inputs, vector<string>& files,
+                       vector<string>& errors)
+{
+    for (const string& input : inputs)
+    {
+        error_code errorCode;
+        if (filesystem::is_directory(input, errorCode))
+        {
+            size_t countBefore = files.size();
+            filesystem::recursive_directory_iterator walker(
+                input, filesystem::directory_options::skip_permission_denied, errorCode);
+            for (; !errorCode && walker != filesystem::recursive_directory_iterator();
+                 walker.increment(errorCode))
+            {
+                if (walker->is_regular_file(errorCode) &&
+                    IsSourceFileName(walker->path().filename().string()))
+                {
+                    files.push_back(walker->path().string());
+                }
+            }
+            if (errorCode)
+            {
+                errors.push_back("Cannot read directory " + input + ": " + errorCode.message());
+            }
+            else if (files.size() == countBefore)
+            {
+                errors.push_back("No source files in " + input);
+            }
+        }
+        else if (input.find_first_of("*?[") != string::npos &&
+                 !filesystem::exists(input, errorCode))
+        {
+            glob_t matches;
+            if (glob(input.c_str(), 0, nullptr, &matches) == 0)
+            {
+                for (size_t i = 0; i < matches.gl_pathc; i++)
+                {
+                    files.push_back(matches.gl_pathv[i]);
+                }
+            }
+            else
+            {
+                errors.push_back("No files match " + input);
+            }
+            globfree(&matches);
+        }
+        else
+        {
+            // Plain file - a missing one is reported when it is opened
+            files.push_back(input);
+        }
+    }
+    
+    // Keep one spelling of each file, however the inputs name it
+    sort(files.begin(), files.end());
+    files.erase(unique(files.begin(), files.end()), files.end());
+    map<string, bool> known;
+    size_t keptCount = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        error_code errorCode;
+        if (known.emplace(filesystem::weakly_canonical(files[i], errorCode).string(), true).second)
+        {
+            files[keptCount++] = files[i];
+        }
+    }
+    files.resize(keptCount);
+} // CollectInputFiles
+
+
+
+/*
+ * Compile database
+ * With --project the inputs come from a compile_commands.json: every
+ * translation unit in it, plus each project header they include. Only
+ * "directory", "file" and "command" or "arguments" are read; other
+ * members are skipped.
+ */
+struct CompileCommand
+{
+    string directory;           // where the compiler ran
+    string file;                // the translation unit
+    vector<string> arguments;   // compiler argv, from either form
+};
+
+
+
+/*
+ * SkipJsonSpace
+ * This function moves past JSON white space.
+ * Input: text [IN] - the JSON text
+ *        position [IN/OUT] - where to start, left at the next token
+ * Return: void - no return value. No side effects.
+ */
+void SkipJsonSpace(string_view text, size_t& position)
+{
+    while (position < text.length() &&
+           (text[position] == ' ' || text[position] == '\t' ||
+            text[position] == '\n' || text[position] == '\r'))
+    {
+        position++;
+    }
+} // SkipJsonSpace
+
+
+
+/*
+ * ReadJsonString
+ * This function reads one JSON string and undoes its escapes; \u
+ * escapes become UTF-8.
+ * Input: text [IN] - the JSON text
+ *        position [IN/OUT] - at the opening quote, left after the closing one
+ *        value [OUT] - receives the string
+ * Return: bool - returns true if a whole string was read, false
+ *                otherwise. No side effects.
+ */
+bool ReadJsonString(string_view text, size_t& position, string& value)
+{
+    value.clear();
+    if (position >= text.length() || text[position] != '"')
+    {
+        return false;
+    }
+    position++;
+    while (position < text.length())
+    {
+        char c = text[position++];
+        if (c == '"')
+        {
+            return true;
+        }
+        if (c != '\\')
+        {
+            value += c;
+            continue;
+        }
+        if (position >= text.length())
+        {
+            return false;
+        }
+        char escape = text[position++];
+        switch (escape)
+        {
+            case 'b': value += '\b'; break;
+            case 'f': value += '\f'; break;
+            case 'n': value += '\n'; break;
+            case 'r': value += '\r'; break;
+            case 't': value += '\t'; break;
+            case 'u':
+            {
+                auto readHex = [&](uint32_t& code)
+                {
+                    if (position + 4 > text.length())
+                    {
+                        return false;
+                    }
+                    string hex(text.substr(position, 4));
+                    char* end = nullptr;
+                    code = (uint32_t)strtoul(hex.c_str(), &end, 16);
+                    position += 4;
+                    return end == hex.c_str() + 4;
+                };
+                uint32_t code = 0;
+                if (!readHex(code))
+                {
+                    return false;
+                }
+                // A surrogate pair is one code point
+                uint32_t low = 0;
+                if (code >= 0xD800 && code < 0xDC00 && position + 1 < text.length() &&
+                    text[position] == '\\' && text[position + 1] == 'u')
+                {
+                    position += 2;
+                    if (!readHex(low))
+                    {
+                        return false;
+                    }
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                if (code < 0x80)
+                {
+                    value += (char)code;
+                }
+                else if (code < 0x800)
+                {
+                    value += (char)(0xC0 | (code >> 6));
+                    value += (char)(0x80 | (code & 0x3F));
+                }
+                else if (code < 0x10000)
+                {
+                    value += (char)(0xE0 | (code >> 12));
+                    value += (char)(0x80 | ((code >> 6) & 0x3F));
+                    value += (char)(0x80 | (code & 0x3F));
+                }
+                else
+                {
+                    value += (char)(0xF0 | (code >> 18));
+                    value += (char)(0x80 | ((code >> 12) & 0x3F));
+                    value += (char)(0x80 | ((code >> 6) & 0x3F));
+                    value += (char)(0x80 | (code & 0x3F));
+                }
+                break;
+            }
+            default: value += escape; break;   // \" \\ and \/
+        }
+    }
+    return false;
+} // ReadJsonString
+
+
+
+/*
+ * SkipJsonValue
+ * This function moves past one JSON value of any kind, nested
+ * objects and arrays included.
+ * Input: text [IN] - the JSON text
+ *        position [IN/OUT] - at the value, left after it
+ * Return: bool - returns true if a value was skipped, false if the
+ *                text ends inside it. No side effects.
+ */
+bool SkipJsonValue(string_view text, size_t& position)
+{
+    int depth = 0;
+    string ignored;
+    do
+    {
+        SkipJsonSpace(text, position);
+        if (position >= text.length())
+        {
+            return false;
+        }
+        char c = text[position];
+        if (c == '"')
+        {
+            if (!ReadJsonString(text, position, ignored))
+            {
+                return false;
+            }
+        }
+        else if (c == '{' || c == '[')
+        {
+            depth++;
+            position++;
+        }
+        else if (c == '}' || c == ']')
+        {
+            depth--;
+            position++;
+        }
+        else if (c == ',' || c == ':')
+        {
+            position++;
+        }
+        else
+        {
+            // A number or literal runs to the next delimiter
+            while (position < text.length() && strchr(",:[]{}\" \t\r\n", text[position]) == nullptr)
+            {
+                position++;
+            }
+        }
+    } while (depth > 0);
+    return depth == 0;
+} // SkipJsonValue
+
+
+
+/*
+ * SplitCommandLine
+ * This function splits a "command" entry into arguments the way a
+ * POSIX shell would: white space separates them, quotes and
+ * backslashes keep characters together.
+ * Input: command [IN] - the command line
+ *        arguments [OUT] - receives the arguments
+ * Return: void - no return value. No side effects.
+ */
+void SplitCommandLine(string_view command, vector<string>& arguments)
+{
+    string argument;
+    bool inArgument = false;
+    char quote = 0;
+    for (size_t i = 0; i < command.length(); i++)
+    {
+        char c = command[i];
+        if (quote == '\'')
+        {
+            if (c == '\'') quote = 0;
+            else argument += c;
+        }
+        else if (c == '\\' && i + 1 < command.length() &&
+                 (quote == 0 || strchr("\"\\$`", command[i + 1]) != nullptr))
+        {
+            argument += command[++i];
+        }
+        else if (quote == '"')
+        {
+            if (c == '"') quote = 0;
+            else argument += c;
+        }
+        else if (c == '"' || c == '\'')
+        {
+            quote = c;
+            inArgument = true;
+        }
+        else if (c == ' ' || c == '\t' || c == '\n')
+        {
+            if (inArgument)
+            {
+                arguments.push_back(argument);
+                argument.clear();
+                inArgument = false;
+            }
+        }
+        else
+        {
+            argument += c;
+            inArgument = true;
+        }
+    }
+    if (inArgument)
+    {
+        arguments.push_back(argument);
+    }
+} // SplitCommandLine
+
+
+
+/*
+ * ParseCompileCommands
+ * This function reads a compile database: an array of objects, one
+ * per compiled file.
+ * Input: text [IN] - contents of compile_commands.json
+ *        commands [OUT] - receives one entry per object
+ *        errorMessage [OUT] - receives the reason on failure
+ * Return: bool - returns true if the text was a valid database, false
+ *                otherwise. No side effects.
+ */
+bool ParseCompileCommands(string_view text, vector<CompileCommand>& commands, string& errorMessage)
+{
+    size_t position = 0;
+    auto fail = [&](const char* reason)
+    {
+        errorMessage = string(reason) + " at byte " + to_string(position);
+        return false;
+    };
+    auto expect = [&](char wanted)
+    {
+        SkipJsonSpace(text, position);
+        if (position < text.length() && text[position] == wanted)
+        {
+            position++;
+            return true;
+        }
+        return false;
+    };
+    
+    if (!expect('['))
+    {
+        return fail("expected an array");
+    }
+    if (expect(']'))
+    {
+        return true;
+    }
+    do
+    {
+        if (!expect('{'))
+        {
+            return fail("expected an object");
+        }
+        CompileCommand command;
+        string key;
+        string value;
+        if (!expect('}'))
+        {
+            do
+            {
+                SkipJsonSpace(text, position);
+                if (!ReadJsonString(text, position, key) || !expect(':'))
+                {
+                    return fail("expected a member name");
+                }
+                SkipJsonSpace(text, position);
+                if (key == "directory" || key == "file" || key == "command")
+                {
+                    if (!ReadJsonString(text, position, value))
+                    {
+                        return fail("expected a string");
+                    }
+                    if (key == "directory") command.directory = value;
+                    else if (key == "file") command.file = value;
+                    else if (command.arguments.empty()) SplitCommandLine(value, command.arguments);
+                }
+                else if (key == "arguments")
+                {
+                    // The argv form wins over a command line
+                    command.arguments.clear();
+                    if (!expect('['))
+                    {
+                        return fail("expected an argument array");
+                    }
+                    if (!expect(']'))
+                    {
+                        do
+                        {
+                            SkipJsonSpace(text, position);
+                            if (!ReadJsonString(text, position, value))
+                            {
+                                return fail("expected a string");
+                            }
+                            command.arguments.push_back(value);
+                        } while (expect(','));
+                        if (!expect(']'))
+                        {
+                            return fail("expected , or ]");
+                        }
+                    }
+                }
+                else if (!SkipJsonValue(text, position))
+                {
+                    return fail("unexpected end");
+                }
+            } while (expect(','));
+            if (!expect('}'))
+            {
+                return fail("expected , or }");
+            }
+        }
+        if (command.file.empty())
+        {
+            return fail("entry without a file");
+        }
+        commands.push_back(move(command));
+    } while (expect(','));
+    if (!expect(']'))
+    {
+        return fail("expected , or ]");
+    }
+    return true;
+} // ParseCompileCommands
+
+
+
+/*
+ * IncludeSearchPath
+ * Where one compile command looks for included files. Directories
+ * from -isystem are left out: those headers belong to libraries.
+ */
+struct IncludeSearchPath
+{
+    vector<filesystem::path> quoteDirectories;   // -iquote, for "" only
+    vector<filesystem::path> directories;        // -I, for "" and <>
+};
+
+
+
+/*
+ * GetIncludeSearchPath
+ * This function reads the include options of a compile command.
+ * Both "-I dir" and "-Idir" spellings are taken; relative folders
+ * are relative to the command's directory.
+ * Input: command [IN] - the compile command
+ *        directory [IN] - its directory, made absolute
+ *        searchPath [OUT] - receives the include folders in order
+ * Return: void - no return value. No side effects.
+ */
+void GetIncludeSearchPath(const CompileCommand& command, const filesystem::path& directory,
+                          IncludeSearchPath& searchPath)
+{
+    const vector<string>& arguments = command.arguments;
+    for (size_t i = 0; i < arguments.size(); i++)
+    {
+        const string& argument = arguments[i];
+        vector<filesystem::path>* target = nullptr;
+        size_t flagLength = 0;
+        if (argument.compare(0, 2, "-I") == 0)
+        {
+            target = &searchPath.directories;
+            flagLength = 2;
+        }
+        else if (argument.compare(0, 7, "-iquote") == 0)
+        {
+            target = &searchPath.quoteDirectories;
+            flagLength = 7;
+        }
+        if (target == nullptr)
+        {
+            continue;
+        }
+        string folder = argument.substr(flagLength);
+        if (folder.empty() && i + 1 < arguments.size())
+        {
+            folder = arguments[++i];
+        }
+        if (!folder.empty())
+        {
+            target->push_back((directory / folder).lexically_normal());
+        }
+    }
+} // GetIncludeSearchPath
+
+
+
+/*
+ * FindIncludeDirectives
+ * This function lists the #include lines of a source. It only looks
+ * at line starts, not at comments or #if blocks, which is enough to
+ * find the headers a file may pull in.
+ * Input: source [IN] - the file contents
+ *        length [IN] - number of bytes in source
+ *        includes [OUT] - receives each included name, and whether it
+ *                         was written with quotes rather than <>
+ * Return: void - no return value. No side effects.
+ */
+void FindIncludeDirectives(const char* source, size_t length, vector<pair<string, bool>>& includes)
+{
+    const char* end = source + length;
+    for (const char* line = source; line < end; )
+    {
+        const char* lineEnd = (const char*)memchr(line, '\n', end - line);
+        if (lineEnd == nullptr)
+        {
+            lineEnd = end;
+        }
+        const char* p = line;
+        while (p < lineEnd && (*p == ' ' || *p == '\t')) p++;
+        if (p < lineEnd && *p == '#')
+        {
+            p++;
+            while (p < lineEnd && (*p == ' ' || *p == '\t')) p++;
+            if (lineEnd - p > 7 && memcmp(p, "include", 7) == 0)
+            {
+                p += 7;
+                while (p < lineEnd && (*p == ' ' || *p == '\t')) p++;
+                if (p < lineEnd && (*p == '"' || *p == '<'))
+                {
+                    char close = (*p == '"') ? '"' : '>';
+                    const char* nameEnd = (const char*)memchr(p + 1, close, lineEnd - p - 1);
+                    if (nameEnd != nullptr && nameEnd > p + 1)
+                    {
+                        includes.push_back(make_pair(string(p + 1, nameEnd), close == '"'));
+                    }
+                }
+            }
+        }
+        line = lineEnd + 1;
+    }
+} // FindIncludeDirectives
+
+
+
+/*
+ * CollectProjectFiles
+ * This function adds the files of a compile database to the inputs:
+ * each translation unit, then every header reachable from them through
+ * "" or <> includes that resolves inside the project. The project is
+ * the deepest folder holding all the units and the database itself, so
+ * system and third-party headers outside it are left alone. Each file
+ * is read and followed only once, however many units include it; a
+ * header's includes are resolved with the search path of the first
+ * unit that reached it. Files already in the list are not added again.
+ * Input: projectPath [IN] - compile_commands.json, or a folder holding it
+ *        files [IN/OUT] - the inputs so far; receives the project files
+ *        errors [OUT] - receives a message if the database is unusable
+ * Return: void - no return value. No side effects.
+ */
+void CollectProjectFiles(const string& projectPath, vector<string>& files, vector<string>& errors)
+{
+    error_code errorCode;
+    filesystem::path databasePath = filesystem::absolute(projectPath, errorCode);
+    if (filesystem::is_directory(databasePath, errorCode))
+    {
+        databasePath /= "compile_commands.json";
+    }
+    databasePath = databasePath.lexically_normal();
+    
+    vector<CompileCommand> commands;
+    {
+        CMappedFile database;
+        string errorMessage;
+        if (!database.Open(databasePath.string(), errorMessage) ||
+            !ParseCompileCommands(string_view(database.Data(), database.Size()), commands, errorMessage))
+        {
+            errors.push_back("Cannot read compile database " + databasePath.string() + ": " + errorMessage);
+            return;
+        }
+    }
+    
+    // Units are keyed by their normalized path; a file compiled twice
+    // (say in two configurations) keeps its first command
+    map<string, size_t> unitCommands;
+    vector<IncludeSearchPath> searchPaths(commands.size());
+    vector<string> unitPaths;
+    filesystem::path projectRoot = databasePath.parent_path();
+    for (size_t i = 0; i < commands.size(); i++)
+    {
+        filesystem::path directory = (databasePath.parent_path() / commands[i].directory).lexically_normal();
+        GetIncludeSearchPath(commands[i], directory, searchPaths[i]);
+        string unitPath = (directory / commands[i].file).lexically_normal().string();
+        if (!unitCommands.emplace(unitPath, i).second)
+        {
+            continue;
+        }
+        unitPaths.push_back(unitPath);
+        
+        // Narrow the root to what it shares with this unit
+        filesystem::path common;
+        filesystem::path unitFolder = filesystem::path(unitPath).parent_path();
+        auto rootPart = projectRoot.begin();
+        auto unitPart = unitFolder.begin();
+        for (; rootPart != projectRoot.end() && unitPart != unitFolder.end() && *rootPart == *unitPart;
+             ++rootPart, ++unitPart)
+        {
+            common /= *rootPart;
+        }
+        projectRoot = common;
+    }
+    string rootPrefix = projectRoot.string();
+    if (rootPrefix.empty() || rootPrefix.back() != '/')
+    {
+        rootPrefix += '/';
+    }
+    
+    // Every probe of a candidate header is remembered, since the same
+    // names are looked up from many files
+    map<string, bool> probedPaths;
+    auto isProjectFile = [&](const filesystem::path& candidate)
+    {
+        string candidatePath = candidate.string();
+        auto probe = probedPaths.find(candidatePath);
+        if (probe == probedPaths.end())
+        {
+            error_code probeError;
+            bool wanted = candidatePath.compare(0, rootPrefix.length(), rootPrefix) == 0 &&
+                          IsSourceFileName(candidate.filename().string()) &&
+                          filesystem::is_regular_file(candidate, probeError);
+            probe = probedPaths.emplace(candidatePath, wanted).first;
+        }
+        return probe->second;
+    };
+    
+    // Walk the include graph; each file is read once
+    map<string, size_t> reached;
+    vector<pair<string, size_t>> pending;
+    for (const string& unitPath : unitPaths)
+    {
+        reached.emplace(unitPath, unitCommands[unitPath]);
+        pending.push_back(make_pair(unitPath, unitCommands[unitPath]));
+    }
+    vector<pair<string, bool>> includes;
+    while (!pending.empty())
+    {
+        pair<string, size_t> current = pending.back();
+        pending.pop_back();
+        CMappedFile source;
+        string ignoredError;
+        if (!source.Open(current.first, ignoredError))
+        {
+            continue;   // reported when the file is annotated
+        }
+        includes.clear();
+        FindIncludeDirectives(source.Data(), source.Size(), includes);
+        
+        const IncludeSearchPath& searchPath = searchPaths[current.second];
+        filesystem::path includerFolder = filesystem::path(current.first).parent_path();
+        for (const pair<string, bool>& include : includes)
+        {
+            // "" looks beside the includer, then -iquote, then -I; <> only -I
+            filesystem::path found;
+            auto tryFolder = [&](const filesystem::path& folder)
+            {
+                filesystem::path candidate = (folder / include.first).lexically_normal();
+                if (isProjectFile(candidate))
+                {
+                    found = candidate;
+                    return true;
+                }
+                return false;
+            };
+            bool resolved = false;
+            if (include.second)
+            {
+                resolved = tryFolder(includerFolder);
+                for (size_t d = 0; !resolved && d < searchPath.quoteDirectories.size(); d++)
+                {
+                    resolved = tryFolder(searchPath.quoteDirectories[d]);
+                }
+            }
+            for (size_t d = 0; !resolved && d < searchPath.directories.size(); d++)
+            {
+                resolved = tryFolder(searchPath.directories[d]);
+            }
+            if (resolved && reached.emplace(found.string(), current.second).second)
+            {
+                pending.push_back(make_pair(found.string(), current.second));
+            }
+        }
+    }
+    
+    // Skip files the other inputs already name, however they spell them
+    map<string, bool> known;
+    for (const string& file : files)
+    {
+        known[filesystem::weakly_canonical(file, errorCode).string()] = true;
+    }
+    filesystem::path currentFolder = filesystem::current_path(errorCode);
+    for (const auto& entry : reached)
+    {
+        if (known.emplace(filesystem::weakly_canonical(entry.first, errorCode).string(), true).second)
+        {
+            files.push_back(filesystem::path(entry.first).lexically_proximate(currentFolder).string());
+        }
+    }
+    sort(files.begin(), files.end());
+} // CollectProjectFiles
+
+
+
+/*
+ * RunGit
+ * This function runs git and collects what it prints. Its messages on
+ * stderr go straight to ours.
+ * Input: arguments [IN] - the arguments after "git"
+ *        output [OUT] - receives git's standard output
+ *        errorMessage [OUT] - receives the reason on failure
+ * Return: bool - returns true if git ran and exited with 0, false
+ *                otherwise. Side effect: runs a child process.
+ */
+bool RunGit(const vector<string>& arguments, string& output, string& errorMessage)
+{
+    vector<char*> argv;
+    argv.push_back(const_cast<char*>("git"));
+    for (const string& argument : arguments)
+    {
+        argv.push_back(const_cast<char*>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+    
+    int pipeDescriptors[2];
+    if (pipe(pipeDescriptors) != 0)
+    {
+        errorMessage = string("cannot run git: ") + strerror(errno);
+        return false;
+    }
+    pid_t child = fork();
+    if (child < 0)
+    {
+        errorMessage = string("cannot run git: ") + strerror(errno);
+        close(pipeDescriptors[0]);
+        close(pipeDescriptors[1]);
+        return false;
+    }
+    if (child == 0)
+    {
+        dup2(pipeDescriptors[1], STDOUT_FILENO);
+        close(pipeDescriptors[0]);
+        close(pipeDescriptors[1]);
+        execvp("git", argv.data());
+        _exit(127);
+    }
+    
+    close(pipeDescriptors[1]);
+    output.clear();
+    char buffer[64 * 1024];
+    ssize_t count;
+    while ((count = read(pipeDescriptors[0], buffer, sizeof(buffer))) != 0)
+    {
+        if (count > 0)
+        {
+            output.append(buffer, count);
+        }
+        else if (errno != EINTR)
+        {
+            break;
+        }
+    }
+    close(pipeDescriptors[0]);
+    
+    int status = 0;
+    while (waitpid(child, &status, 0) < 0 && errno == EINTR)
+    {
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        errorMessage = !WIFEXITED(status) ? string("git was stopped")
+                       : (WEXITSTATUS(status) == 127) ? string("cannot run git")
+                       : "git exited with status " + to_string(WEXITSTATUS(status));
+        return false;
+    }
+    return true;
+} // RunGit
+
+
+
+/*
+ * UnquoteGitPath
+ * This function undoes the C-style quoting git puts around a path with
+ * unusual characters in it.
+ * Input: text [IN] - the path as git printed it
+ * Return: string - returns the path itself. No side effects.
+ */
+string UnquoteGitPath(string_view text)
+{
+    if (text.length() < 2 || text.front() != '"' || text.back() != '"')
+    {
+        return string(text);
+    }
+    string path;
+    for (size_t i = 1; i + 1 < text.length(); i++)
+    {
+        char c = text[i];
+        if (c != '\\' || i + 2 >= text.length())
+        {
+            path += c;
+            continue;
+        }
+        c = text[++i];
+        if (c >= '0' && c <= '7')
+        {
+            // Three octal digits, one byte
+            int value = 0;
+            for (int digit = 0; digit < 3 && i < text.length() - 1 && text[i] >= '0' && text[i] <= '7'; digit++)
+            {
+                value = value * 8 + (text[i++] - '0');
+            }
+            i--;
+            path += (char)value;
+        }
+        else
+        {
+            path += (c == 'n') ? '\n' : (c == 't') ? '\t' : (c == 'a') ? '\a' : (c == 'b') ? '\b' :
+                    (c == 'f') ? '\f' : (c == 'r') ? '\r' : (c == 'v') ? '\v' : c;
+        }
+    }
+    return path;
+} // UnquoteGitPath
+
+
+
+/*
+ * ParseChangedLines
+ * This function reads a "git diff --unified=0" of the working tree and
+ * notes, for each source file, the lines of the new version that a
+ * hunk touches. A hunk that only removes lines touches the lines on
+ * both sides of the gap.
+ * Input: diffText [IN] - git's output
+ *        topLevel [IN] - top folder of the repository
+ *        changedFiles [OUT] - receives the files by CacheKeyPath
+ * Return: void - no return value. No side effects.
+ */
+void ParseChangedLines(string_view diffText, const string& topLevel, map<string, ChangedFile>& changedFiles)
+{
+    ChangedFile* current = nullptr;
+    bool inHeader = false;
+    bool added = false;
+    size_t position = 0;
+    while (position < diffText.length())
+    {
+        size_t lineEnd = diffText.find('\n', position);
+        if (lineEnd == string_view::npos)
+        {
+            lineEnd = diffText.length();
+        }
+        string_view line = diffText.substr(position, lineEnd - position);
+        position = lineEnd + 1;
+        
+        // Hunk lines start with + - or space, so this is never one
+        if (line.compare(0, 11, "diff --git ") == 0)
+        {
+            current = nullptr;
+            inHeader = true;
+            added = false;
+        }
+        else if (inHeader && line.compare(0, 13, "new file mode") == 0)
+        {
+            added = true;
+        }
+        else if (inHeader && line.compare(0, 4, "+++ ") == 0)
+        {
+            string path = UnquoteGitPath(line.substr(4));
+            if (path.compare(0, 2, "b/") == 0 &&
+                IsSourceFileName(filesystem::path(path).filename().string()))
+            {
+                current = &changedFiles[CacheKeyPath(topLevel + "/" + path.substr(2))];
+                current->added = added;
+            }
+        }
+        else if (line.compare(0, 3, "@@ ") == 0)
+        {
+            inHeader = false;
+            size_t plus = line.find(" +");
+            if (current == nullptr || plus == string_view::npos)
+            {
+                continue;
+            }
+            string numbers(line.substr(plus + 2, line.find(' ', plus + 2) - plus - 2));
+            char* end = nullptr;
+            size_t firstLine = strtoul(numbers.c_str(), &end, 10);
+            size_t lineCount = (*end == ',') ? strtoul(end + 1, nullptr, 10) : 1;
+            if (lineCount == 0)
+            {
+                current->ranges.push_back(LineRange{(firstLine > 0) ? firstLine - 1 : 0, firstLine});
+            }
+            else
+            {
+                current->ranges.push_back(LineRange{firstLine - 1, firstLine + lineCount - 2});
+            }
+        }
+    }
+} // ParseChangedLines
+
+
+
+/*
+ * CollectChangedFiles
+ * This function asks git which source files in the working tree differ
+ * from a revision, and which of their lines. Only the diff is read, so
+ * the work grows with the change, not with the repository. Files that
+ * were deleted, only renamed or only changed mode are left out, as are
+ * files git does not track.
+ * Input: revision [IN] - what to compare with, e.g. HEAD or origin/main
+ *        pathspecs [IN] - limit to these files, folders or patterns;
+ *                         empty for the whole repository
+ *        files [OUT] - receives the changed files, sorted
+ *        changedFiles [OUT] - receives their changed lines
+ *        errors [OUT] - receives a message if git fails
+ * Return: void - no return value. Side effect: runs git.
+ */
+void CollectChangedFiles(const string& revision, const vector<string>& pathspecs, vector<string>& files,
+                         map<string, ChangedFile>& changedFiles, vector<string>& errors)
+{
+    string topLevel;
+    string errorMessage;
+    if (!RunGit({"rev-parse", "--show-toplevel"}, topLevel, errorMessage))
+    {
+        errors.push_back("Cannot find the git repository: " + errorMessage);
+        return;
+    }
+    while (!topLevel.empty() && (topLevel.back() == '\n' || topLevel.back() == '\r'))
+    {
+        topLevel.pop_back();
+    }
+    
+    // Fix every setting that changes the output format
+    vector<string> arguments = {
+        "-c", "core.quotePath=false", "diff", "--no-color", "--no-ext-diff", "--no-textconv",
+        "--no-relative", "--src-prefix=a/", "--dst-prefix=b/", "-M", "--unified=0",
+        "--end-of-options", revision, "--"
+    };
+    arguments.insert(arguments.end(), pathspecs.begin(), pathspecs.end());
+    string diffText;
+    if (!RunGit(arguments, diffText, errorMessage))
+    {
+        errors.push_back("Cannot compare with " + revision + ": " + errorMessage);
+        return;
+    }
+    ParseChangedLines(diffText, topLevel, changedFiles);
+    
+    error_code errorCode;
+    filesystem::path currentFolder = filesystem::current_path(errorCode);
+    for (auto changed = changedFiles.begin(); changed != changedFiles.end(); )
+    {
+        if (changed->second.ranges.empty())
+        {
+            changed = changedFiles.erase(changed);
+            continue;
+        }
+        files.push_back(filesystem::path(changed->first).lexically_proximate(currentFolder).string());
+        ++changed;
+    }
+    sort(files.begin(), files.end());
+} // CollectChangedFiles
+
+
+
+/*
+ * Server protocol
+ * With --serve the program listens on a Unix socket. A client sends
+ * requests on one connection, one after another; each is a line of
+ * text, then the bytes it announces:
+ *     ANNOTATE <specLength> <sourceLength> <path>\n<spec><source>
+ *     PING\n
+ * A spec of length 0 means the server's own (--batch SPEC, or the
+ * built-in defaults). The path is used for the file header and the
+ * cache, so it should be absolute. The answer is
+ *     OK <changeCount> <bodyLength>\n<body>
+ * where the body is changeCount changes in line order, each
+ *     <firstLine> <removedCount> <textLength>\n<text>
+ * meaning: replace removedCount lines from 0-based firstLine with text,
+ * all counted in the source as sent. PING gets "OK 0 0". A request
+ * that cannot be served gets "ERROR <reason>\n"; after a malformed
+ * request line the server also closes the connection.
+ * One thread polls the socket and every idle connection; a connection
+ * goes to the worker pool only once a whole request has arrived, so
+ * clients that keep a connection open hold no worker while idle.
+ */
+
+// Longest request line, and the largest spec or source, the server takes
+const size_t SERVE_MAX_LINE = 4096;
+const size_t SERVE_MAX_BODY = (size_t)1 << 30;
+
+// A connection idle this long is closed, and a client that reads no
+// answer for this long is dropped, so neither holds memory or a worker
+const int SERVE_IDLE_SECONDS = 30;
+
+// Parsed request specs kept; the cache starts over when it is full
+const size_t SERVE_SPEC_CACHE_SIZE = 64;
+
+// Smallest connection buffer, and fewest threads when -j is not given
+const size_t SERVE_READ_SIZE = 64 * 1024;
+const int SERVE_MIN_THREADS = 4;
+
+/*
+ * ServeConnection
+ * One client connection, with what was read from it but not used yet.
+ * Between requests the dispatcher owns it; while its requests are
+ * answered, one worker does.
+ */
+struct ServeConnection
+{
+    int descriptor = -1;
+    vector<char> buffer;
+    size_t start = 0;             // first byte not used yet
+    size_t end = 0;               // one past the last byte read
+    chrono::steady_clock::time_point lastActive;   // when bytes last came in
+};
+
+
+
+/*
+ * ServeRequest
+ * The next request of a connection, as its request line gives it.
+ */
+struct ServeRequest
+{
+    bool valid = false;           // false for a malformed request line
+    bool ping = false;
+    size_t lineLength = 0;        // with the '\n'
+    size_t specLength = 0;
+    size_t sourceLength = 0;
+    string filePath;
+};
+
+
+
+/*
+ * ReceiveConnection
+ * This function reads what a connection has ready, without waiting.
+ * Used bytes are dropped first, and the buffer only grows when it is
+ * full, so a long-lived connection does not grow its buffer.
+ * Input: connection [IN/OUT] - the client connection
+ * Return: bool - returns true if the connection is still open, false if
+ *                the client closed it or it failed.
+ */
+bool ReceiveConnection(ServeConnection& connection)
+{
+    if (connection.start > 0)
+    {
+        memmove(connection.buffer.data(), connection.buffer.data() + connection.start,
+                connection.end - connection.start);
+        connection.end -= connection.start;
+        connection.start = 0;
+    }
+    if (connection.end == connection.buffer.size())
+    {
+        connection.buffer.resize(max(connection.buffer.size() * 2, SERVE_READ_SIZE));
+    }
+    while (true)
+    {
+        ssize_t bytesRead = recv(connection.descriptor, connection.buffer.data() + connection.end,
+                                 connection.buffer.size() - connection.end, MSG_DONTWAIT);
+        if (bytesRead < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            return true;
+        }
+        if (bytesRead <= 0)
+        {
+            return false;
+        }
+        connection.end += (size_t)bytesRead;
+        connection.lastActive = chrono::steady_clock::now();
+        return true;
+    }
+} // ReceiveConnection
+
+
+
+/*
+ * ParseRequest
+ * This function reads the request line at the front of a connection's
+ * buffer and tells whether the whole request has arrived.
+ * Input: connection [IN] - the client connection
+ *        request [OUT] - receives the parsed request line
+ * Return: bool - returns true if the request is complete or its line is
+ *                malformed (request.valid is false), false if more bytes
+ *                are needed. No side effects.
+ */
+bool ParseRequest(const ServeConnection& connection, ServeRequest& request)
+{
+    request = ServeRequest();
+    size_t pendingLength = connection.end - connection.start;
+    if (pendingLength == 0)
+    {
+        return false;
+    }
+    const char* pending = connection.buffer.data() + connection.start;
+    const char* newline = (const char*)memchr(pending, '\n', min(pendingLength, SERVE_MAX_LINE));
+    if (newline == nullptr)
+    {
+        return pendingLength >= SERVE_MAX_LINE;
+    }
+    request.lineLength = newline - pending + 1;
+    string_view line(pending, newline - pending);
+    if (!line.empty() && line.back() == '\r')
+    {
+        line.remove_suffix(1);
+    }
+    if (line == "PING")
+    {
+        request.valid = true;
+        request.ping = true;
+        return true;
+    }
+    
+    // ANNOTATE <specLength> <sourceLength> <path>
+    string header(line);
+    char* cursor = nullptr;
+    bool valid = (header.compare(0, 9, "ANNOTATE ") == 0);
+    request.specLength = valid ? strtoull(header.c_str() + 9, &cursor, 10) : 0;
+    valid = valid && *cursor == ' ';
+    request.sourceLength = valid ? strtoull(cursor + 1, &cursor, 10) : 0;
+    valid = valid && (*cursor == ' ' || *cursor == '\0') &&
+            request.specLength <= SERVE_MAX_BODY && request.sourceLength <= SERVE_MAX_BODY;
+    if (!valid)
+    {
+        return true;
+    }
+    request.valid = true;
+    request.filePath = (*cursor == ' ') ? string(TrimWhitespace(cursor + 1)) : string();
+    if (request.filePath.empty())
+    {
+        request.filePath = "buffer";
+    }
+    return pendingLength - request.lineLength >= request.specLength + request.sourceLength;
+} // ParseRequest
+
+
+
+/*
+ * SendAll
+ * This function writes all of a buffer to a connection. A client that
+ * went away does not raise SIGPIPE.
+ * Input: descriptor [IN] - the client connection
+ *        data [IN] - bytes to send
+ *        length [IN] - number of bytes
+ * Return: bool - returns true if everything was sent, false otherwise.
+ */
+bool SendAll(int descriptor, const char* data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t sent = send(descriptor, data, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (sent <= 0)
+        {
+            return false;
+        }
+        data += sent;
+        length -= (size_t)sent;
+    }
+    return true;
+} // SendAll
+
+
+
+/*
+ * CSpecCache
+ * The specs clients have sent, parsed once and kept by their text, so
+ * an editor that sends the same answers with every save does not pay
+ * for parsing them again. Shared by all server threads.
+ */
+class CSpecCache
+{
+public:
+    shared_ptr<const AnnotationSpec> Find(string_view specText, string& errorMessage);
+    
+private:
+    struct Entry
+    {
+        string text;
+        shared_ptr<const AnnotationSpec> spec;
+    };
+    
+    map<uint64_t, Entry> m_entries;
+    mutex m_lock;
+};
+
+
+
+/*
+ * CSpecCache::Find
+ * This function gives the parsed form of a spec, parsing it the first
+ * time it is seen.
+ * Input: specText [IN] - the spec as sent
+ *        errorMessage [OUT] - receives the parse error, if any
+ * Return: shared_ptr<const AnnotationSpec> - returns the spec, or
+ *         nullptr if it does not parse. Side effect: caches the spec.
+ */
+shared_ptr<const AnnotationSpec> CSpecCache::Find(string_view specText, string& errorMessage)
+{
+    uint64_t textHash = HashBytes(specText.data(), specText.length());
+    {
+        lock_guard<mutex> guard(m_lock);
+        map<uint64_t, Entry>::const_iterator found = m_entries.find(textHash);
+        if (found != m_entries.end() && found->second.text == specText)
+        {
+            return found->second.spec;
+        }
+    }
+    
+    // Parse outside the lock; two threads may both parse a new spec
+    istringstream specStream{string(specText)};
+    shared_ptr<AnnotationSpec> spec = make_shared<AnnotationSpec>();
+    if (!ParseAnnotationSpec(specStream, "spec", *spec, errorMessage))
+    {
+        return nullptr;
+    }
+    lock_guard<mutex> guard(m_lock);
+    if (m_entries.size() >= SERVE_SPEC_CACHE_SIZE)
+    {
+        m_entries.clear();
+    }
+    m_entries[textHash] = Entry{string(specText), spec};
+    return spec;
+} // CSpecCache::Find
+
+
+
+/*
+ * ServeContext
+ * What every server thread shares: the default answers, the warm caches
+ * and the queues connections take between the dispatcher and workers.
+ */
+struct ServeContext
+{
+    shared_ptr<const AnnotationSpec> defaultSpec;
+    CAnnotationCache* cache = nullptr;   // only read: spec answers never store
+    CSpecCache specs;
+    mutex queueLock;
+    condition_variable requestReady;
+    deque<unique_ptr<ServeConnection>> ready;       // a whole request is in
+    vector<unique_ptr<ServeConnection>> finished;   // answered, back to the dispatcher
+    int wakeDescriptors[2] = {-1, -1};              // a pipe that wakes the dispatcher
+    atomic<bool> stopping{false};
+};
+
+
+
+/*
+ * AppendChanges
+ * This function adds changes to a response body, in the form the server
+ * protocol gives. A change that would put back the same text, as reuse
+ * from the cache can make, is left out.
+ * Input: document [IN] - the annotated document
+ *        changes [IN] - its changes
+ *        body [IN/OUT] - the response body
+ * Return: size_t - returns the number of changes added. No side effects.
+ */
+size_t AppendChanges(const SourceDocument& document, const vector<DiffChange>& changes, string& body)
+{
+    size_t changeCount = 0;
+    for (const DiffChange& change : changes)
+    {
+        if (change.removedCount > 0)
+        {
+            size_t removedStart = document.lines[change.firstLine].start;
+            size_t removedEnd = (change.firstLine + change.removedCount < document.lines.size())
+                                ? document.lines[change.firstLine + change.removedCount].start
+                                : document.sourceLength;
+            if (string_view(document.source + removedStart, removedEnd - removedStart) == change.added)
+            {
+                continue;
+            }
+        }
+        body += to_string(change.firstLine);
+        body += ' ';
+        body += to_string(change.removedCount);
+        body += ' ';
+        body += to_string(change.added.length());
+        body += '\n';
+        body += change.added;
+        changeCount++;
+    }
+    return changeCount;
+} // AppendChanges
+
+
+
+/*
+ * ServeRequests
+ * This function answers every request that has fully arrived on a
+ * connection, in order.
+ * Input: connection [IN/OUT] - the client connection
+ *        context [IN/OUT] - what the server threads share
+ * Return: bool - returns true if the connection stays open, false if the
+ *                client went away or sent a malformed request.
+ *                Side effect: sends the responses.
+ */
+bool ServeRequests(ServeConnection& connection, ServeContext& context)
+{
+    int descriptor = connection.descriptor;
+    string body;
+    string response;
+    vector<DiffChange> changes;
+    
+    ServeRequest request;
+    while (!context.stopping && ParseRequest(connection, request))
+    {
+        if (!request.valid)
+        {
+            const char error[] = "ERROR malformed request\n";
+            SendAll(descriptor, error, sizeof(error) - 1);
+            return false;
+        }
+        connection.start += request.lineLength;
+        if (request.ping)
+        {
+            if (!SendAll(descriptor, "OK 0 0\n", 7))
+            {
+                return false;
+            }
+            continue;
+        }
+        
+        const char* specText = connection.buffer.data() + connection.start;
+        const char* source = specText + request.specLength;
+        connection.start += request.specLength + request.sourceLength;
+        
+        TRACE_SPAN("request", request.filePath);
+        COUNT_STAT(STAT_FILES, 1);
+        string errorMessage;
+        shared_ptr<const AnnotationSpec> spec = (request.specLength == 0) ? context.defaultSpec
+                                                : context.specs.Find(string_view(specText, request.specLength),
+                                                                     errorMessage);
+        if (spec == nullptr)
+        {
+            response = "ERROR " + errorMessage + "\n";
+            if (!SendAll(descriptor, response.data(), response.length()))
+            {
+                return false;
+            }
+            continue;
+        }
+        
+        AnnotationSession session;
+        session.spec = spec.get();
+        session.cacheSeed = spec->fingerprint;
+        session.cache = context.cache;
+        g_documentArena.Reset();
+        SourceDocument document(g_documentArena, source, request.sourceLength);
+        changes.clear();
+        CollectAnnotationChanges(document, session, request.filePath, changes);
+        
+        body.clear();
+        size_t changeCount = AppendChanges(document, changes, body);
+        RecordDocumentMemory(g_documentArena);
+        response = "OK " + to_string(changeCount) + " " + to_string(body.length()) + "\n";
+        response += body;
+        if (!SendAll(descriptor, response.data(), response.length()))
+        {
+            return false;
+        }
+    }
+    
+    // An idle connection does not keep the buffer of a large request
+    if (connection.start == connection.end && connection.buffer.size() > SERVE_READ_SIZE)
+    {
+        vector<char>().swap(connection.buffer);
+        connection.start = 0;
+        connection.end = 0;
+    }
+    return true;
+} // ServeRequests
+
+
+
+/*
+ * ServeWorker
+ * This function is one thread of the server pool: it takes connections
+ * whose requests have arrived, answers them and hands the connections
+ * back to the dispatcher, until the server stops.
+ * Input: context [IN/OUT] - what the server threads share
+ * Return: void - no return value. Side effect: serves clients.
+ */
+void ServeWorker(ServeContext& context)
+{
+    while (true)
+    {
+        unique_ptr<ServeConnection> connection;
+        {
+            unique_lock<mutex> guard(context.queueLock);
+            context.requestReady.wait(guard, [&]() { return context.stopping || !context.ready.empty(); });
+            if (context.stopping)
+            {
+                return;
+            }
+            connection = std::move(context.ready.front());
+            context.ready.pop_front();
+        }
+        
+        if (!ServeRequests(*connection, context))
+        {
+            close(connection->descriptor);
+            continue;
+        }
+        {
+            lock_guard<mutex> guard(context.queueLock);
+            context.finished.push_back(std::move(connection));
+        }
+        char wake = 0;
+        if (write(context.wakeDescriptors[1], &wake, 1) < 0)
+        {
+            // The pipe is full, so the dispatcher is woken already
+        }
+    }
+} // ServeWorker
+
+
+
+/*
+ * ServeDispatcher
+ * This function is the server's one waiting thread. It polls the
+ * listening socket and every idle connection, reads what arrives, and
+ * queues a connection for the workers once a whole request is in.
+ * Connections idle too long are closed.
+ * Input: listenDescriptor [IN] - the listening socket, non-blocking
+ *        context [IN/OUT] - what the server threads share
+ * Return: void - no return value. Side effects: accepts and closes
+ *               connections.
+ */
+void ServeDispatcher(int listenDescriptor, ServeContext& context)
+{
+    vector<unique_ptr<ServeConnection>> connections;    // idle, owned here
+    vector<unique_ptr<ServeConnection>> readyNow;
+    vector<pollfd> pollDescriptors;
+    while (!context.stopping)
+    {
+        {
+            lock_guard<mutex> guard(context.queueLock);
+            for (unique_ptr<ServeConnection>& connection : context.finished)
+            {
+                connections.push_back(std::move(connection));
+            }
+            context.finished.clear();
+        }
+        
+        pollDescriptors.clear();
+        pollDescriptors.push_back(pollfd{context.wakeDescriptors[0], POLLIN, 0});
+        pollDescriptors.push_back(pollfd{listenDescriptor, POLLIN, 0});
+        for (const unique_ptr<ServeConnection>& connection : connections)
+        {
+            pollDescriptors.push_back(pollfd{connection->descriptor, POLLIN, 0});
+        }
+        if (poll(pollDescriptors.data(), pollDescriptors.size(), 1000) < 0 && errno != EINTR)
+        {
+            break;
+        }
+        if (pollDescriptors[0].revents != 0)
+        {
+            char drain[256];
+            while (read(context.wakeDescriptors[0], drain, sizeof(drain)) > 0)
+            {
+            }
+        }
+        
+        // Read what came in; whole requests go to the workers
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        size_t keptCount = 0;
+        for (size_t i = 0; i < connections.size(); i++)
+        {
+            unique_ptr<ServeConnection>& connection = connections[i];
+            bool open = (pollDescriptors[i + 2].revents != 0)
+                        ? ReceiveConnection(*connection)
+                        : (now - connection->lastActive < chrono::seconds(SERVE_IDLE_SECONDS));
+            ServeRequest request;
+            if (!open)
+            {
+                close(connection->descriptor);
+            }
+            else if (ParseRequest(*connection, request))
+            {
+                readyNow.push_back(std::move(connection));
+            }
+            else
+            {
+                connections[keptCount++] = std::move(connection);
+            }
+        }
+        connections.resize(keptCount);
+        if (!readyNow.empty())
+        {
+            lock_guard<mutex> guard(context.queueLock);
+            for (unique_ptr<ServeConnection>& connection : readyNow)
+            {
+                context.ready.push_back(std::move(connection));
+            }
+            readyNow.clear();
+            context.requestReady.notify_all();
+        }
+        
+        if (pollDescriptors[1].revents != 0)
+        {
+            while (true)
+            {
+                int descriptor = accept4(listenDescriptor, nullptr, nullptr, SOCK_CLOEXEC);
+                if (descriptor < 0)
+                {
+                    if (errno == EINTR || errno == ECONNABORTED)
+                    {
+                        continue;
+                    }
+                    break;
+                }
+                
+                // Sends block, but not forever on a client that stopped reading
+                timeval sendTimeout = {SERVE_IDLE_SECONDS, 0};
+                setsockopt(descriptor, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+                unique_ptr<ServeConnection> connection = make_unique<ServeConnection>();
+                connection->descriptor = descriptor;
+                connection->lastActive = now;
+                connections.push_back(std::move(connection));
+            }
+        }
+    }
+    
+    for (const unique_ptr<ServeConnection>& connection : connections)
+    {
+        close(connection->descriptor);
+    }
+} // ServeDispatcher
+
+
+
+/*
+ * OpenServerSocket
+ * This function creates the listening Unix socket. A socket file left
+ * by a server that is gone is replaced; one a server still answers on,
+ * or a file that is not a socket, is an error. Only the owner may
+ * connect.
+ * Input: socketPath [IN] - where to create the socket
+ *        errorMessage [OUT] - receives the reason when it fails
+ * Return: int - returns the listening descriptor, or -1 on failure.
+ */
+int OpenServerSocket(const string& socketPath, string& errorMessage)
+{
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socketPath.length() >= sizeof(address.sun_path))
+    {
+        errorMessage = "Socket path too long: " + socketPath;
+        return -1;
+    }
+    memcpy(address.sun_path, socketPath.c_str(), socketPath.length() + 1);
+    
+    struct stat fileInfo;
+    if (lstat(socketPath.c_str(), &fileInfo) == 0)
+    {
+        int probe = S_ISSOCK(fileInfo.st_mode) ? socket(AF_UNIX, SOCK_STREAM, 0) : -1;
+        bool inUse = !S_ISSOCK(fileInfo.st_mode) ||
+                     (probe >= 0 && connect(probe, (const sockaddr*)&address, sizeof(address)) == 0);
+        if (probe >= 0)
+        {
+            close(probe);
+        }
+        if (inUse)
+        {
+            errorMessage = S_ISSOCK(fileInfo.st_mode) ? "A server is already running on " + socketPath
+                                                      : socketPath + " exists and is not a socket";
+            return -1;
+        }
+        unlink(socketPath.c_str());
+    }
+    
+    int listenDescriptor = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenDescriptor < 0)
+    {
+        errorMessage = string("Cannot create socket: ") + strerror(errno);
+        return -1;
+    }
+    mode_t oldMask = umask(0077);
+    bool bound = (bind(listenDescriptor, (const sockaddr*)&address, sizeof(address)) == 0);
+    umask(oldMask);
+    if (!bound || listen(listenDescriptor, SOMAXCONN) != 0)
+    {
+        errorMessage = "Cannot listen on " + socketPath + ": " + strerror(errno);
+        close(listenDescriptor);
+        return -1;
+    }
+    return listenDescriptor;
+} // OpenServerSocket
+
+
+
+/*
+ * ProgramOptions
+ * Settings taken from the command line. With no arguments the program
+ * runs the interactive flow.
+ */
+struct ProgramOptions
+{
+    bool showHelp = false;
+    string specPath;              // --batch SPEC
+    string outputPath;            // -o OUTPUT
+    int threadCount = 0;          // -j N, 0 means one per core
+    bool useCache = true;         // --no-cache turns it off
+    string cachePath = ".commentgen_cache";   // --cache FILE
+    ReusePolicy reusePolicy = REUSE_CONFIRM;  // --reuse always|confirm|never
+    bool filterMode = false;      // --filter, stdin to stdout
+    string filterName = "stdin";  // --name NAME, file name in the header
+    string diffPath;              // --diff FILE, "-" for stdout
+    bool inPlace = false;         // --in-place, replace the sources
+    bool showStats = false;       // --stats
+    string tracePath;             // --trace FILE
+    bool runBenchmark = false;    // --bench
+    int benchMegabytes = 64;      // --bench-size MB, the large corpus
+    string benchBaseline;         // --bench-baseline FILE
+    string benchSave;             // --bench-save FILE
+    int benchTolerance = 15;      // --bench-tolerance PCT
+    bool outlineMode = false;     // --outline, build the outline index
+    string queryText;             // --query WHAT, answer from the index
+    string indexPath = ".commentgen_index";   // --index FILE
+    string servePath;             // --serve SOCKET, run as a server
+    string projectPath;           // --project FILE, compile_commands.json
+    string changedRevision;       // --changed REV, only what differs from REV
+    vector<string> inputPaths;    // files, directories or glob patterns
+};
+
+
+
+/*
+ * ParseCommandLine
+ * This function reads command line arguments into ProgramOptions.
+ * Input: argc [IN] - number of arguments
+ *        argv [IN] - the argument strings
+ *        options [OUT] - receives the parsed settings
+ * Return: bool - returns true if the arguments are valid, false
+ *                otherwise. Side effect: prints errors.
+ */
+bool ParseCommandLine(int argc, char* argv[], ProgramOptions& options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        string argument = argv[i];
+        if (argument == "-h" || argument == "--help")
+        {
+            options.showHelp = true;
+        }
+        else if (argument == "--no-cache")
+        {
+            options.useCache = false;
+        }
+        else if (argument == "--bench")
+        {
+            options.runBenchmark = true;
+        }
+        else if (argument == "--filter")
+        {
+            options.filterMode = true;
+        }
+        else if (argument == "--in-place")
+        {
+            options.inPlace = true;
+        }
+        else if (argument == "--outline")
+        {
+            options.outlineMode = true;
+        }
+        else if (argument == "--stats")
+        {
+            options.showStats = true;
+        }
+        else if (argument == "--batch" || argument == "-o" || argument == "-j" ||
+                 argument == "--cache" || argument == "--reuse" || argument == "--trace" ||
+                 argument == "--name" || argument == "--bench-size" || argument == "--bench-baseline" ||
+                 argument == "--bench-save" || argument == "--bench-tolerance" ||
+                 argument == "--query" || argument == "--index" || argument == "--diff" ||
+                 argument == "--serve" || argument == "--project" || argument == "--changed")
+        {
+            if (i + 1 >= argc)
+            {
+                cout << "Error: " << argument << " needs a value" << endl;
+                return false;
+            }
+            string value = argv[++i];
+            if (argument == "--batch")
+            {
+                options.specPath = value;
+            }
+            else if (argument == "-o")
+            {
+                options.outputPath = value;
+            }
+            else if (argument == "--cache")
+            {
+                options.cachePath = value;
+            }
+            else if (argument == "--name")
+            {
+                options.filterName = value;
+            }
+            else if (argument == "--trace")
+            {
+                options.tracePath = value;
+            }
+            else if (argument == "--diff")
+            {
+                options.diffPath = value;
+            }
+            else if (argument == "--query")
+            {
+                options.queryText = value;
+            }
+            else if (argument == "--index")
+            {
+                options.indexPath = value;
+            }
+            else if (argument == "--serve")
+            {
+                options.servePath = value;
+            }
+            else if (argument == "--project")
+            {
+                options.projectPath = ExpandPath(value);
+            }
+            else if (argument == "--changed")
+            {
+                options.changedRevision = value;
+            }
+            else if (argument == "--bench-baseline")
+            {
+                options.benchBaseline = value;
+            }
+            else if (argument == "--bench-save")
+            {
+                options.benchSave = value;
+            }
+            else if (argument == "--bench-size" || argument == "--bench-tolerance")
+            {
+                int number = atoi(value.c_str());
+                if (number < 1)
+                {
+                    cout << "Error: " << argument << " needs a positive number" << endl;
+                    return false;
+                }
+                int& target = (argument == "--bench-size") ? options.benchMegabytes : options.benchTolerance;
+                target = number;
+            }
+            else if (argument == "--reuse")
+            {
+                if (value == "always") options.reusePolicy = REUSE_ALWAYS;
+                else if (value == "confirm") options.reusePolicy = REUSE_CONFIRM;
+                else if (value == "never") options.reusePolicy = REUSE_NEVER;
+                else
+                {
+                    cout << "Error: --reuse needs always, confirm or never" << endl;
+                    return false;
+                }
+            }
+            else
+            {
+                options.threadCount = atoi(value.c_str());
+                if (options.threadCount < 1)
+                {
+                    cout << "Error: -j needs a positive number" << endl;
+                    return false;
+                }
+            }
+        }
+        else if (argument.length() > 1 && argument[0] == '-')
+        {
+            cout << "Error: unknown option " << argument << endl;
+            return false;
+        }
+        else
+        {
+            options.inputPaths.push_back(ExpandPath(argument));
+        }
+    }
+    
+    if (options.filterMode && (!options.inputPaths.empty() || !options.outputPath.empty()))
+    {
+        cout << "Error: --filter reads stdin and writes stdout, without paths" << endl;
+        return false;
+    }
+    if (!options.diffPath.empty() && (options.specPath.empty() || options.filterMode))
+    {
+        cout << "Error: --diff needs --batch SPEC and input files" << endl;
+        return false;
+    }
+    if (!options.diffPath.empty() && !options.outputPath.empty())
+    {
+        cout << "Error: --diff and -o cannot be used together" << endl;
+        return false;
+    }
+    if (options.inPlace && (options.specPath.empty() || options.filterMode ||
+                            !options.outputPath.empty() || !options.diffPath.empty()))
+    {
+        cout << "Error: --in-place needs --batch SPEC, without -o or --diff" << endl;
+        return false;
+    }
+    if (!options.servePath.empty() &&
+        (options.filterMode || options.outlineMode || options.inPlace || !options.queryText.empty() ||
+         !options.diffPath.empty() || !options.outputPath.empty() || !options.inputPaths.empty()))
+    {
+        cout << "Error: --serve takes its input from requests, without paths or other modes" << endl;
+        return false;
+    }
+    if (!options.projectPath.empty() && ((options.specPath.empty() && !options.outlineMode) ||
+                                         options.filterMode || !options.servePath.empty()))
+    {
+        cout << "Error: --project needs --batch SPEC or --outline" << endl;
+        return false;
+    }
+    if (!options.changedRevision.empty() && (options.specPath.empty() || options.filterMode ||
+                                             options.outlineMode || !options.servePath.empty() ||
+                                             !options.projectPath.empty()))
+    {
+        cout << "Error: --changed needs --batch SPEC, without --project" << endl;
+        return false;
+    }
+    if (!options.queryText.empty() && (options.outlineMode || !options.inputPaths.empty()))
+    {
+        cout << "Error: --query reads only the index, without paths" << endl;
+        return false;
+    }
+    if (!options.showHelp && !options.filterMode && !options.outlineMode && options.specPath.empty() &&
+        !options.inputPaths.empty())
+    {
+        cout << "Error: input files need --batch SPEC" << endl;
+        return false;
+    }
+    return true;
+} // ParseCommandLine
+
+
+
+/*
+ * PrintUsage
+ * This function prints the command line help.
+ * Input: programName [IN] - name the program was run as
+ * Return: void - no return value. Side effect: prints to the screen.
+ */
+void PrintUsage(const string& programName)
+{
+    cout << "Usage: " << programName << "                       interactive mode" << endl;
+    cout << "       " << programName << " --batch SPEC PATH...  annotate files from a spec" << endl;
+    cout << "       " << programName << " --filter [--batch SPEC] annotate stdin to stdout" << endl;
+    cout << "       " << programName << " --batch SPEC --project FILE  annotate a whole project" << endl;
+    cout << "       " << programName << " --outline PATH...     build the outline index" << endl;
+    cout << "       " << programName << " --query WHAT          look up functions in the index" << endl;
+    cout << "       " << programName << " --serve SOCKET        answer annotate requests on a Unix socket" << endl;
+    cout << "       " << programName << " --bench               measure throughput" << endl;
+    cout << endl;
+    cout << "PATH may be a file, a directory (searched recursively) or a quoted glob." << endl;
+    cout << endl;
+    cout << "Options:" << endl;
+    cout << "  --batch SPEC   answer every prompt from SPEC instead of the keyboard" << endl;
+    cout << "  -o OUTPUT      output file (one input only; default commented_<name>)" << endl;
+    cout << "  -j N           annotate N files at once (default: one per core)" << endl;
+    cout << "  --filter       stream stdin to stdout with SPEC answers (default: none);" << endl;
+    cout << "                 messages go to stderr" << endl;
+    cout << "  --name NAME    file name for the --filter header (default: stdin)" << endl;
+    cout << "  --project FILE with --batch or --outline, also take every file compiled in" << endl;
+    cout << "                 compile_commands.json (FILE or the folder holding it) and" << endl;
+    cout << "                 the project headers they include, each once" << endl;
+    cout << "  --changed REV  with --batch, only annotate functions whose lines differ between" << endl;
+    cout << "                 the working tree and git revision REV; PATHs narrow the search." << endl;
+    cout << "                 Only new files get a file header; no cache" << endl;
+    cout << "  --in-place     with --batch, replace each source with its commented version" << endl;
+    cout << "  --diff FILE    with --batch, write one unified diff of all changes to FILE" << endl;
+    cout << "                 (- for stdout) instead of commented_ copies; no cache" << endl;
+    cout << "  --cache FILE   reuse comments of unchanged functions from FILE" << endl;
+    cout << "                 (default: .commentgen_cache)" << endl;
+    cout << "  --no-cache     annotate every function from scratch" << endl;
+    cout << "  --reuse WHEN   earlier answers for the same statement: always use them," << endl;
+    cout << "                 confirm them with Enter (default), or never" << endl;
+    cout << "  --index FILE   outline index for --outline and --query" << endl;
+    cout << "                 (default: .commentgen_index)" << endl;
+    cout << "  --query WHAT   undocumented, documented, all, or a function name" << endl;
+    cout << "                 (Print or CList::Print)" << endl;
+    cout << "  --serve SOCKET keep running and annotate buffers sent to SOCKET; --batch SPEC" << endl;
+    cout << "                 gives the default answers, -j the threads (default: one per" << endl;
+    cout << "                 core, at least 4); stops on SIGINT or SIGTERM" << endl;
+    cout << "  --stats        print a one-line summary of counters and timings" << endl;
+    cout << "  --trace FILE   save per-stage timings as Chrome trace-event JSON" << endl;
+    cout << "  --bench-size MB        size of the large benchmark corpus (default 64)" << endl;
+    cout << "  --bench-baseline FILE  fail if a stage is slower than FILE says" << endl;
+    cout << "  --bench-save FILE      save the results as a new baseline" << endl;
+    cout << "  --bench-tolerance PCT  allowed slowdown against the baseline (default 15)" << endl;
+    cout << "  -h, --help     show this help" << endl;
+} // PrintUsage
+
+
+
+/*
+ * RunBatchMode
+ * This function annotates every input file from a spec, with no prompts.
+ * Files are spread over a work-stealing pool; results are reported in
+ * sorted path order, and a file that fails does not stop the others.
+ * With --diff the changes to all files go into one unified diff; with
+ * --in-place each source is replaced once all of them are written.
+ * With --changed the inputs are the files git reports as changed, and
+ * only their changed functions are annotated.
+ * Input: options [IN] - parsed command line settings
+ * Return: int - returns 0 if every file was annotated, 1 otherwise.
+ *               Side effects: writes output files, prints a summary.
+ */
+int RunBatchMode(const ProgramOptions& options)
+{
+    AnnotationSpec spec;
+    if (!LoadAnnotationSpec(ExpandPath(options.specPath), spec))
+    {
+        return 1;
+    }
+    
+    CAnnotationCache cache;
+    AnnotationSession session;
+    session.spec = &spec;
+    session.cacheSeed = spec.fingerprint;
+    bool useCache = options.useCache && options.diffPath.empty() && options.changedRevision.empty();
+    if (useCache)
+    {
+        TRACE_SPAN("load cache");
+        cache.Load(ExpandPath(options.cachePath));
+        session.cache = &cache;
+    }
+    
+    vector<string> inputPaths;
+    vector<string> inputErrors;
+    map<string, ChangedFile> changedFiles;
+    {
+        TRACE_SPAN("collect inputs");
+        if (!options.changedRevision.empty())
+        {
+            CollectChangedFiles(options.changedRevision, options.inputPaths, inputPaths, changedFiles, inputErrors);
+            session.changedFiles = &changedFiles;
+        }
+        else
+        {
+            CollectInputFiles(options.inputPaths, inputPaths, inputErrors);
+        }
+        if (!options.projectPath.empty())
+        {
+            CollectProjectFiles(options.projectPath, inputPaths, inputErrors);
+        }
+    }
+    for (const string& inputError : inputErrors)
+    {
+        cout << "Error: " << inputError << endl;
+    }
+    
+    // Nothing changed is a normal outcome for a --changed run
+    if (!options.changedRevision.empty() && inputPaths.empty() && inputErrors.empty())
+    {
+        cout << "No source files changed since " << options.changedRevision << endl;
+        return 0;
+    }
+    
+    string outputPath = options.outputPath.empty() ? spec.outputFile : options.outputPath;
+    if (inputPaths.empty())
+    {
+        cout << "Error: no input files given" << endl;
+        return 1;
+    }
+    if (!outputPath.empty() && inputPaths.size() > 1)
+    {
+        cout << "Error: an output name only works with one input file" << endl;
+        return 1;
+    }
+    
+    // Two inputs writing one output would interleave in it, and an
+    // output that is another input would be cut short while it is read
+    if (options.diffPath.empty() && !options.inPlace && outputPath.empty())
+    {
+        map<string, string> inputKeys;
+        for (const string& inputPath : inputPaths)
+        {
+            error_code errorCode;
+            inputKeys[filesystem::weakly_canonical(inputPath, errorCode).string()] = inputPath;
+        }
+        map<string, string> outputOwners;
+        for (const string& inputPath : inputPaths)
+        {
+            error_code errorCode;
+            string outputKey = filesystem::weakly_canonical(DefaultOutputPath(inputPath), errorCode).string();
+            auto owner = outputOwners.emplace(outputKey, inputPath);
+            if (!owner.second)
+            {
+                cout << "Error: " << owner.first->second << " and " << inputPath
+                     << " would both be written to " << DefaultOutputPath(inputPath) << endl;
+                return 1;
+            }
+            if (inputKeys.count(outputKey) != 0)
+            {
+                cout << "Error: " << inputPath << " would be written over the input "
+                     << inputKeys[outputKey] << endl;
+                return 1;
+            }
+        }
+    }
+    
+    // Two spellings of one file must not both rewrite it
+    if (options.inPlace)
+    {
+        map<string, bool> targetPaths;
+        size_t keptCount = 0;
+        for (size_t i = 0; i < inputPaths.size(); i++)
+        {
+            error_code errorCode;
+            filesystem::path targetPath = filesystem::canonical(inputPaths[i], errorCode);
+            if (targetPaths.emplace(errorCode ? inputPaths[i] : targetPath.string(), true).second)
+            {
+                inputPaths[keptCount++] = inputPaths[i];
+            }
+        }
+        inputPaths.resize(keptCount);
+    }
+    
+    // Annotate in parallel, keeping each file's result in its own slot
+    vector<string> outputPaths(inputPaths.size());
+    vector<string> errorMessages(inputPaths.size());
+    vector<char> succeeded(inputPaths.size(), 0);
+    vector<string> patches(options.diffPath.empty() ? 0 : inputPaths.size());
+    vector<InPlaceTarget> targets(options.inPlace ? inputPaths.size() : 0);
+    
+    int threadCount = options.threadCount;
+    if (threadCount == 0)
+    {
+        threadCount = (int)thread::hardware_concurrency();
+    }
+    
+    // Threads beyond one per file go to cutting up large files
+    session.splitThreads = max(1, threadCount / (int)inputPaths.size());
+    if (threadCount > (int)inputPaths.size())
+    {
+        threadCount = (int)inputPaths.size();
+    }
+    
+    // Start the biggest files first, so a large one picked up last does
+    // not keep a single core busy after the others are done
+    vector<size_t> schedule(inputPaths.size());
+    {
+        vector<off_t> fileSizes(inputPaths.size(), 0);
+        for (size_t i = 0; i < inputPaths.size(); i++)
+        {
+            struct stat fileInfo;
+            if (stat(inputPaths[i].c_str(), &fileInfo) == 0)
+            {
+                fileSizes[i] = fileInfo.st_size;
+            }
+            schedule[i] = i;
+        }
+        stable_sort(schedule.begin(), schedule.end(), [&](size_t a, size_t b)
+        {
+            return fileSizes[a] > fileSizes[b];
+        });
+    }
+    
+    CWorkStealingPool pool(threadCount);
+    pool.Run(schedule.size(), [&](size_t slot)
+    {
+        size_t fileIndex = schedule[slot];
+        const string& inputPath = inputPaths[fileIndex];
+        if (!patches.empty())
+        {
+            outputPaths[fileIndex] = options.diffPath;
+            succeeded[fileIndex] = DiffFileFromSpec(session, inputPath, patches[fileIndex],
+                                                    errorMessages[fileIndex]);
+            return;
+        }
+        if (!targets.empty())
+        {
+            InPlaceTarget& target = targets[fileIndex];
+            outputPaths[fileIndex] = inputPath;
+            succeeded[fileIndex] = PrepareInPlaceTarget(inputPath, target, errorMessages[fileIndex]) &&
+                                   AnnotateFileFromSpec(session, inputPath, target.temporaryPath,
+                                                        errorMessages[fileIndex]) &&
+                                   FinishInPlaceTarget(target, errorMessages[fileIndex]);
+            if (!succeeded[fileIndex] && !target.temporaryPath.empty())
+            {
+                remove(target.temporaryPath.c_str());
+            }
+            return;
+        }
+        outputPaths[fileIndex] = outputPath.empty() ? DefaultOutputPath(inputPath)
+                                                    : ExpandPath(outputPath);
+        succeeded[fileIndex] = AnnotateFileFromSpec(session, inputPath, outputPaths[fileIndex],
+                                                    errorMessages[fileIndex]);
+    }, true);
+    
+    if (useCache && !cache.Save(ExpandPath(options.cachePath)))
+    {
+        cout << "Warning: cannot write cache " << options.cachePath << endl;
+    }
+    
+    // Sources are only replaced once every new version is written
+    if (!targets.empty())
+    {
+        vector<size_t> written;
+        vector<InPlaceTarget> writtenTargets;
+        for (size_t i = 0; i < targets.size(); i++)
+        {
+            if (succeeded[i])
+            {
+                written.push_back(i);
+                writtenTargets.push_back(targets[i]);
+            }
+        }
+        vector<string> commitErrors;
+        CommitInPlaceTargets(writtenTargets, commitErrors);
+        for (size_t n = 0; n < written.size(); n++)
+        {
+            if (!commitErrors[n].empty())
+            {
+                succeeded[written[n]] = 0;
+                errorMessages[written[n]] = commitErrors[n];
+            }
+        }
+    }
+    
+    // The diffs go out in input order, as one patch
+    if (!patches.empty())
+    {
+        TRACE_SPAN("write output", options.diffPath);
+        bool toStdout = (options.diffPath == "-");
+        int diffDescriptor = toStdout ? STDOUT_FILENO
+                             : open(ExpandPath(options.diffPath).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (diffDescriptor < 0)
+        {
+            cout << "Error: Cannot create " << options.diffPath << endl;
+            return 1;
+        }
+        COutputWriter diffOutput(diffDescriptor);
+        for (const string& patch : patches)
+        {
+            diffOutput.AddSource(patch.data(), patch.length());
+        }
+        bool written = diffOutput.Flush();
+        if ((!toStdout && close(diffDescriptor) != 0) || !written)
+        {
+            cout << "Error: Cannot write " << options.diffPath << endl;
+            return 1;
+        }
+    }
+    
+    // Report in input order so runs are easy to compare
+    int failedCount = 0;
+    for (size_t i = 0; i < inputPaths.size(); i++)
+    {
+        if (succeeded[i])
+        {
+            cout << inputPaths[i] << " -> " << outputPaths[i] << endl;
+        }
+        else
+        {
+            cout << "Error: " << errorMessages[i] << endl;
+            failedCount++;
+        }
+    }
+    
+    if (failedCount > 0)
+    {
+        cout << failedCount << " of " << inputPaths.size() << " files failed" << endl;
+    }
+#ifdef CG_COUNT_ALLOCATIONS
+    cout << "Heap allocations in AnnotateSource: " << g_annotateAllocations
+         << " for " << g_annotateLines << " lines" << endl;
+#endif
+    return (failedCount > 0 || !inputErrors.empty()) ? 1 : 0;
+} // RunBatchMode
+
+
+
+/*
+ * RunFilterMode
+ * This function annotates source from stdin to stdout, so the generator
+ * can sit in a pipeline. Answers come from the spec, or its defaults
+ * when there is none; nothing is asked and the cache is not used.
+ * Input: options [IN] - parsed command line settings
+ * Return: int - returns 0 if all of stdin was annotated, 1 otherwise.
+ *               Side effect: writes the annotated source to stdout.
+ */
+int RunFilterMode(const ProgramOptions& options)
+{
+    AnnotationSpec spec;
+    if (!options.specPath.empty() && !LoadAnnotationSpec(ExpandPath(options.specPath), spec))
+    {
+        return 1;
+    }
+    
+    AnnotationSession session;
+    session.spec = &spec;
+    COUNT_STAT(STAT_FILES, 1);
+    
+    COutputWriter output(STDOUT_FILENO);
+    auto writeFileHeader = [&](string_view firstChunk)
+    {
+        if (!HasFileHeader(firstChunk.data(), firstChunk.length(), spec.style))
+        {
+            string date = spec.date.empty() ? GetTodaysDate() : spec.date;
+            CreateFileHeader(output, spec.style, options.filterName, date, spec.project, spec.description);
+        }
+    };
+    
+    string errorMessage;
+    if (!AnnotateStream(STDIN_FILENO, output, session, writeFileHeader, errorMessage))
+    {
+        cout << "Error: " << errorMessage << endl;
+        return 1;
+    }
+    return 0;
+} // RunFilterMode
+
+
+
+/*
+ * RunOutlineMode
+ * This function builds the outline index of the input files. Files whose
+ * size and modification time match the old index are taken from it;
+ * the rest are scanned on a work-stealing pool.
+ * Input: options [IN] - parsed command line settings
+ * Return: int - returns 0 if every file was indexed, 1 otherwise.
+ *               Side effects: writes the index, prints a summary.
+ */
+int RunOutlineMode(const ProgramOptions& options)
+{
+    vector<string> inputPaths;
+    vector<string> inputErrors;
+    {
+        TRACE_SPAN("collect inputs");
+        CollectInputFiles(options.inputPaths, inputPaths, inputErrors);
+        if (!options.projectPath.empty())
+        {
+            CollectProjectFiles(options.projectPath, inputPaths, inputErrors);
+        }
+    }
+    for (const string& inputError : inputErrors)
+    {
+        cout << "Error: " << inputError << endl;
+    }
+    if (inputPaths.empty())
+    {
+        cout << "Error: no input files given" << endl;
+        return 1;
+    }
+    
+    string indexPath = ExpandPath(options.indexPath);
+    COutlineIndex oldIndex;
+    string errorMessage;
+    map<string_view, uint32_t> oldFiles;
+    if (oldIndex.Open(indexPath, errorMessage))
+    {
+        for (uint32_t fileIndex = 0; fileIndex < oldIndex.FileCount(); fileIndex++)
+        {
+            oldFiles[oldIndex.FilePath(oldIndex.File(fileIndex))] = fileIndex;
+        }
+    }
+    else if (filesystem::exists(indexPath))
+    {
+        cout << "Warning: rebuilding, " << errorMessage << endl;
+    }
+    
+    // Reuse unchanged files, queue the rest
+    vector<OutlineFile> files(inputPaths.size());
+    vector<size_t> toScan;
+    for (size_t i = 0; i < inputPaths.size(); i++)
+    {
+        OutlineFile& file = files[i];
+        file.path = inputPaths[i];
+        struct stat fileInfo;
+        if (stat(file.path.c_str(), &fileInfo) == 0)
+        {
+            file.sourceSize = (uint64_t)fileInfo.st_size;
+            file.modifiedTime = (int64_t)fileInfo.st_mtim.tv_sec * 1000000000 + fileInfo.st_mtim.tv_nsec;
+        }
+        
+        map<string_view, uint32_t>::const_iterator old = oldFiles.find(file.path);
+        if (old == oldFiles.end() || oldIndex.File(old->second).sourceSize != file.sourceSize ||
+            oldIndex.File(old->second).modifiedTime != file.modifiedTime)
+        {
+            toScan.push_back(i);
+            continue;
+        }
+        const OutlineFileRecord& oldFile = oldIndex.File(old->second);
+        file.lineCount = oldFile.lineCount;
+        for (uint32_t n = 0; n < oldFile.functionCount; n++)
+        {
+            const OutlineFunctionRecord& record = oldIndex.Function(oldFile.firstFunction + n);
+            OutlineFunction function;
+            function.name = string(oldIndex.FunctionName(record));
+            function.signatureOffset = record.signatureOffset;
+            function.signatureLength = record.signatureLength;
+            function.startLine = record.startLine;
+            function.endLine = record.endLine;
+            function.docLine = record.docLine;
+            function.docStatus = (DocStatus)record.docStatus;
+            file.functions.push_back(function);
+        }
+    }
+    
+    int threadCount = options.threadCount;
+    if (threadCount == 0)
+    {
+        threadCount = (int)thread::hardware_concurrency();
+    }
+    if (threadCount > (int)toScan.size())
+    {
+        threadCount = max((int)toScan.size(), 1);
+    }
+    vector<string> errorMessages(inputPaths.size());
+    vector<char> succeeded(inputPaths.size(), 1);
+    CWorkStealingPool pool(threadCount);
+    pool.Run(toScan.size(), [&](size_t scanIndex)
+    {
+        size_t fileIndex = toScan[scanIndex];
+        succeeded[fileIndex] = OutlineSourceFile(files[fileIndex], errorMessages[fileIndex]);
+    });
+    
+    // Files that cannot be read are left out of the index
+    int failedCount = 0;
+    vector<OutlineFile> indexedFiles;
+    size_t functionCount = 0;
+    size_t undocumentedCount = 0;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (!succeeded[i])
+        {
+            cout << "Error: " << errorMessages[i] << endl;
+            failedCount++;
+            continue;
+        }
+        for (const OutlineFunction& function : files[i].functions)
+        {
+            undocumentedCount += (function.docStatus == DOC_STATUS_UNDOCUMENTED) ? 1 : 0;
+        }
+        functionCount += files[i].functions.size();
+        indexedFiles.push_back(std::move(files[i]));
+    }
+    
+    bool written;
+    {
+        TRACE_SPAN("write index", indexPath);
+        written = WriteOutlineIndex(indexPath, indexedFiles);
+    }
+    if (!written)
+    {
+        cout << "Error: Cannot write index " << options.indexPath << endl;
+        return 1;
+    }
+    cout << "Indexed " << indexedFiles.size() << " files (" << toScan.size() << " scanned), "
+         << functionCount << " functions, " << undocumentedCount << " undocumented -> "
+         << options.indexPath << endl;
+    return (failedCount > 0 || !inputErrors.empty()) ? 1 : 0;
+} // RunOutlineMode
+
+
+
+/*
+ * RunQueryMode
+ * This function answers a query from the outline index alone. The
+ * query is "undocumented", "documented" or "all" for a listing, or a
+ * function name, short or qualified. Each match is printed as
+ * "path:first-last: name [status]", first and last being the lines of
+ * the signature and the closing brace.
+ * Input: options [IN] - parsed command line settings
+ * Return: int - returns 0 if something matched, 1 otherwise.
+ *               Side effect: prints the matches.
+ */
+int RunQueryMode(const ProgramOptions& options)
+{
+    static const char* const statusNames[] = { "undocumented", "documented", "generated" };
+    
+    COutlineIndex index;
+    string errorMessage;
+    if (!index.Open(ExpandPath(options.indexPath), errorMessage))
+    {
+        cout << "Error: " << errorMessage << endl;
+        return 1;
+    }
+    
+    const string& query = options.queryText;
+    vector<uint32_t> matches;
+    if (query == "undocumented" || query == "documented" || query == "all")
+    {
+        for (uint32_t i = 0; i < index.FunctionCount(); i++)
+        {
+            uint32_t docStatus = index.Function(i).docStatus;
+            if (query == "all" || (docStatus == DOC_STATUS_UNDOCUMENTED) == (query == "undocumented"))
+            {
+                matches.push_back(i);
+            }
+        }
+    }
+    else
+    {
+        index.FindByName(query, matches);
+    }
+    
+    string report;
+    for (uint32_t functionIndex : matches)
+    {
+        const OutlineFunctionRecord& function = index.Function(functionIndex);
+        report += index.FilePath(index.File(function.fileIndex));
+        report += ":" + to_string(function.startLine);
+        if (function.endLine != 0)
+        {
+            report += "-" + to_string(function.endLine);
+        }
+        report += ": ";
+        report += index.FunctionName(function);
+        report += " [";
+        report += (function.docStatus <= DOC_STATUS_GENERATED) ? statusNames[function.docStatus] : "unknown";
+        report += "]\n";
+    }
+    cout << report << flush;
+    return matches.empty() ? 1 : 0;
+} // RunQueryMode
+
+
+
+/*
+ * RunServeMode
+ * This function runs the generator as a server on a Unix socket, so an
+ * editor can have buffers annotated without starting a process each
+ * time. The default spec, the cache and the parsed request specs stay
+ * loaded; one thread waits on the connections and a pool of threads
+ * answers the requests. Runs until SIGINT or SIGTERM.
+ * Input: options [IN] - parsed command line settings
+ * Return: int - returns 0 after a clean stop, 1 if the server could not
+ *               start. Side effects: creates and removes the socket.
+ */
+int RunServeMode(const ProgramOptions& options)
+{
+    ServeContext context;
+    shared_ptr<AnnotationSpec> defaultSpec = make_shared<AnnotationSpec>();
+    if (!options.specPath.empty() && !LoadAnnotationSpec(ExpandPath(options.specPath), *defaultSpec))
+    {
+        return 1;
+    }
+    context.defaultSpec = defaultSpec;
+    
+    // Lookups only; what requests produce is not stored back
+    CAnnotationCache cache;
+    if (options.useCache)
+    {
+        TRACE_SPAN("load cache");
+        cache.Load(ExpandPath(options.cachePath));
+        context.cache = &cache;
+    }
+    
+    string socketPath = ExpandPath(options.servePath);
+    string errorMessage;
+    int listenDescriptor = OpenServerSocket(socketPath, errorMessage);
+    if (listenDescriptor < 0)
+    {
+        cout << "Error: " << errorMessage << endl;
+        return 1;
+    }
+    
+    // The dispatcher waits on the wake pipe, the listening socket and
+    // the idle connections; none of them may block it
+    if (pipe2(context.wakeDescriptors, O_NONBLOCK | O_CLOEXEC) != 0 ||
+        fcntl(listenDescriptor, F_SETFL, fcntl(listenDescriptor, F_GETFL) | O_NONBLOCK) != 0)
+    {
+        cout << "Error: Cannot set up " << socketPath << ": " << strerror(errno) << endl;
+        close(listenDescriptor);
+        unlink(socketPath.c_str());
+        return 1;
+    }
+    
+    // The stop signals are only taken by sigwait below, never by a worker
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, nullptr);
+    
+    int threadCount = options.threadCount;
+    if (threadCount == 0)
+    {
+        threadCount = max((int)thread::hardware_concurrency(), SERVE_MIN_THREADS);
+    }
+    vector<thread> workers;
+    for (int i = 0; i < threadCount; i++)
+    {
+        workers.push_back(thread(ServeWorker, ref(context)));
+    }
+    thread dispatcher(ServeDispatcher, listenDescriptor, ref(context));
+    cout << "Serving on " << socketPath << " with " << threadCount << " threads" << endl;
+    
+    int signalNumber = 0;
+    sigwait(&stopSignals, &signalNumber);
+    
+    // Wake every thread; a worker finishes the request it is answering
+    {
+        lock_guard<mutex> guard(context.queueLock);
+        context.stopping = true;
+        context.requestReady.notify_all();
+    }
+    char wake = 0;
+    if (write(context.wakeDescriptors[1], &wake, 1) < 0)
+    {
+        // The pipe is full, so the dispatcher is woken already
+    }
+    dispatcher.join();
+    for (thread& worker : workers)
+    {
+        worker.join();
+    }
+    for (const unique_ptr<ServeConnection>& connection : context.ready)
+    {
+        close(connection->descriptor);
+    }
+    for (const unique_ptr<ServeConnection>& connection : context.finished)
+    {
+        close(connection->descriptor);
+    }
+    close(context.wakeDescriptors[0]);
+    close(context.wakeDescriptors[1]);
+    close(listenDescriptor);
+    unlink(socketPath.c_str());
+    pthread_sigmask(SIG_UNBLOCK, &stopSignals, nullptr);
+    cout << "Server stopped" << endl;
+    return 0;
+} // RunServeMode
+
+
+/*
+ * CorpusShape
+ * How a synthetic source file for the benchmark is built.
+ */
+struct CorpusShape
+{
+    const char* name;
+    size_t targetBytes;
+    int statementsPerFunction;    // lower means more functions per line
+    int nestingDepth;             // deepest if/for/while block
+    int ioPercent;                // share of statements that are I/O
+};
+
+
+
+/*
+ * GenerateSyntheticSource
+ * This function writes a made-up but realistic C++ file of about the
+ * requested size. The same shape and seed always give the same text.
+ * Input: shape [IN] - size, function density, nesting and I/O share
+ *        seed [IN] - random seed
+ *        source [OUT] - receives the generated code
+ * Return: void - no return value. No side effects.
+ */
+void GenerateSyntheticSource(const CorpusShape& shape, uint32_t seed, string& source)
+{
+    static const char* const ioLines[] = {
+        "cout << \"Value: \" << value << endl;",
+        "cin >> value;",
+        "getline(cin, name);",
+        "printf(\"%d\\n\", total);",
+        "cout << endl;"
+    };
+    static const char* const plainLines[] = {
+        "int total = value + 1;",
+        "double ratio = total / 2.0;",
+        "string name = \"item\";",
+        "total += Compute(value, ratio);",
+        "bool isDone = (total > 100);",
+        "value = value * 3 + 7;",
+        "char grade = 'A';"
+    };
+    static const char* const controlOpeners[] = {
+        "if (total > value)",
+        "for (int i = 0; i < total; i++)",
+        "while (value < 100)",
+        "switch (grade)"
+    };
+    
+    source.clear();
+    source.reserve(shape.targetBytes + 4096);
+    source += "#include <iostream>\n#include <string>\nusing namespace std;\n\n";
+    
+    // Small xorshift generator, so runs do not depend on the library
+    uint32_t state = seed ? seed : 1;
+    auto nextRandom = [&state](uint32_t limit)
+    {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state % limit;
+    };
+    
+    int functionNumber = 0;
+    while (source.length() < shape.targetBytes)
+    {
+        source += "int Function" + to_string(functionNumber++) + "(int value, double ratio)\n{\n";
+        
+        int depth = 1;
+        for (int statement = 0; statement < shape.statementsPerFunction; statement++)
+        {
+            string indent(depth * 4, ' ');
+            uint32_t roll = nextRandom(100);
+            if (depth <= shape.nestingDepth && roll < 15)
+            {
+                source += indent + controlOpeners[nextRandom(4)] + "\n" + indent + "{\n";
+                depth++;
+            }
+            else if (depth > 1 && roll < 25)
+            {
+                depth--;
+                source += string(depth * 4, ' ') + "}\n";
+            }
+            else if ((int)nextRandom(100) < shape.ioPercent)
+            {
+                source += indent + ioLines[nextRandom(5)] + "\n";
+            }
+            else
+            {
+                source += indent + plainLines[nextRandom(7)] + "\n";
+            }
+        }
+        
+        while (depth > 1)
+        {
+            depth--;
+            source += string(depth * 4, ' ') + "}\n";
+        }
+        source += "    return value;\n}\n\n";
+    }
+} // GenerateSyntheticSource
+
+
+
+/*
+ * BenchmarkResult
+ * Speed of one stage on one corpus.
+ */
+struct BenchmarkResult
+{
+    string corpus;
+    string stage;
+    double bytesPerSecond;
+    double linesPerSecond;
+};
+
+
+
+/*
+ * TimeStage
+ * This function runs a stage several times and keeps the fastest run,
+ * which is the least disturbed by other work on the machine.
+ * Input: stage [IN] - the work to time
+ * Return: double - returns the best time in seconds. Side effect: runs
+ *                  the stage at least three times and for 0.5 seconds.
+ */
+double TimeStage(const function<void()>& stage)
+{
+    double bestSeconds = 1e30;
+    double totalSeconds = 0;
+    for (int run = 0; run < 3 || (totalSeconds < 0.5 && run < 1000); run++)
+    {
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        stage();
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        bestSeconds = min(bestSeconds, seconds);
+        totalSeconds += seconds;
+    }
+    return (bestSeconds > 0) ? bestSeconds : 1e-9;
+} // TimeStage
+
+
+
+/*
+ * BenchmarkCorpus
+ * This function measures scanning, classification, output emission and
+ * full annotation on one synthetic corpus.
+ * Input: shape [IN] - the corpus to generate
+ *        results [IN/OUT] - receives one result per stage
+ * Return: void - no return value. Side effect: writes to /dev/null.
+ */
+void BenchmarkCorpus(const CorpusShape& shape, vector<BenchmarkResult>& results)
+{
+    string source;
+    GenerateSyntheticSource(shape, 12345, source);
+    
+    CArena arena;
+    ArenaVector<LineSpan> lineSpans{ArenaAllocator<LineSpan>(arena)};
+    ScanSourceLines(source.data(), source.length(), lineSpans);
+    vector<char> isFunctionStart(lineSpans.size());
+    for (size_t i = 0; i < lineSpans.size(); i++)
+    {
+        string_view line(source.data() + lineSpans[i].start, lineSpans[i].length);
+        isFunctionStart[i] = IsLikelyFunctionStart(ClassifyLine(line));
+    }
+    
+    int nullDescriptor = open("/dev/null", O_WRONLY);
+    
+    // Full annotation: a header and end comment on every function
+    AnnotationSpec spec;
+    spec.defaults.addComment = true;
+    spec.defaults.addEndComment = true;
+    spec.defaults.description = "Generated function";
+    AnnotationSession session;
+    session.spec = &spec;
+    
+    volatile unsigned sink = 0;
+    double scanSeconds = TimeStage([&]()
+    {
+        ScanSourceLines(source.data(), source.length(), lineSpans);
+    });
+    double classifySeconds = TimeStage([&]()
+    {
+        unsigned features = 0;
+        for (const LineSpan& span : lineSpans)
+        {
+            features ^= ClassifyLine(string_view(source.data() + span.start, span.length));
+        }
+        sink = features;
+    });
+    double emitSeconds = TimeStage([&]()
+    {
+        COutputWriter output(nullDescriptor);
+        for (size_t i = 0; i < lineSpans.size(); i++)
+        {
+            if (isFunctionStart[i])
+            {
+                CreateFunctionHeader(output, DEFAULT_COMMENT_STYLE, "Function", "Generated function", "value [IN] -- input", "");
+            }
+            WriteSourceLine(output, source.data(), source.length(), lineSpans[i]);
+        }
+        output.Flush();
+    });
+    double annotateSeconds = TimeStage([&]()
+    {
+        COutputWriter output(nullDescriptor);
+        AnnotateSource(source.data(), source.length(), output, session, "");
+        output.Flush();
+    });
+    (void)sink;
+    close(nullDescriptor);
+    
+    const char* stages[] = {"scan", "classify", "emit", "annotate"};
+    double seconds[] = {scanSeconds, classifySeconds, emitSeconds, annotateSeconds};
+    for (int i = 0; i < 4; i++)
+    {
+        BenchmarkResult result;
+        result.corpus = shape.name;
+        result.stage = stages[i];
+        result.bytesPerSecond = source.length() / seconds[i];
+        result.linesPerSecond = lineSpans.size() / seconds[i];
+        results.push_back(result);
+    }
+} // BenchmarkCorpus
+
+
+
+/*
+ * RunBenchmark
+ * This function benchmarks every stage on a set of synthetic corpora,
+ * from a small file up to one large amalgamation, and prints MB/s and
+ * lines/s. Results can be saved as a baseline, or compared against one,
+ * in which case a stage that got slower than the tolerance fails.
+ * Input: largeMegabytes [IN] - size of the large corpus in MB
+ *        baselinePath [IN] - baseline to compare with, or empty
+ *        savePath [IN] - file to save results to, or empty
+ *        tolerancePercent [IN] - allowed slowdown against the baseline
+ * Return: int - returns 0 if nothing regressed, 1 otherwise.
+ *               Side effects: prints a table, may write savePath.
+ */
+int RunBenchmark(int largeMegabytes, const string& baselinePath, const string& savePath,
+                 int tolerancePercent)
+{
+    const CorpusShape shapes[] = {
+        {"small", 64 * 1024, 20, 2, 10},
+        {"dense", 8 << 20, 4, 1, 30},
+        {"deep", 8 << 20, 40, 6, 5},
+        {"large", (size_t)largeMegabytes << 20, 12, 3, 15}
+    };
+    
+    vector<BenchmarkResult> results;
+    for (const CorpusShape& shape : shapes)
+    {
+        BenchmarkCorpus(shape, results);
+    }
+    
+    // Baseline lines are "corpus stage bytesPerSecond linesPerSecond"
+    map<string, double> baseline;
+    if (!baselinePath.empty())
+    {
+        ifstream baselineFile(baselinePath);
+        if (!baselineFile.is_open())
+        {
+            cout << "Error: Cannot open baseline " << baselinePath << endl;
+            return 1;
+        }
+        string corpus;
+        string stage;
+        double bytesPerSecond;
+        double linesPerSecond;
+        while (baselineFile >> corpus >> stage >> bytesPerSecond >> linesPerSecond)
+        {
+            baseline[corpus + " " + stage] = bytesPerSecond;
+        }
+    }
+    
+    int regressions = 0;
+    cout << "corpus   stage          MB/s    Mlines/s   vs baseline" << endl;
+    for (const BenchmarkResult& result : results)
+    {
+        char row[128];
+        snprintf(row, sizeof(row), "%-8s %-9s %9.1f %11.2f", result.corpus.c_str(),
+                 result.stage.c_str(), result.bytesPerSecond / 1e6, result.linesPerSecond / 1e6);
+        cout << row;
+        
+        map<string, double>::const_iterator expected = baseline.find(result.corpus + " " + result.stage);
+        if (expected != baseline.end())
+        {
+            double change = (result.bytesPerSecond / expected->second - 1) * 100;
+            snprintf(row, sizeof(row), "   %+6.1f%%", change);
+            cout << row;
+            if (change < -tolerancePercent)
+            {
+                cout << "  REGRESSION";
+                regressions++;
+            }
+        }
+        cout << endl;
+    }
+    
+    if (!savePath.empty())
+    {
+        ofstream saveFile(savePath);
+        for (const BenchmarkResult& result : results)
+        {
+            saveFile << result.corpus << " " << result.stage << " "
+                     << (long long)result.bytesPerSecond << " " << (long long)result.linesPerSecond << "\n";
+        }
+        if (!saveFile)
+        {
+            cout << "Error: Cannot write baseline " << savePath << endl;
+            return 1;
+        }
+    }
+    
+    if (regressions > 0)
+    {
+        cout << regressions << " stage(s) slower than the baseline by more than "
+             << tolerancePercent << "%" << endl;
+        return 1;
+    }
+    return 0;
+} // RunBenchmark
+
+
+
+/*
+ * RunInteractiveMode
+ * This function asks for a file and every comment, one prompt at a time.
+ * Tracks function depth to only ask about function-level closing braces.
+ * Input: options [IN] - parsed command line settings
+ * Return: int - returns 0 for successful completion, 1 for file errors.
+ *               Side effects: creates output file, displays user interface.
+ */
+int RunInteractiveMode(const ProgramOptions& options)
+{
+    cout << "// ============================================================================" << endl;
+    cout << "// Enhanced C++ Comment Generator" << endl;
+    cout << "// ============================================================================" << endl;
+    cout << endl;
+    
+    // Get and validate input file path
+    string inputFilePath = GetValidFilePath();
+    
+    // Get output filename
+    string outputFileName;
+    cout << "Enter output filename (or press Enter for default): ";
+    ReadAnswer(outputFileName);
+    
+    if (outputFileName.empty())
+    {
+        outputFileName = DefaultOutputPath(inputFilePath);
+    }
+    
+    // Open the input first, a file that has a header needs no new one
+    COUNT_STAT(STAT_FILES, 1);
+    CMappedFile inputFile;
+    string errorMessage;
+    if (!inputFile.Open(inputFilePath, errorMessage))
+    {
+        cout << "Error: Cannot open " << inputFilePath << endl;
+        return 1;
+    }
+    bool hasFileHeader = HasFileHeader(inputFile.Data(), inputFile.Size(), DEFAULT_COMMENT_STYLE);
+    
+    // Scan the whole file while the header questions are answered, so
+    // every site is known, and counted, before the first one is asked
+    CArena documentArena;
+    SourceDocument document(documentArena, inputFile.Data(), inputFile.Size());
+    thread scanner([&]()
+    {
+        LexerState lexerState;
+        ScopeState scopeState;
+        BuildDocument(document, lexerState, scopeState, inputFilePath);
+    });
+    
+    // Get header information
+    string currentDate;
+    string projectName;
+    string programDescription;
+    
+    if (!hasFileHeader)
+    {
+        cout << endl << "File header information:" << endl;
+        cout << "Today's date (MM/DD/YYYY): ";
+        ReadAnswer(currentDate);
+        
+        cout << "Project name: ";
+        ReadAnswer(projectName);
+        
+        cout << "Program description: ";
+        ReadAnswer(programDescription);
+    }
+    {
+        TRACE_SPAN("wait for scan");
+        scanner.join();
+    }
+    
+    // Open the output, never over the mapped input
+    if (IsSameFile(inputFilePath, outputFileName))
+    {
+        cout << "Error: Cannot write " << outputFileName << " over its own input" << endl;
+        return 1;
+    }
+    int outputDescriptor = open(outputFileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (outputDescriptor < 0)
+    {
+        cout << "Error: Cannot create " << outputFileName << endl;
+        return 1;
+    }
+    COutputWriter output(outputDescriptor);
+    
+    // Create file header
+    if (!hasFileHeader)
+    {
+        CreateFileHeader(output, DEFAULT_COMMENT_STYLE, inputFilePath, currentDate, projectName,
+                         programDescription);
+    }
+    
+    // Process file line by line with smart brace tracking
+    size_t functionCount = 0;
+    for (const DocumentSite& site : document.sites)
+    {
+        functionCount += IsFunctionDefinition(site.features) ? 1 : 0;
+    }
+    cout << endl << "Processing your code: " << functionCount << " functions and "
+         << document.sites.size() - functionCount << " statements to review..." << endl << endl;
+    CAnnotationCache cache;
+    AnnotationSession session;
+    session.reusePolicy = options.reusePolicy;
+    if (options.useCache)
+    {
+        TRACE_SPAN("load cache");
+        cache.Load(ExpandPath(options.cachePath));
+        session.cache = &cache;
+    }
+    AnnotateDocument(document, output, session, CacheKeyPath(inputFilePath));
+    
+    // Write everything out and close the file
+    bool written;
+    {
+        TRACE_SPAN("write output", outputFileName);
+        written = output.Flush();
+    }
+    if (close(outputDescriptor) != 0 || !written)
+    {
+        cout << "Error: Cannot write " << outputFileName << endl;
+        return 1;
+    }
+    if (options.useCache && !cache.Save(ExpandPath(options.cachePath)))
+    {
+        cout << "Warning: cannot write cache " << options.cachePath << endl;
+    }
+    
+    cout << endl << "Done! Commented code saved as: " << outputFileName << endl;
+    cout << "// ============================================================================" << endl;
+    
+    return 0;
+} // RunInteractiveMode
+
+
+
+
+/*
+ * main
+ * This function is the main program entry point.
+ * Runs batch mode when given a spec, otherwise asks for everything.
+ * Input: argc [IN] - number of command line arguments
+ *        argv [IN] - the command line arguments
+ * Return: int - returns 0 for successful completion, 1 for file errors.
+ *               Side effects: creates output file, displays user interface.
+ */
+int main(int argc, char* argv[])
+{
+    ProgramOptions options;
+    if (!ParseCommandLine(argc, argv, options))
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+    if (options.showHelp)
+    {
+        PrintUsage(argv[0]);
+        return 0;
+    }
+    if (options.runBenchmark)
+    {
+        return RunBenchmark(options.benchMegabytes, ExpandPath(options.benchBaseline),
+                            ExpandPath(options.benchSave), options.benchTolerance);
+    }
+    
+#ifndef CG_NO_TRACE
+    g_traceEnabled = !options.tracePath.empty();
+#endif
+    // Stdout carries the annotated source in filter mode, or the diff
+    streambuf* consoleBuffer = cout.rdbuf();
+    if (options.filterMode || options.diffPath == "-")
+    {
+        cout.rdbuf(cerr.rdbuf());
+    }
+    
+    int result = !options.servePath.empty() ? RunServeMode(options)
+                 : options.outlineMode ? RunOutlineMode(options)
+                 : !options.queryText.empty() ? RunQueryMode(options)
+                 : options.filterMode ? RunFilterMode(options)
+                 : options.specPath.empty() ? RunInteractiveMode(options) : RunBatchMode(options);
+    
+#ifndef CG_NO_TRACE
+    if (options.showStats)
+    {
+        cout << FormatStatsSummary() << endl;
+    }
+    if (!options.tracePath.empty() && !WriteChromeTrace(ExpandPath(options.tracePath)))
+    {
+        cout << "Error: Cannot write trace " << options.tracePath << endl;
+        result = 1;
+    }
+#else
+    if (options.showStats || !options.tracePath.empty())
+    {
+        cout << "Warning: built with CG_NO_TRACE, no stats or trace" << endl;
+    }
+#endif
+    cout.rdbuf(consoleBuffer);
+    return result;
 } // main
@@ -0,0 +1,46 @@
+#include <iostream>
+#include <string>
+#include <vector>
+using namespace std;
+
+int SumValues(vector<int> values = {})
+{
+    int sum = 0;
+    for (int value : values)
+    {
+        sum += value;
+    }
+    return sum;
+}
+
+int Twice(int x = int{3})
+{
+    return x * 2;
+}
+
+void PrintPair(int first = {}, int second = int{1})
+{
+    cout << first << ", " << second << endl;
+}
+
+string Label(const string& name,
+             int count = 1)
+{
+    return name + " x" + to_string(count);
+}
+
+template <typename T>
+T Larger(T first, T second = T{})
+{
+    return (first > second) ? first : second;
+}
+
+int main()
+{
+    cout << SumValues({1, 2, 3}) << endl;
+    cout << Twice() << endl;
+    PrintPair();
+    cout << Larger(4) << endl;
+    cout << Label("apple") << endl;
+    return 0;
+}